@@ -4,58 +4,360 @@
 //
 // TODO: it seems like this should be entirely unnecessary. fix?
 
-import java.io.File;
-import java.io.FileOutputStream;
 import java.io.IOException;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLongArray;
 
 public class Heapster {
-  private static native byte[] _dumpProfile(boolean forceGC);
-  private static native void _newObject(Object thread, Object o);
+  private static native byte[] _dumpProfile(
+      boolean forceGC, boolean lifetime, boolean proto);
+  private static native byte[] _dumpProfileDelta(int since);
+  private static native boolean _writeProfile(
+      String path, boolean forceGC, boolean lifetime, boolean proto);
+  private static native long _newObject(Object thread, Object o);
+  private static native long _nextSamplingPoint();
+  private static native long _objectSize(Object o);
+  private static native long _newAllocation(Object thread, int site, long size);
+  private static native boolean _handOver(Object thread, Object o);
+  private static native int _siteSize(int site);
   private static native void _clearProfile();
   private static native void _setSamplingPeriod(int period);
+  private static native void _setProfiling(boolean on);
+  private static native String _stackWalker();
 
   public static volatile int isReady = 0;
   public static volatile boolean isProfiling = false;
 
+  // Size estimates used for the sampling decision. These are
+  // measured and set by the agent when the VM is initialized.
+  public static int objectSize = 16;
+  public static int arrayHeaderSize = 16;
+  public static int referenceSize = 4;
+  public static int objectAlignment = 8;
+
+  // Instance sizes by class, filled in on first sight of a class.
+  // This is a direct-mapped cache, keyed by the class's identity hash
+  // so that it keeps no class (or its loader) from being unloaded;
+  // each entry packs the hash with the size. A collision costs
+  // another call to _objectSize, and classes sharing a hash at worst
+  // a misestimate.
+  private static final int SIZE_CACHE_SIZE = 4096;
+  private static final long[] sizeCache = new long[SIZE_CACHE_SIZE];
+
+  // With the tick injection, allocations are identified by a site
+  // number; this holds the instance size (or element size, for
+  // arrays) allocated by site, filled in on first use. It grows to
+  // hold every site; a racing update lost to growth is redone.
+  private static volatile int[] siteSizes = new int[1 << 16];
+
+  // The number of bytes left until the next sampling point. We're
+  // called from Object.<init>, so we can't use a ThreadLocal here
+  // (it may allocate); instead, countdowns are striped by thread id,
+  // one per cache line. Threads that share a stripe merely share a
+  // sampling stream.
+  private static final int STRIPE_SHIFT = 3;
+  private static final int NUM_STRIPES = 256;
+  private static final long[] bytesUntilSample =
+    new long[NUM_STRIPES << STRIPE_SHIFT];
+
+  // With the tick injection, a sampled allocation's object is handed
+  // over once constructed, so that the agent can track it until it's
+  // freed. A sample leaves its stripe awaiting the object: the count
+  // here is one more than the objects handed over for it so far, of
+  // which the agent takes the first of the sampled type. Objects are
+  // constructed everywhere, so they first check only how many
+  // stripes are awaiting, which is nearly always none.
+  private static final int MAX_HAND_OVERS = 16;
+  private static final AtomicLongArray awaiting =
+    new AtomicLongArray(NUM_STRIPES << STRIPE_SHIFT);
+  private static final AtomicInteger stripesAwaiting = new AtomicInteger();
+
+  // Exact allocation counts by site, kept with HEAPSTER_COUNT=exact
+  // in addition to sampling. Each counter row holds a site's objects
+  // and bytes; rows are striped by thread id, with stripes far enough
+  // apart that threads in different stripes don't share cache lines.
+  // Sites are counted in chunks, added as sites are numbered; chunks
+  // are never moved, so growing loses no counts.
+  public static boolean isCounting = false;
+  private static final int COUNTER_STRIPES = 8;
+  private static final int COUNTED_CHUNK_SHIFT = 10;
+  private static final int COUNTED_CHUNK_SITES = 1 << COUNTED_CHUNK_SHIFT;
+  private static volatile AtomicLongArray[] siteCounts =
+    new AtomicLongArray[0];
+
+  public static void startCounting() {
+    isCounting = true;
+  }
+
+  private static synchronized AtomicLongArray[] growSiteCounts(int site) {
+    AtomicLongArray[] chunks = siteCounts;
+    int nchunks = (site >>> COUNTED_CHUNK_SHIFT) + 1;
+    if (nchunks <= chunks.length)
+      return chunks;
+
+    AtomicLongArray[] grown = new AtomicLongArray[nchunks];
+    System.arraycopy(chunks, 0, grown, 0, chunks.length);
+    for (int i = chunks.length; i < nchunks; i++)
+      grown[i] = new AtomicLongArray(2 * COUNTER_STRIPES * COUNTED_CHUNK_SITES);
+    siteCounts = grown;
+    return grown;
+  }
+
+  // The counts, summed over stripes, as read by the agent.
+  public static long[] siteCounts() {
+    AtomicLongArray[] chunks = siteCounts;
+    long[] counts = new long[2 * COUNTED_CHUNK_SITES * chunks.length];
+    for (int c = 0; c < chunks.length; c++) {
+      int base = 2 * COUNTED_CHUNK_SITES * c;
+      for (int i = 0; i < chunks[c].length(); i++)
+        counts[base + i % (2 * COUNTED_CHUNK_SITES)] += chunks[c].get(i);
+    }
+
+    return counts;
+  }
+
   public static void start() {
+    seedSampler();
     isProfiling = true;
+    _setProfiling(true);
   }
 
   public static void stop() {
     isProfiling = false;
+    _setProfiling(false);
   }
 
   public static void clearProfile() {
     _clearProfile();
+
+    AtomicLongArray[] chunks = siteCounts;
+    for (int c = 0; c < chunks.length; c++) {
+      for (int i = 0; i < chunks[c].length(); i++)
+        chunks[c].set(i, 0);
+    }
+  }
+
+  // "asgct" or "jvmti", whichever the agent walks stacks with.
+  public static String stackWalker() {
+    return _stackWalker();
   }
 
   public static void setSamplingPeriod(java.lang.Integer period) {
     _setSamplingPeriod(period);
+    seedSampler();
   }
 
   public static void newObject(Object obj) {
     if (!isProfiling)
       return;
 
-    // TODO: can we get a hold of the sizes here?  if so, we could do
-    // the sampling here & never leave bytecode execution.
+    Thread thread = Thread.currentThread();
+    if (isReady != 1 || thread == null)
+      return;
+
+    // Only allocations that cross a sampling point leave bytecode;
+    // the agent hands back the distance to the next one.
+    int stripe = ((int)thread.getId() & (NUM_STRIPES - 1)) << STRIPE_SHIFT;
+    long left = bytesUntilSample[stripe] - sizeOf(obj);
+    if (left >= 0)
+      bytesUntilSample[stripe] = left;
+    else
+      bytesUntilSample[stripe] = _newObject(thread, obj);
+  }
+
+  // The tick injection calls these at allocation sites instead of
+  // handing over every new object, which keeps those objects from
+  // escaping (and the injected bytecode small). The common path stays
+  // within allocate(); only sampled allocations cross into the agent,
+  // and only their objects are handed over, by constructed().
+  public static void newInstance(int siteHigh, int siteLow) {
+    if (isProfiling)
+      allocate(siteHigh << 15 | siteLow, -1);
+  }
 
+  public static void newArray(int length, int siteHigh, int siteLow) {
+    if (isProfiling)
+      allocate(siteHigh << 15 | siteLow, length);
+  }
+
+  private static void allocate(int site, int length) {
     Thread thread = Thread.currentThread();
-    if (isReady == 1 && thread != null)
-      _newObject(thread, obj);
+    if (isReady != 1 || thread == null)
+      return;
+
+    long size = siteSize(site, length);
+    if (isCounting)
+      count(thread, site, size);
+
+    int stripe = ((int)thread.getId() & (NUM_STRIPES - 1)) << STRIPE_SHIFT;
+    long left = bytesUntilSample[stripe] - size;
+    if (left >= 0) {
+      bytesUntilSample[stripe] = left;
+    } else {
+      bytesUntilSample[stripe] = _newAllocation(thread, site, size);
+      if (awaiting.getAndSet(stripe, 1) == 0)
+        stripesAwaiting.incrementAndGet();
+    }
+  }
+
+  // Called by the tick injection from Object.<init> and after array
+  // allocations. The object only escapes on the slow path, which the
+  // JIT can leave out of compiled code until it's first taken.
+  public static void constructed(Object obj) {
+    if (stripesAwaiting.get() != 0)
+      handOver(obj);
+  }
+
+  private static void handOver(Object obj) {
+    Thread thread = Thread.currentThread();
+    if (isReady != 1 || thread == null)
+      return;
+
+    int stripe = ((int)thread.getId() & (NUM_STRIPES - 1)) << STRIPE_SHIFT;
+    long tries = awaiting.get(stripe);
+    if (tries == 0)
+      return;
+
+    // Another thread may share the stripe, so we give up after a few
+    // objects in any case.
+    if (!_handOver(thread, obj) && tries < MAX_HAND_OVERS)
+      awaiting.compareAndSet(stripe, tries, tries + 1);
+    else if (awaiting.compareAndSet(stripe, tries, 0))
+      stripesAwaiting.decrementAndGet();
+  }
+
+  private static void count(Thread thread, int site, long size) {
+    AtomicLongArray[] chunks = siteCounts;
+    if ((site >>> COUNTED_CHUNK_SHIFT) >= chunks.length)
+      chunks = growSiteCounts(site);
+
+    AtomicLongArray chunk = chunks[site >>> COUNTED_CHUNK_SHIFT];
+    int stripe = (int)thread.getId() & (COUNTER_STRIPES - 1);
+    int row = 2 * (stripe * COUNTED_CHUNK_SITES + (site & (COUNTED_CHUNK_SITES - 1)));
+    chunk.incrementAndGet(row);
+    chunk.addAndGet(row + 1, size);
+  }
+
+  private static long siteSize(int site, int length) {
+    int[] sizes = siteSizes;
+    if (site >= sizes.length)
+      sizes = growSiteSizes(site);
+
+    int size = sizes[site];
+    if (size == 0) {
+      // Instance ticks follow their new, so the class is prepared by
+      // now: a size the agent doesn't know, it never will.
+      size = _siteSize(site);
+      if (size == 0)
+        size = length < 0 ? objectSize : referenceSize;
+      sizes[site] = size;
+    }
+
+    return length < 0 ? size : arraySize(length, size);
+  }
+
+  private static synchronized int[] growSiteSizes(int site) {
+    int[] sizes = siteSizes;
+    if (site < sizes.length)
+      return sizes;
+
+    int length = sizes.length;
+    while (length <= site)
+      length <<= 1;
+
+    int[] grown = new int[length];
+    System.arraycopy(sizes, 0, grown, 0, sizes.length);
+    siteSizes = grown;
+    return grown;
+  }
+
+  private static void seedSampler() {
+    for (int i = 0; i < NUM_STRIPES; i++)
+      bytesUntilSample[i << STRIPE_SHIFT] = _nextSamplingPoint();
+  }
+
+  private static long sizeOf(Object obj) {
+    Class klass = obj.getClass();
+    if (!klass.isArray())
+      return instanceSize(klass, obj);
+
+    if (obj instanceof Object[])
+      return arraySize(((Object[])obj).length, referenceSize);
+    if (obj instanceof byte[])
+      return arraySize(((byte[])obj).length, 1);
+    if (obj instanceof boolean[])
+      return arraySize(((boolean[])obj).length, 1);
+    if (obj instanceof char[])
+      return arraySize(((char[])obj).length, 2);
+    if (obj instanceof short[])
+      return arraySize(((short[])obj).length, 2);
+    if (obj instanceof int[])
+      return arraySize(((int[])obj).length, 4);
+    if (obj instanceof float[])
+      return arraySize(((float[])obj).length, 4);
+    if (obj instanceof long[])
+      return arraySize(((long[])obj).length, 8);
+    if (obj instanceof double[])
+      return arraySize(((double[])obj).length, 8);
+
+    return objectSize;
+  }
+
+  private static long instanceSize(Class klass, Object obj) {
+    int hash = System.identityHashCode(klass);
+    int slot = hash & (SIZE_CACHE_SIZE - 1);
+    long entry = sizeCache[slot];
+    if ((int)(entry >>> 32) == hash && (int)entry != 0)
+      return (int)entry;
+
+    int size = (int)_objectSize(obj);
+    sizeCache[slot] = (long)hash << 32 | (size & 0xffffffffL);
+    return size;
+  }
+
+  private static long arraySize(int length, int elementSize) {
+    long size = arrayHeaderSize + (long)length * elementSize;
+    return (size + objectAlignment - 1) & -objectAlignment;
   }
 
   public static byte[] dumpProfile(java.lang.Boolean forceGC) {
-    return _dumpProfile(forceGC);
+    return _dumpProfile(forceGC, false, false);
+  }
+
+  // With proto set, the profile is a gzipped profile.proto, as read
+  // by (Go's) pprof, rather than in the perftools format.
+  public static byte[] dumpProfile(
+      java.lang.Boolean forceGC, java.lang.Boolean proto) {
+    return _dumpProfile(forceGC, false, proto);
   }
 
+  // Like dumpProfile, but counts allocations since the start rather
+  // than since the profile was last cleared.
+  public static byte[] dumpLifetimeProfile(java.lang.Boolean forceGC) {
+    return _dumpProfile(forceGC, true, false);
+  }
+
+  // The sites and symbols that changed since the given delta dump
+  // (0 for all of them). Each delta names its own dump id in its
+  // "dump:" line, to be passed as "since" to the next; heapster-merge
+  // folds a chain of deltas back into a full profile.
+  public static byte[] dumpProfileDelta(int since) {
+    return _dumpProfileDelta(since);
+  }
+
+  // Streams the profile straight to the file, without holding all
+  // of it in memory.
   public static void dumpProfileToFile(
       String path, boolean forceGC)
       throws IOException {
-    File file = new File(path);
-    FileOutputStream stream = new FileOutputStream(file);
-    stream.write(dumpProfile(forceGC));
-    stream.close();
+    dumpProfileToFile(path, forceGC, false);
+  }
+
+  public static void dumpProfileToFile(
+      String path, boolean forceGC, boolean proto)
+      throws IOException {
+    if (!_writeProfile(path, forceGC, false, proto))
+      throw new IOException("Failed to write profile to " + path);
   }
 
 }
\ No newline at end of file
@@ -4,21 +4,38 @@
 // Author: marius a. eriksen <marius@monkey.org>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <string>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <jvmti.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dlfcn.h>
 #include "java_crw_demo.h"
 
+#include <algorithm>
+#include <new>
+#include <deque>
 #include <set>
 #include <map>
+#include <vector>
 
+#include "heapster_events.h"
+#include "heapster_rings.h"
+#include "heapster_shm.h"
+#include "heapster_sites.h"
 #include "sampler.h"
 #include "util.h"
 
@@ -52,40 +69,6 @@ void errx(int code, const char* fmt, ...) {
   exit(code);
 }
 
-// Bogarted from various OpenBSD.
-size_t AtomicIO(ssize_t (*f)(int, const void*, size_t),
-                int fd, const void* _s, size_t n) {
-  const char* s = reinterpret_cast<const char*>(_s);
-  size_t pos = 0;
-  ssize_t res;
-
-  while (n > pos) {
-    res = (f) (fd, s + pos, n - pos);
-    switch (res) {
-      case -1:
-        if (errno == EINTR || errno == EAGAIN)
-          continue;
-        return 0;
-
-    case 0:
-        errno = EPIPE;
-        return pos;
-
-    default:
-        pos += (u_int)res;
-    }
-  }
-
-  return pos;
-}
-
-void AtomicWrite(int fd, const char* buf, int n) {
- if (AtomicIO(write, fd, (const void*)buf, n) != (size_t)n) {
-   perror("AtomicWrite");
-   exit(1);
- }
-}
-
 class Monitor {
  public:
   inline explicit Monitor(jvmtiEnv* jvmti, const char* descr)
@@ -106,6 +89,11 @@ class Monitor {
     return raw_monitor_;
   }
 
+  // Must be called with the monitor held.
+  void Wait(jlong millis) {
+    jvmti_->RawMonitorWait(raw_monitor_, millis);
+  }
+
  private:
   jvmtiEnv* jvmti_;
   jrawMonitorID raw_monitor_;
@@ -141,50 +129,181 @@ class Lock {
   jrawMonitorID monitor_;
 };
 
-#define HELPER_CLASS "Heapster"
-#define HELPER_FIELD_ISREADY "isReady"
-#define HELPER_FIELD_ISPROFILING "isProfiling"
+// The calling thread's free buffer, if it has reported frees.
+static __thread FreeBuffer* thread_free_buffer = NULL;
 
-class Heapster {
- public:
-  static const uint32_t kHashTableSize;
-  static const uint32_t kMaxStackFrames;
+// The calling thread's event buffer, if it has logged events.
+static __thread EventBuffer* thread_event_buffer = NULL;
+
+// In tick injection mode, the tag of the thread's last sampled
+// allocation, until its object is handed over; see Heapster::HandOver.
+struct PendingObject {
+  jlong    tag;  // 0 if none is pending.
+  jint     site;
+  uint32_t misses;
+};
 
-  struct Site {
-    Site(Site* _next , long _hash, int _nframes, jvmtiFrameInfo* frames)
-        : next(_next), hash(_hash), active(true),
-          nframes(_nframes), stack(new jmethodID[_nframes]),
-          num_allocs(0), num_bytes(0) {
-      for (int i = 0; i < nframes; ++i)
-        stack[i] = frames[i].method;
+static __thread PendingObject pending_object = {0, 0, 0};
+
+// A count-min sketch of counts by stack hash. Estimates are never
+// low, and, but for a chance of e^-kDepth, too high by at most
+// e/kWidth of the total count.
+struct CountMinSketch {
+  static const uint32_t kDepth = 4;
+  static const uint32_t kWidth = 1 << 12;
+
+  // Adds n to the count, and returns its new estimate.
+  jlong Add(long h, jlong n) {
+    jlong estimate = 0;
+    for (uint32_t i = 0; i < kDepth; ++i) {
+      const jlong c = __sync_add_and_fetch(&counts[i][Slot(h, i)], n);
+      if (i == 0 || c < estimate)
+        estimate = c;
     }
+    return estimate;
+  }
 
-    ~Site() {
-      delete[] stack;
+  jlong Estimate(long h) const {
+    jlong estimate = 0;
+    for (uint32_t i = 0; i < kDepth; ++i) {
+      const jlong c = counts[i][Slot(h, i)];
+      if (i == 0 || c < estimate)
+        estimate = c;
     }
+    return estimate;
+  }
 
-    Site(const Site& _other)
-        : next(NULL), hash(_other.hash), active(_other.active),
-          nframes(_other.nframes), stack(new jmethodID[_other.nframes]),
-          num_allocs(_other.num_allocs), num_bytes(_other.num_bytes) {
-      for (int i = 0; i < nframes; ++i) {
-        stack[i] = _other.stack[i];
-      }
+  // Rows hash independently enough for us by mixing in the row.
+  static uint32_t Slot(long h, uint32_t row) {
+    uint64_t x = static_cast<uint64_t>(h) + (row + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<uint32_t>(x >> 32) & (kWidth - 1);
+  }
+
+  volatile jlong counts[kDepth][kWidth];
+};
+
+// AsyncGetCallTrace is exported by HotSpot, but not declared in any
+// of its headers.
+struct ASGCT_CallFrame {
+  jint      lineno;     // The bci, or negative for native frames.
+  jmethodID method_id;
+};
+
+struct ASGCT_CallTrace {
+  JNIEnv*          env_id;
+  jint             num_frames;  // Negative on failure.
+  ASGCT_CallFrame* frames;
+};
+
+typedef void (*AsyncGetCallTraceFunc)(ASGCT_CallTrace*, jint, void*);
+
+// Collects a profile in chunks, for copying into a Java array once
+// the locks it was written under are released.
+class ChunkSink : public Sink {
+ public:
+  ChunkSink() : size_(0) {}
+
+  virtual bool Write(const char* data, size_t n) {
+    chunks_.push_back(string(data, n));
+    size_ += n;
+    return true;
+  }
+
+  // Copies the profile into a new array, releasing chunks as it
+  // goes.
+  jbyteArray ToByteArray(JNIEnv* env) {
+    jbyteArray buf = env->NewByteArray(size_);
+    if (buf == NULL)
+      return NULL;
+
+    size_t pos = 0;
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      env->SetByteArrayRegion(buf, pos, chunks_[i].size(),
+                              (const jbyte*)chunks_[i].data());
+      pos += chunks_[i].size();
+      string().swap(chunks_[i]);
     }
 
-    Site*      next;
-    long       hash;
-    bool       active;
+    return buf;
+  }
+
+ private:
+  vector<string> chunks_;
+  size_t         size_;
+};
+
+// Methods stand in for addresses in profiles.
+#ifdef __x86_64
+#define FRAME_FORMAT "0x%016lx"
+#else
+#define FRAME_FORMAT "0x%08lx"
+#endif
+
+#define HELPER_CLASS "Heapster"
+#define HELPER_FIELD_ISREADY "isReady"
+#define HELPER_FIELD_ISPROFILING "isProfiling"
+#define HELPER_FIELD_OBJECTSIZE "objectSize"
+#define HELPER_FIELD_ARRAYHEADERSIZE "arrayHeaderSize"
+#define HELPER_FIELD_REFERENCESIZE "referenceSize"
+#define HELPER_FIELD_OBJECTALIGNMENT "objectAlignment"
+#define HELPER_METHOD_START "start"
+#define HELPER_METHOD_STOP "stop"
+#define HELPER_METHOD_CLEARPROFILE "clearProfile"
+#define HELPER_METHOD_SEEDSAMPLER "seedSampler"
+#define HELPER_METHOD_STARTCOUNTING "startCounting"
+#define HELPER_METHOD_SITECOUNTS "siteCounts"
 
-    int        nframes;
-    jmethodID* stack;
+class Heapster {
+ public:
+  static const uint32_t kInitialSiteTableSize;
+  static const uint32_t kMaxStackFrames;
+  static const uint32_t kMaxSkipFrames;
+  static const jlong kFreeDrainPeriodMillis;
+  static const jlong kFreeQuietMillis;
+  static const jlong kFreeSettleMillis;
+  static const jlong kClientTimeoutMillis;
+  static const jlong kAcceptBackoffMillis;
+  static const jlong kAdmitSamples;
+  static const uint32_t kMaxHandOvers;
+
+  // Stands for the frames of stacks folded away; see AdmitSite.
+  static const jmethodID kOtherFrame;
+
+  typedef ::SiteTable<jmethodID> SiteTable;
+  typedef SiteTable::Site Site;
+
+  // A site's counts as of a dump.
+  struct SiteSnapshot {
+    const Site* site;
+    long long   inuse_objects;
+    long long   inuse_bytes;
+    long long   alloc_objects;
+    long long   alloc_bytes;
+  };
 
-    // Stats.
-    int num_allocs;
-    int num_bytes;
+  // A method's name ("Lfoo/Bar;baz"), and where it's from.
+  struct NamedMethod {
+    NamedMethod() : dump(0), line(0), logged(false) {}
+    NamedMethod(const string& _name, uint32_t _dump)
+        : name(_name), dump(_dump), line(0), logged(false) {}
+
+    string   name;
+    uint32_t dump;    // The next delta dump's id when it was named.
+    string   file;    // Of the source; empty if unknown.
+    jint     line;    // Of the method's start; 0 if unknown.
+    bool     logged;  // In the event log.
   };
 
-  typedef pair<Site*, int> Allocation;
+  // Sampled objects are tagged as laid out in heapster_sites.h.
+  // Classes whose methods we've named are tagged too, with bit 63
+  // set, the index of their signature, and bit 62 once their type is
+  // in the event log.
+  static const jlong    kTagClass      = 1ULL << 63;
+  static const jlong    kTagClassLogged = 1ULL << 62;
+  static const jlong    kTagClassIndex = kTagClassLogged - 1;
+  static const uint32_t kSiteChunkSize = 1 << 12;
 
   static Heapster* instance;
 
@@ -201,10 +320,54 @@ class Heapster {
     instance->VMDeath(env);
   }
 
+  static void JNICALL JVMTI_ThreadEnd(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+    instance->ThreadEnd(thread);
+  }
+
   static void JNICALL JVMTI_ObjectFree(jvmtiEnv* jvmti, jlong tag) {
     instance->ObjectFree(tag);
   }
 
+  static void JNICALL JVMTI_FreeDrainer(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    instance->DrainFreesForever();
+  }
+
+  static void JNICALL JVMTI_Dumper(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    instance->DumpForever(env);
+  }
+
+  static void JNICALL JVMTI_Exporter(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    instance->ExportForever();
+  }
+
+  static void JNICALL JVMTI_Controller(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    instance->ServeForever(env);
+  }
+
+  static void JNICALL JVMTI_ClassPrepare(
+      jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jclass klass) {
+    instance->ClassPrepare(env, klass);
+  }
+
+  // Numbers allocation sites for java_crw_demo.
+  static unsigned CRW_AllocationSite(
+      unsigned class_num, unsigned method_num, int bci, const char* type) {
+    return instance->AllocationSiteNumber(class_num, method_num, bci, type);
+  }
+
+  static void CRW_MethodNumbers(
+      unsigned class_num, const char** names, const char** descrs, int count) {
+    instance->MethodNumbers(class_num, names, descrs, count);
+  }
+
+  static void JNICALL JVMTI_SampledObjectAlloc(
+      jvmtiEnv* jvmti, JNIEnv* env, jthread thread,
+      jobject object, jclass object_klass, jlong size) {
+    // The VM has already made the sampling decision; the allocating
+    // method is the top frame.
+    instance->RecordSample(thread, object, size, 0);
+  }
+
   static void JNICALL JVMTI_ClassFileLoadHook(
       jvmtiEnv* jvmti, JNIEnv* env,
       jclass class_being_redefined, jobject loader,
@@ -212,9 +375,9 @@ class Heapster {
       jint class_data_len, const unsigned char* class_data,
       jint* new_class_data_len, unsigned char** new_class_data) {
     //
-    // Currently, we always instrument classes (but profiling is
-    // optional, and won't leave bytecode unecessarily), but in the
-    // future we may consider dynamic BCI, as per:
+    // Classes are only instrumented while profiling; starting and
+    // stopping the profiler retransforms all loaded classes to add or
+    // strip instrumentation (dynamic BCI), as per:
     //
     //   http://download.oracle.com/javase/6/docs/platform/jvmti/jvmti.html#bci
     //
@@ -232,10 +395,31 @@ class Heapster {
 
   // * Instance methods.
 
-  Heapster(jvmtiEnv* jvmti)
-      : jvmti_(jvmti), monitor_(NULL),
-        sites_(NULL), class_count_(0),
+  Heapster(JavaVM* jvm, jvmtiEnv* jvmti)
+      : jvm_(jvm), jvmti_(jvmti), async_get_call_trace_(NULL),
+        engine_(kEngineBCI), injection_(kInjectObject),
+        top_frame_only_(false), counting_(false), source_info_(false),
+        instrumenting_(false), profiling_monitor_(NULL), reference_size_(4), object_alignment_(8),
+        monitor_(NULL), free_monitor_(NULL), free_buffers_(NULL),
+        max_free_buffers_(0), num_free_buffers_(0), deferred_frees_(false),
+        method_monitor_(NULL), dump_monitor_(NULL), dump_id_(1),
+        dump_dir_(NULL), dump_interval_millis_(0), dump_keep_(0),
+        dump_max_bytes_(0), dump_proto_(false), dumper_monitor_(NULL),
+        dump_files_bytes_(0), shm_(NULL), shm_size_(0),
+        shm_interval_millis_(0), exporter_monitor_(NULL), control_fd_(-1),
+        control_monitor_(NULL),
+        event_monitor_(NULL), event_sink_(NULL), event_out_(NULL),
+        event_buffers_(NULL), num_event_buffers_(0),
+        event_buffers_monitor_(NULL), free_event_buffers_(NULL),
+        reserve_event_buffers_(NULL), num_reserve_event_buffers_(0),
+        max_reserve_event_buffers_(0), events_dropped_(0),
+        events_reported_dropped_(0), event_start_micros_(0),
+        sites_(NULL), max_sites_(0), num_buckets_(0), sketch_(NULL),
+        folded_samples_(0), folded_max_(0), folded_at_eviction_(0),
+        evictions_(0), evicted_max_(0), epoch_(0),
+        sample_period_(0), sampler_seed_(0),
         vm_started_(false) {
+    memset(site_types_, 0, sizeof(site_types_));
     Setup();
   }
 
@@ -243,6 +427,14 @@ class Heapster {
     // TODO: deallocate raw_monitor.
     // TODO: deallocate sites table.
     delete monitor_;
+    delete free_monitor_;
+    delete method_monitor_;
+    delete dump_monitor_;
+    delete profiling_monitor_;
+    delete dumper_monitor_;
+    delete exporter_monitor_;
+    delete event_monitor_;
+    delete event_buffers_monitor_;
   }
 
   void VMStart(JNIEnv* env) {
@@ -268,355 +460,2803 @@ class Heapster {
       errx(3, "Failed to get handle to helper class - %s.\n", HELPER_CLASS);
     }
 
+    // Hand the helper our size estimates; it makes the sampling
+    // decision without calling back into us.
+    SetSizeEstimates(env, klass);
+    if (engine_ == kEngineBCI && injection_ == kInjectTick)
+      SizeLoadedClasses(env);
+
+    StartFreeDrainer(env);
+    if (dump_dir_ != NULL && !StartAgentThread(
+            env, "Heapster dumper", &Heapster::JVMTI_Dumper))
+      warnx("Failed to start the dumper; no profiles will be dumped\n");
+    if (shm_ != NULL && !StartAgentThread(
+            env, "Heapster exporter", &Heapster::JVMTI_Exporter))
+      warnx("Failed to start the exporter; no profiles will be exported\n");
+    if (control_fd_ >= 0 && !StartAgentThread(
+            env, "Heapster control", &Heapster::JVMTI_Controller))
+      warnx("Failed to start the control socket server\n");
+
+    // Classes prepared from now on get their method IDs in
+    // ClassPrepare.
+    if (async_get_call_trace_ != NULL)
+      AllocateLoadedMethodIDs();
+
     // Set the static field to hint the helper.
     jfieldID is_ready_field = env->GetStaticFieldID(klass, HELPER_FIELD_ISREADY, "I");
     if (is_ready_field == NULL)
       errx(3, "Failed to get %s field\n", HELPER_FIELD_ISREADY);
     env->SetStaticIntField(klass, is_ready_field, 1);
 
-    // If we ask for a static profile, make sure we turn profiling on
-    // from the beginning.
-    if (getenv("HEAPSTER_PROFILE") != NULL) {
-      jfieldID is_profiling_field = env->GetStaticFieldID(klass,
-                                                          HELPER_FIELD_ISPROFILING,
-                                                          "Z");
-      if (is_profiling_field == NULL)
-        errx(3, "Failed to get %s field\n", HELPER_FIELD_ISPROFILING);
+    if (counting_) {
+      jmethodID start = env->GetStaticMethodID(
+          klass, HELPER_METHOD_STARTCOUNTING, "()V");
+      if (start == NULL)
+        errx(3, "Failed to get %s method\n", HELPER_METHOD_STARTCOUNTING);
 
-      env->SetStaticBooleanField(klass, is_profiling_field, (jboolean)1);
+      env->CallStaticVoidMethod(klass, start);
+    }
+
+    // If we ask for a static profile, or for profiles to be dumped,
+    // make sure we turn profiling on from the beginning.
+    if (getenv("HEAPSTER_PROFILE") != NULL || dump_dir_ != NULL ||
+        shm_ != NULL || event_out_ != NULL) {
+      jmethodID start = env->GetStaticMethodID(klass, HELPER_METHOD_START, "()V");
+      if (start == NULL)
+        errx(3, "Failed to get %s method\n", HELPER_METHOD_START);
+
+      env->CallStaticVoidMethod(klass, start);
     }
   }
 
   void JNICALL VMDeath(JNIEnv* env) {
+    if (event_out_ != NULL)
+      FlushEvents();
+    if (shm_ != NULL)
+      unlink(shm_path_.c_str());
+    if (control_fd_ >= 0)
+      unlink(control_path_.c_str());
+
     char* path = getenv("HEAPSTER_PROFILE");
     if (path == NULL)
       return;
 
-    string profile = DumpProfile(false/*force GC*/);
+    if (WriteProfile(env, path, false/*force GC*/, false/*lifetime*/,
+                     false/*proto*/))
+      warnx("Profile written to %s", path);
+  }
 
+  // Streams a profile to a file.
+  bool WriteProfile(JNIEnv* env, const char* path, bool force_gc,
+                    bool lifetime, bool proto) {
     int fd = open(
         path, O_WRONLY | O_TRUNC | O_CREAT,
         S_IRUSR | S_IWUSR);
 
     if (fd < 0) {
       perror("open");
-      return;
+      return false;
     }
 
-    AtomicWrite(fd, reinterpret_cast<const char*>(profile.data()), profile.size());
-    warnx("Profile written to %s", path);
+    FdSink sink(fd);
+    bool ok = DumpProfile(env, &sink, force_gc, lifetime, proto);
+    if (!ok)
+      perror("write");
 
     close(fd);
+    return ok;
+  }
+
+  void JNICALL ThreadEnd(jthread thread) {
+    // The free drainer writes out the rest of the thread's events.
+    EventBuffer* buffer = thread_event_buffer;
+    if (buffer != NULL) {
+      thread_event_buffer = NULL;
+      __sync_synchronize();
+      buffer->dead = true;
+    }
+
+    tcmalloc::Sampler* sampler;
+    if (jvmti_->GetThreadLocalStorage(thread, (void**)&sampler) != JVMTI_ERROR_NONE)
+      return;
+
+    jvmti_->SetThreadLocalStorage(thread, NULL);
+    delete sampler;
   }
 
+  // We're called during GC, so we only queue the free; the drainer
+  // thread (or the next dump) accounts for it. If we have no queue,
+  // or it is full, we account for it right away.
   void JNICALL ObjectFree(jlong tag) {
-    Lock l(monitor_);
+    // Unloaded classes keep their names.
+    if (tag & kTagClass)
+      return;
 
-    Allocation* alloc = reinterpret_cast<Allocation*>(tag);
-    Site* s = alloc->first;
-    int nbytes = alloc->second;
+    if (event_out_ != NULL) {
+      const uint64_t fields[] = {
+        static_cast<uint64_t>(tag >> kTagSiteShift & (kMaxSites - 1)),
+        static_cast<uint64_t>(tag & 0xffffffffLL) << 3
+      };
+      LogEvent(kEventFree, fields, arraysize(fields), NULL, 0, false);
+    }
 
-    s->num_bytes -= nbytes;
-    if (!s->active && s->num_bytes == 0)
-      delete s;
+    FreeBuffer* buffer = ThreadFreeBuffer();
+    if (buffer == NULL || !buffer->Push(tag)) {
+      SiteTable::Reader reader(sites_);
+      ApplyFree(tag);
+    }
+  }
 
-    delete alloc;
+  // We can't allocate during GC, so buffers come from a pool made
+  // when the drainer starts; threads past its end (or reporting frees
+  // before then) have none.
+  FreeBuffer* ThreadFreeBuffer() {
+    FreeBuffer* buffer = thread_free_buffer;
+    if (buffer != NULL)
+      return buffer;
+
+    uint32_t i;
+    do {
+      i = num_free_buffers_;
+      if (i == max_free_buffers_)
+        return NULL;
+    } while (!__sync_bool_compare_and_swap(&num_free_buffers_, i, i + 1));
+
+    buffer = &free_buffers_[i];
+    thread_free_buffer = buffer;
+    return buffer;
   }
 
-  void JNICALL ClassFileLoadHook(
-      jvmtiEnv* jvmti, JNIEnv* env,
-      jclass class_being_redefined, jobject loader,
-      const char* name, jobject protection_domain,
-      jint class_data_len, const unsigned char* class_data,
-      jint* new_class_data_len, unsigned char** new_class_data) {
-    // This is where the magic rewriting happens.
+  // Returns how many frees were drained.
+  uint64_t DrainFrees() {
+    Lock l(free_monitor_);
+    SiteTable::Reader reader(sites_);
+    const uint32_t n = num_free_buffers_;
+    uint64_t drained = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      int64_t tag;
+      while (free_buffers_[i].Pop(&tag)) {
+        ApplyFree(tag);
+        ++drained;
+      }
+    }
+    return drained;
+  }
 
-    char* classname;
-    if (name == NULL) {
-      classname = java_crw_demo_classname(class_data, class_data_len, NULL);
-      if (classname == NULL)
-        errx(3, "Failed to find classname\n");
-    } else {
-      if ((classname = strdup(name)) == NULL)
-        errx(3, "malloc failed\n");
+  // Since JDK 16, the VM posts ObjectFree events from its service
+  // thread after a collection, rather than during it, so they may
+  // still be coming once a forced collection returns. We drain until
+  // none have come for kFreeQuietMillis, but for no longer than
+  // kFreeSettleMillis in all.
+  void SettleFrees() {
+    const jlong start = NowMillis();
+    jlong quiet_since = start;
+    for (jlong now = start; now - start < kFreeSettleMillis;
+         now = NowMillis()) {
+      if (DrainFrees() > 0)
+        quiet_since = now;
+      else if (now - quiet_since >= kFreeQuietMillis)
+        return;
+
+      Lock l(free_monitor_);
+      free_monitor_->Wait(kFreeQuietMillis / 10);
     }
+    DrainFrees();
+  }
 
-    // Ignore the helper class.
-    if (strcmp(classname, HELPER_CLASS) == 0)
-      return;
+  void DrainFreesForever() {
+    for (;;) {
+      {
+        Lock l(free_monitor_);
+        free_monitor_->Wait(kFreeDrainPeriodMillis);
+        DrainFrees();
+      }
 
-    int class_num;
-    bool is_system_class;
-    {
-      Lock l(monitor_);
-      class_num = class_count_++;
-      is_system_class = !vm_started_;
+      if (event_out_ != NULL)
+        FlushEvents();
     }
+  }
 
-    // The big magic: rewrite the class with our instrumentation.
-    unsigned char* new_image = NULL;
-    long new_length = 0L;
+  // With HEAPSTER_EVENT_LOG, each sampled allocation and each free of
+  // a sampled object is logged to that file, as are the definitions
+  // of the sites, methods and types they refer to. Threads log into
+  // their own buffers, which only the free drainer writes out; see
+  // heapster_events.h for the format. Events that don't fit are
+  // dropped, and counted. Frees of objects with the same site and
+  // size can't be told apart. Returns false if the event was dropped.
+  bool LogEvent(EventKind kind, const uint64_t* fields, size_t nfields,
+                const char* name, size_t name_length, bool named_thread) {
+    EventBuffer* buffer = ThreadEventBuffer(named_thread);
+    if (buffer == NULL) {
+      __sync_add_and_fetch(&events_dropped_, 1);
+      return false;
+    }
 
-    java_crw_demo(
-      class_num,
-      classname,
-      class_data,
-      class_data_len,
-      is_system_class ? 1 : 0,
-      (char*)HELPER_CLASS,
-      (char*)("L" HELPER_CLASS ";"),
-      NULL, NULL,
-      NULL, NULL,
-      (char*)"newObject", (char*)"(Ljava/lang/Object;)V",
-      (char*)"newObject", (char*)"(Ljava/lang/Object;)V",
-      &new_image,
-      &new_length,
-      NULL, NULL);
+    const uint64_t now = EventTime();
+    const uint64_t delta = now > buffer->last_time ? now - buffer->last_time : 0;
+
+    // The length, time delta, kind, up to a site's fields, and a
+    // name's length.
+    char record[10 * (kMaxStackFrames + 6)];
+    char* p = record + 10;
+    p += PutVarint(p, delta);
+    p += PutVarint(p, kind);
+    for (size_t i = 0; i < nfields; ++i)
+      p += PutVarint(p, fields[i]);
+    if (name != NULL)
+      p += PutVarint(p, name_length);
+
+    // The length goes right before the rest.
+    char length[10];
+    const size_t n = PutVarint(length, p - (record + 10) + name_length);
+    char* start = record + 10 - n;
+    memcpy(start, length, n);
+
+    if (!buffer->Push(start, p - start, name, name_length)) {
+      __sync_add_and_fetch(&events_dropped_, 1);
+      return false;
+    }
+    buffer->last_time = now;
+    return true;
+  }
 
-    if (new_length > 0L) {
-      // Success. We now need to allocate it with the JVMTI allocator,
-      // copy the definition there, and set the corresponding
-      // pointers.
-      void* bufp;
-      Assert(jvmti_->Allocate(new_length, (unsigned char**)&bufp),
-             "failed to allocate buffer for new classfile");
+  EventBuffer* ThreadEventBuffer(bool named_thread) {
+    EventBuffer* buffer = thread_event_buffer;
+    if (buffer != NULL)
+      return buffer;
 
-      memcpy(bufp, new_image, new_length);
-      *new_class_data_len = (jint)new_length;
-      *new_class_data = (unsigned char*)bufp;
+    // Buffers of ended threads are reused. Threads that may not
+    // allocate (the GC's, reporting frees) otherwise take one from a
+    // reserve kept for them alone; Java threads make their own.
+    {
+      Lock l(event_buffers_monitor_);
+      buffer = free_event_buffers_;
+      if (buffer != NULL) {
+        free_event_buffers_ = buffer->next;
+      } else if (!named_thread && reserve_event_buffers_ != NULL) {
+        buffer = reserve_event_buffers_;
+        reserve_event_buffers_ = buffer->next;
+        --num_reserve_event_buffers_;
+      }
     }
 
-    if (new_image != NULL)
-      free(new_image);
+    if (buffer == NULL && named_thread)
+      buffer = new (nothrow) EventBuffer();
+    if (buffer == NULL)
+      return NULL;
+
+    buffer->id = __sync_add_and_fetch(&num_event_buffers_, 1);
+    buffer->dead = false;
+    buffer->last_time = 0;
+    buffer->flushed_time = 0;
+
+    EventBuffer* head;
+    do {
+      head = event_buffers_;
+      buffer->next = head;
+    } while (!__sync_bool_compare_and_swap(&event_buffers_, head, buffer));
+
+    thread_event_buffer = buffer;
+
+    // Java threads are named by their first event; others (say, the
+    // GC's) may not call into JVMTI from where they log.
+    jvmtiThreadInfo info;
+    if (named_thread &&
+        jvmti_->GetThreadInfo(NULL, &info) == JVMTI_ERROR_NONE) {
+      LogEvent(kEventThread, NULL, 0, info.name, strlen(info.name), false);
+      jvmti_->Deallocate(reinterpret_cast<unsigned char*>(info.name));
+
+      JNIEnv* env;
+      if (jvm_->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_2) == JNI_OK) {
+        env->DeleteLocalRef(info.thread_group);
+        env->DeleteLocalRef(info.context_class_loader);
+      }
+    }
+
+    return buffer;
   }
 
-  void NewObject(JNIEnv* env, jclass klass, jthread thread, jobject o) {
-    // Compute the size of the allocation & decide whether to sample
-    // it.
-    jlong size;
-    Assert(jvmti_->GetObjectSize(o, &size),
-           "failed to get size of object");
+  // Logs a sampled allocation, and the definitions of its site and
+  // type if they aren't logged yet. The type is the object's class,
+  // or, in tick mode, given.
+  void LogAllocation(Site* s, jobject o, jlong size, uint64_t type) {
+    if (!s->logged && s->index < kMaxSites && LogSite(s))
+      s->logged = 1;
+
+    const uint64_t fields[] = {
+      s->index,
+      static_cast<uint64_t>(size),
+      o != NULL ? EventType(o) : type
+    };
+    LogEvent(kEventAlloc, fields, arraysize(fields), NULL, 0, true);
+  }
 
-    { Lock l(sampler_monitor_);
-      if (!sampler_.SampleAllocation(size))
-        return;
+  // Logs a site's stack, and the names of its methods that aren't
+  // logged yet; returns false if any were dropped, to be tried again.
+  bool LogSite(const Site* s) {
+    Lock l(method_monitor_);
+
+    bool ok = true;
+    uint64_t fields[kMaxStackFrames + 2];
+    fields[0] = s->index;
+    fields[1] = s->nframes;
+    for (int i = 0; i < s->nframes; ++i) {
+      fields[i + 2] = reinterpret_cast<uintptr_t>(s->stack[i]);
+
+      map<jmethodID, NamedMethod>::iterator it = method_names_.find(s->stack[i]);
+      if (it == method_names_.end() || it->second.logged)
+        continue;
+
+      const string& name = it->second.name;
+      if (LogEvent(kEventMethod, &fields[i + 2], 1, name.data(), name.size(), true))
+        it->second.logged = true;
+      else
+        ok = false;
     }
 
-    jvmtiFrameInfo frames[kMaxStackFrames];
-    jint nframes;
+    return LogEvent(kEventSite, fields, s->nframes + 2, NULL, 0, true) && ok;
+  }
+
+  // Types are numbered by class, as their signatures are, and logged
+  // with a class's first sample. Its tag then says so, so that later
+  // samples take no lock.
+  uint64_t EventType(jobject o) {
+    JNIEnv* env;
+    if (jvm_->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_2) != JNI_OK)
+      return kEventUnknownType;
+
+    jclass klass = env->GetObjectClass(o);
+    jlong tag;
+    uint64_t type;
+    if (jvmti_->GetTag(klass, &tag) == JVMTI_ERROR_NONE &&
+        (tag & kTagClass) && (tag & kTagClassLogged))
+      type = tag & kTagClassIndex;
+    else
+      type = LogClassType(klass);
+
+    env->DeleteLocalRef(klass);
+    return type;
+  }
+
+  uint64_t LogClassType(jclass klass) {
+    Lock l(method_monitor_);
+
+    jlong tag;
+    const string* signature = ClassSignature(klass);
+    if (signature == NULL || jvmti_->GetTag(klass, &tag) != JVMTI_ERROR_NONE)
+      return kEventUnknownType;
+
+    const uint64_t type = tag & kTagClassIndex;
+    if (!(tag & kTagClassLogged) &&
+        LogEvent(kEventType, &type, 1, signature->data(), signature->size(), true))
+      jvmti_->SetTag(klass, tag | kTagClassLogged);
+    return type;
+  }
+
+  // In tick mode, types are numbered as the injection numbers them,
+  // and logged with the first sample of each site allocating them.
+  // Sites' types are looked up without a lock, from a directory of
+  // chunks (as sites are by index), filled in as sites are numbered.
+  // Each entry is the type's number plus one, shifted left of a bit
+  // set once it is logged; 0 if there is none.
+  uint64_t SiteEventType(jint site) {
+    if (site < 0 || static_cast<uint32_t>(site) >= kMaxSites)
+      return kEventUnknownType;
+
+    volatile uint32_t* chunk = site_types_[site / kSiteChunkSize];
+    const uint32_t entry = chunk != NULL ? chunk[site % kSiteChunkSize] : 0;
+    if (entry == 0)
+      return kEventUnknownType;
+
+    const uint64_t type = (entry >> 1) - 1;
+    if (!(entry & 1)) {
+      string name;
+      {
+        Lock l(monitor_);
+        name = types_[type];
+      }
+
+      // Logged as a signature, as for objects we see.
+      if (name[0] != '[')
+        name = "L" + name + ";";
+      if (LogEvent(kEventType, &type, 1, name.data(), name.size(), true))
+        chunk[site % kSiteChunkSize] = entry | 1;
+    }
 
-    // Subtract 2 stack frames to start outside of our own code. TODO:
-    // use AsyncGetStackTrace?
-    jvmtiError error =
-        jvmti_->GetStackTrace(
-            thread, 2, arraysize(frames),
-            frames, &nframes);
+    return type;
+  }
 
-    // TODO: keep track of these?
-    if (error == JVMTI_ERROR_WRONG_PHASE)
+  // Called with monitor_ held.
+  void SetSiteEventType(unsigned site, unsigned type) {
+    if (site >= kMaxSites)
       return;
 
-    // This hash function was adapted from Google perftools.
-    long h = 0;
-    for (int i = 0; i < nframes; i++) {
-      h += reinterpret_cast<uintptr_t>(frames[i].method);
-      h += h << 10;
-      h ^= h >> 6;
+    volatile uint32_t* chunk = site_types_[site / kSiteChunkSize];
+    if (chunk == NULL) {
+      chunk = static_cast<uint32_t*>(calloc(kSiteChunkSize, sizeof(uint32_t)));
+      if (chunk == NULL)
+        errx(3, "Out of memory\n");
+      __sync_synchronize();
+      site_types_[site / kSiteChunkSize] = chunk;
     }
-    h += h << 3;
-    h ^= h >> 11;
 
-    uint32_t bucket = h % kHashTableSize;
-    Site* s;
-    // TODO: use a concurrent data structure here, or something more
-    // fine grained.
-    { Lock l(monitor_);
-      s = sites_[bucket];
-      for (; s != NULL; s = s->next) {
-        if (s->hash == h && s->nframes == nframes) {
-          int i = 0;
-          for (; i < nframes; i++) {
-            if (frames[i].method != s->stack[i]) {
-              break;
-            }
-          }
-
-          if (i == nframes)
-            break;
-        }
+    chunk[site % kSiteChunkSize] = (type + 1) << 1;
+  }
+
+  // Microseconds since the log was started.
+  uint64_t EventTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000) - event_start_micros_;
+  }
+
+  // Called by the free drainer, and at VM death. The buffers of
+  // ended threads are written out for the last time, and go to
+  // refill the reserve, or else to be reused by any thread. Threads
+  // only ever push buffers onto the head of the list, so we can
+  // unlink any other without racing them.
+  void FlushEvents() {
+    Lock l(event_monitor_);
+    EventBuffer* prev = NULL;
+    for (EventBuffer* buffer = event_buffers_; buffer != NULL;) {
+      const bool dead = buffer->dead;
+      __sync_synchronize();
+      FlushEvents(buffer);
+
+      EventBuffer* next = buffer->next;
+      if (!dead) {
+        prev = buffer;
+        buffer = next;
+        continue;
       }
 
-      if (s == NULL) {
-        sites_[bucket] = s =
-          new Site(sites_[bucket], h, nframes, frames);
+      if (prev == NULL &&
+          !__sync_bool_compare_and_swap(&event_buffers_, buffer, next)) {
+        for (prev = event_buffers_; prev->next != buffer; prev = prev->next) {}
+      }
+      if (prev != NULL)
+        prev->next = next;
+
+      {
+        Lock l(event_buffers_monitor_);
+        if (num_reserve_event_buffers_ < max_reserve_event_buffers_) {
+          buffer->next = reserve_event_buffers_;
+          reserve_event_buffers_ = buffer;
+          ++num_reserve_event_buffers_;
+        } else {
+          buffer->next = free_event_buffers_;
+          free_event_buffers_ = buffer;
+        }
       }
+      buffer = next;
+    }
 
-      s->num_allocs++;
-      s->num_bytes += size;
+    // Drops are counted in a chunk of their own.
+    const uint64_t dropped = events_dropped_;
+    if (dropped != events_reported_dropped_) {
+      char record[30];
+      size_t n = 1;
+      n += PutVarint(record + n, 0);
+      n += PutVarint(record + n, kEventDropped);
+      n += PutVarint(record + n, dropped - events_reported_dropped_);
+      record[0] = n - 1;
+
+      char header[30];
+      size_t m = PutVarint(header, kEventNoThread);
+      m += PutVarint(header + m, EventTime());
+      m += PutVarint(header + m, n);
+      event_out_->Append(header, m);
+      event_out_->Append(record, n);
+      events_reported_dropped_ = dropped;
     }
 
-    // Record this allocation (& sampled size) for deallocation.
-    Allocation* alloc = new Allocation(s, size);
-    jvmti_->SetTag(o, reinterpret_cast<jlong>(alloc));
+    if (!event_out_->Flush())
+      warnx("Failed to write the event log");
   }
 
-  const string DumpProfile(bool force_gc) {
-    if (force_gc) {
-      jvmtiError error = jvmti_->ForceGarbageCollection();
-      if (error != JVMTI_ERROR_NONE)
-        warnx("Failed to force garbage collection.\n");
+  // Writes out the buffer's events as a chunk. Its time is found by
+  // adding up the events' time deltas. Called with event_monitor_
+  // held.
+  void FlushEvents(EventBuffer* buffer) {
+    const uint32_t n = buffer->Copy(&event_scratch_);
+    if (n == 0)
+      return;
+
+    uint64_t time = buffer->flushed_time;
+    const char* end = &event_scratch_[0] + n;
+    for (const char* p = &event_scratch_[0]; p < end;) {
+      uint64_t length, delta;
+      const size_t k = GetVarint(p, end, &length);
+      GetVarint(p + k, end, &delta);
+      time += delta;
+      p += k + length;
     }
 
-    Site** sites_copy = CopyProfile();
+    char header[30];
+    size_t m = PutVarint(header, buffer->id);
+    m += PutVarint(header + m, buffer->flushed_time);
+    m += PutVarint(header + m, n);
+    event_out_->Append(header, m);
+    event_out_->Append(&event_scratch_[0], n);
 
-    string prof = "";
+    buffer->flushed_time = time;
+    buffer->Consume(n);
+  }
 
-    // TODO: change "binary" to main class name?
-    prof += "--- symbol\nbinary=heapster\n";
-
-    // Write out symbol information (traverse the sites & resolve
-    // method names.)
-    set<jmethodID> seen_methods;
-    for (uint32_t i = 0; i < kHashTableSize; ++i) {
-      for (Site* s = sites_copy[i]; s != NULL; s = s->next) {
-        // Don't print for empty sites.
-        if (s->num_bytes <= 0)
-          continue;
+  void StartFreeDrainer(JNIEnv* env) {
+    // Frees are reported by the GC's threads, of which there are
+    // about as many as processors.
+    long nprocs = sysconf(_SC_NPROCESSORS_CONF);
+    const uint32_t nbuffers = nprocs > 4 ? 2 * nprocs : 8;
+    free_buffers_ = new (nothrow) FreeBuffer[nbuffers];
+    if (free_buffers_ != NULL) {
+      __sync_synchronize();
+      max_free_buffers_ = nbuffers;
+    } else {
+      warnx("Failed to allocate free buffers; "
+            "frees will be accounted for as they happen\n");
+    }
 
-        for (int i = 0; i < s->nframes; ++i) {
-          const jmethodID method = s->stack[i];
+    // They log frees too, but can't make buffers of their own.
+    if (event_out_ != NULL) {
+      Lock l(event_buffers_monitor_);
+      max_reserve_event_buffers_ = nbuffers;
+      while (num_reserve_event_buffers_ < nbuffers) {
+        EventBuffer* buffer = new (nothrow) EventBuffer();
+        if (buffer == NULL)
+          break;
+
+        buffer->next = reserve_event_buffers_;
+        reserve_event_buffers_ = buffer;
+        ++num_reserve_event_buffers_;
+      }
+    }
 
-          if (seen_methods.find(method) != seen_methods.end())
-            continue;
+    if (!StartAgentThread(env, "Heapster free drainer",
+                          &Heapster::JVMTI_FreeDrainer))
+      warnx("Failed to start the free drainer; "
+            "frees will be accounted for at dumps\n");
+  }
 
-          uintptr_t frame = reinterpret_cast<uintptr_t>(method);
-          char* method_name;
-          jvmtiError error =
-              jvmti_->GetMethodName(method, &method_name, NULL, NULL);
-          if (error != JVMTI_ERROR_NONE)
-            continue;
+  // With HEAPSTER_DUMP_DIR set, a thread dumps the profile there
+  // every HEAPSTER_DUMP_INTERVAL seconds, straight from native
+  // memory, to files named by time. The oldest are removed to keep
+  // at most HEAPSTER_DUMP_KEEP of them, and, if HEAPSTER_DUMP_MAX_BYTES
+  // is set, at most that many bytes (less one dump); only files
+  // written by this process are ever removed.
+  void DumpForever(JNIEnv* env) {
+    for (unsigned seq = 0;; ++seq) {
+      Sleep(dumper_monitor_, dump_interval_millis_);
+
+      string path = DumpPath(seq);
+      const string tmp = path + ".tmp";
+
+      // Readers never see partial dumps.
+      struct stat st;
+      if (!WriteProfile(env, tmp.c_str(), false/*force GC*/,
+                        false/*lifetime*/, dump_proto_) ||
+          stat(tmp.c_str(), &st) < 0 ||
+          rename(tmp.c_str(), path.c_str()) < 0) {
+        warnx("Failed to dump profile to %s", path.c_str());
+        unlink(tmp.c_str());
+        continue;
+      }
 
-          jclass declaring_class;
-          error = jvmti_->GetMethodDeclaringClass(method, &declaring_class);
-          if (error != JVMTI_ERROR_NONE)
-            continue;
+      dump_files_.push_back(make_pair(path, st.st_size));
+      dump_files_bytes_ += st.st_size;
+      RotateDumps();
+    }
+  }
 
-          char* class_name;
-          error = jvmti_->GetClassSignature(
-              declaring_class, &class_name, NULL);
-          if (error != JVMTI_ERROR_NONE)
-            continue;
+  // <dir>/heapster.<pid>.<UTC time>.<seq>.heap, or .pb.gz.
+  string DumpPath(unsigned seq) {
+    char when[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y%m%dT%H%M%SZ", gmtime_r(&now, &tm));
 
-#ifdef __x86_64
-          prof += StringPrintf(
-              "0x%016lx %s%s\n", frame, class_name, method_name);
-#else
-          prof += StringPrintf(
-              "0x%08lx %s%s\n", frame, class_name, method_name);
-#endif
+    return StringPrintf("%s/heapster.%d.%s.%04u.%s", dump_dir_,
+                        static_cast<int>(getpid()), when, seq,
+                        dump_proto_ ? "pb.gz" : "heap");
+  }
 
-          seen_methods.insert(method);
-        }
-      }
+  void RotateDumps() {
+    while (dump_files_.size() > 1 &&
+           (dump_files_.size() > dump_keep_ ||
+            (dump_max_bytes_ > 0 && dump_files_bytes_ > dump_max_bytes_))) {
+      const pair<string, off_t>& oldest = dump_files_.front();
+      if (unlink(oldest.first.c_str()) < 0 && errno != ENOENT)
+        warnx("Failed to remove %s", oldest.first.c_str());
+
+      dump_files_bytes_ -= oldest.second;
+      dump_files_.pop_front();
+    }
+  }
+
+  // With HEAPSTER_SHM, a thread publishes the profile in shared
+  // memory every HEAPSTER_SHM_INTERVAL milliseconds, for collectors
+  // to read (with ShmReader) without our cooperation. The value is
+  // the file's path, or 1 for /dev/shm/heapster.<pid>.
+  void ExportForever() {
+    for (;;) {
+      Sleep(exporter_monitor_, shm_interval_millis_);
+      Export();
     }
+  }
+
+  void Export() {
+    DrainFrees();
 
-    prof += "---\n";
-    prof += "--- profile\n";
+    Lock l(dump_monitor_);
+    SnapshotProfile(false, 0);
 
-    int count = 0;
-    int total_num_bytes = 0, total_num_allocs = 0;
+    ShmHeader* header = reinterpret_cast<ShmHeader*>(shm_);
+    char* p = shm_ + sizeof(ShmHeader);
+    char* end = shm_ + shm_size_;
 
-    uintptr_t buf[2 + kMaxStackFrames];
+    header->seq++;
+    __sync_synchronize();
+
+    set<jmethodID> methods;
+    header->truncated = 0;
+    header->nsites = 0;
+    for (size_t n = 0; n < snapshot_.size(); ++n) {
+      const SiteSnapshot& snap = snapshot_[n];
+      const Site* s = snap.site;
+      if (static_cast<size_t>(end - p) < ShmSite::Size(s->nframes)) {
+        header->truncated = 1;
+        break;
+      }
+
+      ShmSite* site = reinterpret_cast<ShmSite*>(p);
+      site->inuse_objects = snap.inuse_objects;
+      site->inuse_bytes = snap.inuse_bytes;
+      site->alloc_objects = snap.alloc_objects;
+      site->alloc_bytes = snap.alloc_bytes;
+      site->nframes = s->nframes;
+      for (int i = 0; i < s->nframes; ++i) {
+        site->frames[i] = reinterpret_cast<uintptr_t>(s->stack[i]);
+        methods.insert(s->stack[i]);
+      }
 
-    // Write out the header.
-    buf[0] = 0;
-    buf[1] = 3;
-    buf[2] = 0;
-    buf[3] = 1;
-    buf[4] = 0;
+      p += ShmSite::Size(s->nframes);
+      header->nsites++;
+    }
 
-    prof.append(reinterpret_cast<char*>(buf), sizeof(buf[0]) * 5);
+    header->nsymbols = 0;
+    {
+      Lock l(method_monitor_);
+      for (set<jmethodID>::const_iterator it = methods.begin();
+           it != methods.end(); ++it) {
+        map<jmethodID, NamedMethod>::const_iterator named =
+            method_names_.find(*it);
+        if (named == method_names_.end())
+          continue;
 
-    for (uint32_t i = 0; i < kHashTableSize; ++i) {
-      for (Site* s = sites_copy[i]; s != NULL; s = s->next) {
-        buf[0] = s->num_bytes;          // nsamples
-        buf[1] = s->nframes;            // depth
-        memcpy(&buf[2], s->stack, s->nframes * sizeof(s->stack[0]));
+        const string& name = named->second.name;
+        if (static_cast<size_t>(end - p) < ShmSymbol::Size(name.size())) {
+          header->truncated = 1;
+          break;
+        }
 
-        prof.append(reinterpret_cast<char*>(buf),
-                    sizeof(buf[0]) * (2 + s->nframes));
+        ShmSymbol* symbol = reinterpret_cast<ShmSymbol*>(p);
+        symbol->method = reinterpret_cast<uintptr_t>(*it);
+        symbol->name_length = name.size();
+        memcpy(symbol + 1, name.data(), name.size());
 
-        ++count;
-        total_num_bytes += s->num_bytes;
-        total_num_allocs += s->num_allocs;
+        p += ShmSymbol::Size(name.size());
+        header->nsymbols++;
       }
     }
 
-    DeallocProfile(sites_copy);
+    header->time_millis = NowMillis();
+    header->sample_period = sample_period_;
+    header->data_bytes = p - (shm_ + sizeof(ShmHeader));
 
-    return prof;
+    __sync_synchronize();
+    header->seq++;
   }
 
-  // If we are deallocating a copy, we can simply free all entries, rather than
-  // preserving those that are active (num_bytes > 0).
-  void DeallocProfile(Site** sites) {
-    const bool is_a_copy = sites != sites_;
-    for (uint32_t i = 0; i < kHashTableSize; ++i) {
-      Site* s = sites[i];
-      while (s != NULL) {
-        Site* next = s->next;
+  // With HEAPSTER_SOCKET, a thread serves commands on a Unix socket
+  // at that path, one per connection, each a line:
+  //
+  //   start, stop, clear      reply "ok"
+  //   period <bytes>          sets the sampling period; replies "ok"
+  //   dump [gc] [lifetime] [proto]
+  //                           replies with the profile
+  //   delta <since>           replies with a delta profile
+  //
+  // Errors are replied as "error: <why>". Profiles are streamed to
+  // the client as they're rendered, so dumps don't depend on Java
+  // code running, nor buffer whole profiles. They're rendered under
+  // the dump monitor, which samplers never take, so a slow client
+  // only holds up other dumps; and each client has
+  // kClientTimeoutMillis in all, so it can't hold them up for long.
+  //
+  // Should we run out of descriptors, we back off rather than spin;
+  // should the socket itself be bad, we stop serving.
+  void ServeForever(JNIEnv* env) {
+    for (;;) {
+      int conn = accept(control_fd_, NULL, NULL);
+      if (conn < 0) {
+        switch (errno) {
+          case EINTR:
+          case ECONNABORTED:
+            break;
+          case EMFILE:
+          case ENFILE:
+          case ENOBUFS:
+          case ENOMEM:
+            warnx("Failed to accept on %s: %s\n", control_path_.c_str(),
+                  strerror(errno));
+            Sleep(control_monitor_, kAcceptBackoffMillis);
+            break;
+          case EBADF:
+          case EINVAL:
+          case ENOTSOCK:
+            warnx("Stopped serving on %s: %s\n", control_path_.c_str(),
+                  strerror(errno));
+            return;
+          default:
+            warnx("Failed to accept on %s: %s\n", control_path_.c_str(),
+                  strerror(errno));
+            break;
+        }
+        continue;
+      }
 
-        if (s->num_bytes == 0 || is_a_copy)
-          delete s;
-        else
-          s->active = false;
+#ifdef SO_NOSIGPIPE
+      int on = 1;
+      setsockopt(conn, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
 
-        s = next;
+      // This thread never returns to Java to free its local references.
+      if (env->PushLocalFrame(16) == 0) {
+        Serve(env, conn, MonotonicMillis() + kClientTimeoutMillis);
+        env->PopLocalFrame(NULL);
       }
+      close(conn);
     }
-
-    delete[] sites;
   }
 
-  void ClearProfile() {
-    Lock l(monitor_);
-    // The individual sites will be deallocated as they become empty
-    // when they are marked dead. We also have to collect the
-    // currently empty sites ourselves. But their linked list will
-    // never be used (the ``sites_'') reference is lost & so this is
-    // safe.
-    DeallocProfile(sites_);
-    AllocProfile();
-  }
+  void Serve(JNIEnv* env, int conn, int64_t deadline_millis) {
+    char line[256];
+    size_t n = 0;
+    while (n < sizeof(line) - 1 && memchr(line, '\n', n) == NULL) {
+      if (!SetSocketDeadline(conn, SO_RCVTIMEO, deadline_millis))
+        return;
 
-  void AllocProfile() {
-    sites_ = new Site*[kHashTableSize];
-    memset(sites_, 0, sizeof(Site*) * kHashTableSize);
-  }
+      const ssize_t res = recv(conn, line + n, sizeof(line) - 1 - n, 0);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        break;
+      n += res;
+    }
+    line[n] = '\0';
+
+    char* save;
+    const char* command = strtok_r(line, " \t\r\n", &save);
+    const char* arg = command != NULL ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+    SocketSink sink(conn, deadline_millis);
+    string reply = "ok\n";
+
+    if (command == NULL) {
+      reply = "error: no command\n";
+    } else if (strcmp(command, "dump") == 0) {
+      bool force_gc = false, lifetime = false, proto = false;
+      for (; arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save)) {
+        if (strcmp(arg, "gc") == 0)
+          force_gc = true;
+        else if (strcmp(arg, "lifetime") == 0)
+          lifetime = true;
+        else if (strcmp(arg, "proto") == 0)
+          proto = true;
+        else
+          break;
+      }
 
-  Site** CopyProfile() {
-    Site** copy = new Site*[kHashTableSize];
-    memset(copy, 0, sizeof(Site*) * kHashTableSize);
-    Lock l(monitor_);
-    for (uint32_t bucket = 0; bucket < kHashTableSize; ++bucket) {
-      Site** prev_site_addr = &copy[bucket];
-      for (Site* site = sites_[bucket]; site != NULL; site = site->next) {
-        Site* site_copy = new Site(*site);
-        *prev_site_addr = site_copy;
-        prev_site_addr = &site_copy->next;
+      if (arg == NULL) {
+        DumpProfile(env, &sink, force_gc, lifetime, proto);
+        return;
       }
+      reply = StringPrintf("error: unknown dump option %s\n", arg);
+    } else if (strcmp(command, "delta") == 0) {
+      char* end;
+      const unsigned long since = arg != NULL ? strtoul(arg, &end, 10) : 0;
+      if (arg != NULL && *end == '\0') {
+        DumpProfileDelta(env, &sink, since);
+        return;
+      }
+      reply = "error: usage: delta <since>\n";
+    } else if (strcmp(command, "period") == 0) {
+      char* end;
+      errno = 0;
+      const long period = arg != NULL ? strtol(arg, &end, 10) : 0;
+      if (arg != NULL && *end == '\0' && errno == 0 &&
+          period > 0 && period <= INT_MAX) {
+        SetSamplingPeriod(period);
+        if (!CallHelper(env, HELPER_METHOD_SEEDSAMPLER))
+          reply = "error: failed to reseed the sampler\n";
+      } else {
+        reply = "error: usage: period <bytes>\n";
+      }
+    } else if (strcmp(command, "start") == 0 ||
+               strcmp(command, "stop") == 0 ||
+               strcmp(command, "clear") == 0) {
+      const char* method =
+          strcmp(command, "start") == 0 ? HELPER_METHOD_START :
+          strcmp(command, "stop") == 0 ? HELPER_METHOD_STOP :
+          HELPER_METHOD_CLEARPROFILE;
+      if (!CallHelper(env, method))
+        reply = StringPrintf("error: %s failed\n", command);
+    } else {
+      reply = StringPrintf("error: unknown command %s\n", command);
     }
-    return copy;
+
+    sink.Write(reply.data(), reply.size());
   }
 
-  void SetSamplingPeriod(int period) {
-    Lock l(sampler_monitor_);
-    sampler_.Init(0, period);
+  // Calls a static, void helper method; returns false if it threw.
+  bool CallHelper(JNIEnv* env, const char* name) {
+    jclass klass = env->FindClass(HELPER_CLASS);
+    jmethodID method =
+        klass == NULL ? NULL : env->GetStaticMethodID(klass, name, "()V");
+    if (method != NULL)
+      env->CallStaticVoidMethod(klass, method);
+
+    if (env->ExceptionCheck()) {
+      env->ExceptionClear();
+      return false;
+    }
+    return method != NULL;
+  }
+
+  // Waits on the monitor (held by nobody else) for that long.
+  void Sleep(Monitor* monitor, jlong millis) {
+    Lock l(monitor);
+    const jlong deadline = NowMillis() + millis;
+    for (jlong now; (now = NowMillis()) < deadline;)
+      monitor->Wait(deadline - now);
+  }
+
+  static jlong NowMillis() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000LL + now.tv_usec / 1000;
+  }
+
+  // Runs f in a new daemon thread, which is also a java.lang.Thread
+  // with the given name.
+  bool StartAgentThread(JNIEnv* env, const char* name,
+                        jvmtiStartFunction f) {
+    jclass thread_class = env->FindClass("java/lang/Thread");
+    jmethodID init = thread_class == NULL ? NULL :
+        env->GetMethodID(thread_class, "<init>", "(Ljava/lang/String;)V");
+    jthread thread = init == NULL ? NULL :
+        env->NewObject(thread_class, init, env->NewStringUTF(name));
+
+    if (thread == NULL ||
+        jvmti_->RunAgentThread(
+            thread, f, NULL, JVMTI_THREAD_MIN_PRIORITY) != JVMTI_ERROR_NONE) {
+      env->ExceptionClear();
+      return false;
+    }
+
+    return true;
+  }
+
+  // Called in a reader's scope (see SiteTable::Reader).
+  void ApplyFree(jlong tag) {
+    const uint32_t epoch = SiteTagEpoch(tag);
+    const uint32_t index = SiteTagIndex(tag);
+    const jlong size = SiteTagSize(tag);
+
+    // Objects allocated before the profile was last cleared aren't
+    // in it anymore.
+    if (epoch != (epoch_ & kTagEpochMask))
+      return;
+
+    Site* s = sites_->ByIndex(index);
+    if (s != NULL) {
+      __sync_sub_and_fetch(&s->inuse_objects, 1);
+      __sync_sub_and_fetch(&s->inuse_bytes, size);
+      MarkChanged(s);
+    }
+  }
+
+  void JNICALL ClassFileLoadHook(
+      jvmtiEnv* jvmti, JNIEnv* env,
+      jclass class_being_redefined, jobject loader,
+      const char* name, jobject protection_domain,
+      jint class_data_len, const unsigned char* class_data,
+      jint* new_class_data_len, unsigned char** new_class_data) {
+    // This is where the magic rewriting happens. When we aren't
+    // profiling, we leave the class (or, when retransforming, its
+    // original image) alone.
+    if (!instrumenting_)
+      return;
+
+    char* classname;
+    if (name == NULL) {
+      classname = java_crw_demo_classname(class_data, class_data_len, NULL);
+      if (classname == NULL)
+        errx(3, "Failed to find classname\n");
+    } else {
+      if ((classname = strdup(name)) == NULL)
+        errx(3, "malloc failed\n");
+    }
+
+    // Ignore the helper class.
+    if (strcmp(classname, HELPER_CLASS) == 0) {
+      free(classname);
+      return;
+    }
+
+    // Classes retransformed after VM start retain their system
+    // status by way of their loader.
+    const bool tick = injection_ == kInjectTick;
+    unsigned class_num = 0;
+    bool is_system_class;
+    {
+      Lock l(monitor_);
+      if (tick)
+        class_num = ClassNumber(classname);
+      is_system_class = !vm_started_ ||
+          (class_being_redefined != NULL && loader == NULL);
+    }
+
+    // The big magic: rewrite the class with our instrumentation.
+    unsigned char* new_image = NULL;
+    long new_length = 0L;
+
+    java_crw_demo(
+      class_num,
+      classname,
+      class_data,
+      class_data_len,
+      is_system_class ? 1 : 0,
+      (char*)HELPER_CLASS,
+      (char*)("L" HELPER_CLASS ";"),
+      NULL, NULL,
+      NULL, NULL,
+      tick ? (char*)"constructed" : (char*)"newObject",
+      (char*)"(Ljava/lang/Object;)V",
+      tick ? (char*)"constructed" : (char*)"newObject",
+      (char*)"(Ljava/lang/Object;)V",
+      tick ? (char*)"newInstance" : NULL,
+      tick ? (char*)"(II)V" : NULL,
+      tick ? (char*)"newArray" : NULL,
+      tick ? (char*)"(III)V" : NULL,
+      &new_image,
+      &new_length,
+      NULL,
+      tick ? &Heapster::CRW_MethodNumbers : NULL,
+      &Heapster::CRW_AllocationSite);
+
+    // Classes being retransformed are already prepared, so we can
+    // resolve their new allocation sites right away.
+    if (tick && class_being_redefined != NULL)
+      ResolveAllocationSites(class_being_redefined, classname);
+
+    if (new_length > 0L) {
+      // Success. We now need to allocate it with the JVMTI allocator,
+      // copy the definition there, and set the corresponding
+      // pointers.
+      void* bufp;
+      Assert(jvmti_->Allocate(new_length, (unsigned char**)&bufp),
+             "failed to allocate buffer for new classfile");
+
+      memcpy(bufp, new_image, new_length);
+      *new_class_data_len = (jint)new_length;
+      *new_class_data = (unsigned char*)bufp;
+    }
+
+    if (new_image != NULL)
+      free(new_image);
+
+    free(classname);
+  }
+
+  // Called by the helper for allocations that crossed a sampling
+  // point. Returns the number of bytes until the next one.
+  jlong NewObject(JNIEnv* env, jclass klass, jthread thread, jobject o) {
+    // Skip _newObject and the helper's newObject.
+    RecordSample(thread, o, ObjectSize(o), 2);
+    return NextSamplingPoint();
+  }
+
+  // Called by the helper, in tick injection mode, for allocations
+  // that crossed a sampling point. The object isn't there yet: it's
+  // handed over once constructed (see HandOver).
+  jlong NewAllocation(JNIEnv* env, jthread thread, jint site, jlong size) {
+    jvmtiFrameInfo frame;
+    frame.method = NULL;
+    if (top_frame_only_) {
+      Lock l(monitor_);
+      if (site >= 0 && (size_t)site < alloc_sites_.size()) {
+        frame.method = alloc_sites_[site].method;
+        frame.location = alloc_sites_[site].bci;
+      }
+    }
+
+    const uint64_t type =
+        event_out_ != NULL ? SiteEventType(site) : kEventUnknownType;
+    jlong tag;
+    if (frame.method != NULL) {
+      tag = RecordStack(&frame, 1, NULL, size, type);
+    } else {
+      // Skip _newAllocation, the helper's allocate, and its
+      // newInstance or newArray.
+      tag = RecordSample(thread, NULL, size, 3, type);
+    }
+
+    pending_object.tag = tag;
+    pending_object.site = site;
+    pending_object.misses = 0;
+    return NextSamplingPoint();
+  }
+
+  // Called by the helper, in tick injection mode, with the objects
+  // constructed by a thread whose stripe awaits a sampled one. Until
+  // this thread's is constructed, others may be, as its constructor's
+  // arguments, so we take the first of the type allocated at its
+  // site, within kMaxHandOvers objects. Returns whether the thread
+  // is done waiting.
+  jboolean HandOver(JNIEnv* env, jobject o) {
+    PendingObject& pending = pending_object;
+    if (pending.tag == 0)
+      return false;  // Another thread's, sharing the stripe.
+
+    if (!IsSiteType(env, o, pending.site)) {
+      if (++pending.misses < kMaxHandOvers)
+        return false;
+      pending.tag = 0;
+      return true;
+    }
+
+    const jlong tag = pending.tag;
+    pending.tag = 0;
+
+    // As for samples, objects of an earlier epoch aren't counted.
+    SiteTable::Reader reader(sites_);
+    if (SiteTagEpoch(tag) != (epoch_ & kTagEpochMask))
+      return true;
+    Site* s = sites_->ByIndex(SiteTagIndex(tag));
+    if (s == NULL)
+      return true;
+
+    __sync_add_and_fetch(&s->inuse_objects, 1);
+    __sync_add_and_fetch(&s->inuse_bytes, SiteTagSize(tag));
+    MarkChanged(s);
+    jvmti_->SetTag(o, tag);
+    return true;
+  }
+
+  // Whether an object is of the type the tick injection names for
+  // its site: foo/Bar for instances of Lfoo/Bar;, or the signature
+  // of arrays.
+  bool IsSiteType(JNIEnv* env, jobject o, jint site) {
+    jclass klass = env->GetObjectClass(o);
+    if (klass == NULL)
+      return false;
+
+    string signature;
+    {
+      Lock l(method_monitor_);
+      const string* found = ClassSignature(klass);
+      if (found != NULL)
+        signature = *found;
+    }
+    env->DeleteLocalRef(klass);
+    if (signature.empty())
+      return false;
+
+    Lock l(monitor_);
+    if (site < 0 || (size_t)site >= alloc_sites_.size())
+      return false;
+    const string& type = types_[alloc_sites_[site].type];
+    if (signature[0] != 'L')
+      return signature == type;
+    return signature.size() == type.size() + 2 &&
+        signature.compare(1, type.size(), type) == 0;
+  }
+
+  // Classes are numbered by name, so that a class keeps its number
+  // (and we don't grow) each time it is retransformed. Called with
+  // monitor_ held.
+  unsigned ClassNumber(const char* classname) {
+    map<string, unsigned>::const_iterator it = class_numbers_.find(classname);
+    if (it != class_numbers_.end())
+      return it->second;
+
+    const unsigned num = class_names_.size();
+    class_names_.push_back(classname);
+    class_numbers_[classname] = num;
+    return num;
+  }
+
+  // Allocation sites are numbered by class name, method and bytecode
+  // offset, so that they keep their numbers when a class is
+  // retransformed.
+  unsigned AllocationSiteNumber(
+      unsigned class_num, unsigned method_num, int bci, const char* type) {
+    const unsigned type_num = TypeNumber(type);
+
+    Lock l(monitor_);
+    const string& class_name = class_names_[class_num];
+    const string key = StringPrintf("%s#%u@%d", class_name.c_str(), method_num, bci);
+    map<string, unsigned>::const_iterator it = alloc_site_numbers_.find(key);
+    if (it != alloc_site_numbers_.end())
+      return it->second;
+
+    AllocationSite site;
+    site.class_name = class_name;
+    site.method_num = method_num;
+    site.bci = bci;
+    site.type = type_num;
+    site.method = NULL;
+
+    const unsigned num = alloc_sites_.size();
+    alloc_sites_.push_back(site);
+    alloc_site_numbers_[key] = num;
+    unnamed_sites_[class_num].push_back(num);
+    if (event_out_ != NULL)
+      SetSiteEventType(num, type_num);
+    return num;
+  }
+
+  // Called once java_crw_demo is done with a class: name the methods
+  // of its new allocation sites so we can resolve them later.
+  void MethodNumbers(
+      unsigned class_num, const char** names, const char** descrs, int count) {
+    Lock l(monitor_);
+    map<unsigned, vector<unsigned> >::iterator it = unnamed_sites_.find(class_num);
+    if (it == unnamed_sites_.end())
+      return;
+
+    vector<unsigned>& unresolved = unresolved_sites_[class_names_[class_num]];
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      AllocationSite& site = alloc_sites_[it->second[i]];
+      if (site.method_num >= (unsigned)count)
+        continue;
+
+      site.method_name = names[site.method_num];
+      site.method_signature = descrs[site.method_num];
+      unresolved.push_back(it->second[i]);
+    }
+
+    unnamed_sites_.erase(it);
+  }
+
+  // Find the jmethodIDs of a (prepared) class's allocation sites.
+  // Classes are matched by name alone, so we may pick up a namesake
+  // from another class loader; for profiling this is harmless.
+  void ResolveAllocationSites(jclass klass, const string& class_name) {
+    {
+      Lock l(monitor_);
+      if (unresolved_sites_.find(class_name) == unresolved_sites_.end())
+        return;
+    }
+
+    jint nmethods;
+    jmethodID* methods;
+    if (jvmti_->GetClassMethods(klass, &nmethods, &methods) != JVMTI_ERROR_NONE)
+      return;
+
+    map<string, jmethodID> by_name;
+    for (jint i = 0; i < nmethods; ++i) {
+      char* name;
+      char* signature;
+      if (jvmti_->GetMethodName(methods[i], &name, &signature, NULL) != JVMTI_ERROR_NONE)
+        continue;
+
+      by_name[string(name) + signature] = methods[i];
+      jvmti_->Deallocate(reinterpret_cast<unsigned char*>(name));
+      jvmti_->Deallocate(reinterpret_cast<unsigned char*>(signature));
+    }
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(methods));
+
+    Lock l(monitor_);
+    map<string, vector<unsigned> >::iterator it = unresolved_sites_.find(class_name);
+    if (it == unresolved_sites_.end())
+      return;
+
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      AllocationSite& site = alloc_sites_[it->second[i]];
+      map<string, jmethodID>::const_iterator m =
+          by_name.find(site.method_name + site.method_signature);
+      if (m != by_name.end())
+        site.method = m->second;
+    }
+
+    unresolved_sites_.erase(it);
+  }
+
+  unsigned TypeNumber(const char* type) {
+    Lock l(monitor_);
+    map<string, unsigned>::const_iterator it = type_numbers_.find(type);
+    if (it != type_numbers_.end())
+      return it->second;
+
+    unsigned num = types_.size();
+    types_.push_back(type);
+    type_numbers_[type] = num;
+    return num;
+  }
+
+  // The instance size, or element size for arrays, of the type
+  // allocated at a site; 0 if we don't know it (yet).
+  jint SiteSize(jint site) {
+    Lock l(monitor_);
+    if (site < 0 || (size_t)site >= alloc_sites_.size())
+      return 0;
+
+    const string& name = types_[alloc_sites_[site].type];
+    if (name[0] == '[')
+      return FieldSize(name[1]);
+
+    map<string, jint>::const_iterator it = instance_sizes_.find(name);
+    return it != instance_sizes_.end() ? it->second : 0;
+  }
+
+  void ClassPrepare(JNIEnv* env, jclass klass) {
+    if (async_get_call_trace_ != NULL)
+      AllocateMethodIDs(klass);
+
+    if (engine_ != kEngineBCI || injection_ != kInjectTick)
+      return;
+
+    const string name = SizeClass(env, klass);
+    if (!name.empty())
+      ResolveAllocationSites(klass, name);
+  }
+
+  // Estimates the instance size of a prepared class, for the tick
+  // injection's sites. Returns the class's name, as the injection
+  // knows it, or "" if it isn't a class of objects.
+  string SizeClass(JNIEnv* env, jclass klass) {
+    char* signature;
+    if (jvmti_->GetClassSignature(klass, &signature, NULL) != JVMTI_ERROR_NONE)
+      return "";
+
+    // Lfoo/Bar; names foo/Bar, as allocated by the tick injection.
+    string name;
+    if (signature[0] == 'L') {
+      name.assign(signature + 1, strlen(signature) - 2);
+      jint size = EstimateInstanceSize(env, klass);
+
+      Lock l(monitor_);
+      instance_sizes_[name] = size;
+    }
+
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(signature));
+    return name;
+  }
+
+  // Classes prepared before ClassPrepare was first sent (String, and
+  // much of java.util) are sized up front.
+  void SizeLoadedClasses(JNIEnv* env) {
+    jint nclasses;
+    jclass* classes;
+    if (jvmti_->GetLoadedClasses(&nclasses, &classes) != JVMTI_ERROR_NONE)
+      return;
+
+    for (jint i = 0; i < nclasses; ++i) {
+      jint status;
+      if (jvmti_->GetClassStatus(classes[i], &status) == JVMTI_ERROR_NONE &&
+          (status & JVMTI_CLASS_STATUS_PREPARED) &&
+          !(status & (JVMTI_CLASS_STATUS_ARRAY | JVMTI_CLASS_STATUS_PRIMITIVE)))
+        SizeClass(env, classes[i]);
+      env->DeleteLocalRef(classes[i]);
+    }
+
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(classes));
+  }
+
+  jlong ObjectSize(jobject o) {
+    jlong size;
+    Assert(jvmti_->GetObjectSize(o, &size),
+           "failed to get size of object");
+    return size;
+  }
+
+  jlong NextSamplingPoint() {
+    tcmalloc::Sampler* sampler = ThreadSampler();
+    if (sampler == NULL)
+      return sample_period_;
+
+    return sampler->PickNextSamplingPoint();
+  }
+
+  // Each thread owns its sampler, kept in JVMTI thread local storage
+  // and created on first use. Samplers pick up a changed sampling
+  // period lazily.
+  tcmalloc::Sampler* ThreadSampler() {
+    tcmalloc::Sampler* sampler;
+    if (jvmti_->GetThreadLocalStorage(NULL, (void**)&sampler) != JVMTI_ERROR_NONE)
+      return NULL;
+
+    const int period = sample_period_;
+    if (sampler != NULL && sampler->GetSamplePeriod() == period)
+      return sampler;
+
+    if (sampler == NULL) {
+      sampler = new tcmalloc::Sampler;
+      if (jvmti_->SetThreadLocalStorage(NULL, sampler) != JVMTI_ERROR_NONE) {
+        delete sampler;
+        return NULL;
+      }
+    }
+
+    // Samplers need distinct seeds; 0 would pick one based on the
+    // sampler's address, which may be reused.
+    uint32_t seed = __sync_add_and_fetch(&sampler_seed_, 1) * 2654435761U;
+    sampler->Init(seed != 0 ? seed : 1, period);
+    return sampler;
+  }
+
+  // The type is needed only for the event log, and only if the
+  // object isn't given.
+  jlong RecordSample(jthread thread, jobject o, jlong size, jint skip_frames,
+                     uint64_t type = kEventUnknownType) {
+    jvmtiFrameInfo frames[kMaxStackFrames];
+    jint nframes = -1;
+
+    // Start outside of our own code.
+    if (async_get_call_trace_ != NULL)
+      nframes = AsyncStackTrace(skip_frames, frames, arraysize(frames));
+
+    if (nframes < 0) {
+      jvmtiError error =
+          jvmti_->GetStackTrace(
+              thread, skip_frames, arraysize(frames),
+              frames, &nframes);
+
+      // TODO: keep track of these?
+      if (error == JVMTI_ERROR_WRONG_PHASE)
+        return 0;
+    }
+
+    return RecordStack(frames, nframes, o, size, type);
+  }
+
+  // Walks the current thread's stack with AsyncGetCallTrace. We're
+  // always called from Java (through a native, or an event), so it
+  // can start from the last Java frame and needs no signal context.
+  // Returns -1 if the walk failed.
+  jint AsyncStackTrace(jint skip_frames, jvmtiFrameInfo* frames, jint max_frames) {
+    JNIEnv* env;
+    if (jvm_->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_2) != JNI_OK)
+      return -1;
+
+    ASGCT_CallFrame async_frames[kMaxSkipFrames + kMaxStackFrames];
+    ASGCT_CallTrace trace;
+    trace.env_id = env;
+    trace.num_frames = 0;
+    trace.frames = async_frames;
+
+    async_get_call_trace_(&trace, skip_frames + max_frames, NULL);
+    if (trace.num_frames <= 0)
+      return -1;
+
+    jint nframes = 0;
+    for (jint i = skip_frames; i < trace.num_frames; ++i, ++nframes) {
+      frames[nframes].method = async_frames[i].method_id;
+      frames[nframes].location = async_frames[i].lineno >= 0
+          ? async_frames[i].lineno : -1;
+    }
+
+    return nframes;
+  }
+
+  // AsyncGetCallTrace can't create method IDs, so we create them for
+  // every class up front.
+  void AllocateMethodIDs(jclass klass) {
+    jint nmethods;
+    jmethodID* methods;
+    if (jvmti_->GetClassMethods(klass, &nmethods, &methods) == JVMTI_ERROR_NONE)
+      jvmti_->Deallocate(reinterpret_cast<unsigned char*>(methods));
+  }
+
+  void AllocateLoadedMethodIDs() {
+    jint nclasses;
+    jclass* classes;
+    if (jvmti_->GetLoadedClasses(&nclasses, &classes) != JVMTI_ERROR_NONE)
+      return;
+
+    for (jint i = 0; i < nclasses; ++i)
+      AllocateMethodIDs(classes[i]);
+
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(classes));
+  }
+
+  const char* StackWalkerName() const {
+    return async_get_call_trace_ != NULL ? "asgct" : "jvmti";
+  }
+
+  // Counts a sample, and tags its object. Returns the tag, or 0 if
+  // the object can't be tracked; without the object, its tag is for
+  // HandOver, which counts it as in use.
+  jlong RecordStack(jvmtiFrameInfo* frames, jint nframes, jobject o,
+                    jlong size, uint64_t type = kEventUnknownType) {
+    jmethodID methods[kMaxStackFrames];
+    for (jint i = 0; i < nframes; ++i)
+      methods[i] = frames[i].method;
+    const long h = StackHash(methods, nframes);
+
+    // The site we count in can't be reclaimed until we're done.
+    SiteTable::Reader reader(sites_);
+
+    // Read the epoch first: should the profile be cleared while
+    // we're counting, this sample may end up in the new profile, but
+    // its object will then never be subtracted from it.
+    const uint32_t epoch = epoch_;
+
+    bool inserted;
+    Site* s = FindOrInsertSite(h, methods, nframes, &inserted);
+    if (s == NULL)
+      s = FoldSite(h, methods, nframes, &inserted);
+    if (s == NULL)
+      return 0;
+    if (inserted)
+      NameMethods(s);
+
+    __sync_add_and_fetch(&s->alloc_objects, 1);
+    __sync_add_and_fetch(&s->alloc_bytes, size);
+    __sync_add_and_fetch(&s->lifetime_objects, 1);
+    __sync_add_and_fetch(&s->lifetime_bytes, size);
+
+    // Objects we can't track until freed only count as allocated.
+    const bool tracked = o != NULL && s->index < kMaxSites;
+    if (tracked) {
+      __sync_add_and_fetch(&s->inuse_objects, 1);
+      __sync_add_and_fetch(&s->inuse_bytes, size);
+    }
+
+    MarkChanged(s);
+    if (event_out_ != NULL)
+      LogAllocation(s, o, size, type);
+    if (s->index >= kMaxSites)
+      return 0;
+
+    // Record this allocation (& sampled size) for deallocation.
+    const jlong tag = MakeSiteTag(epoch, s->index, size);
+    if (tracked)
+      jvmti_->SetTag(o, tag);
+    return tag;
+  }
+
+  // This hash function was adapted from Google perftools.
+  static long StackHash(const jmethodID* methods, jint nframes) {
+    long h = 0;
+    for (int i = 0; i < nframes; i++) {
+      h += reinterpret_cast<uintptr_t>(methods[i]);
+      h += h << 10;
+      h ^= h >> 6;
+    }
+    h += h << 3;
+    h ^= h >> 11;
+    return h;
+  }
+
+  // With HEAPSTER_MAX_SITES, the table holds at most that many sites
+  // in all. A quarter of them are buckets, which the samples of
+  // stacks without sites of their own are folded into: one per
+  // allocating method, with the stack <method> <other>, and a last,
+  // <other> alone. The rest are for stacks. Past half of those, new
+  // stacks must first be sampled kAdmitSamples times, as counted by a
+  // sketch, so that the room goes to the stacks that recur. Once it's
+  // nearly all used, dumps evict the stacks sampled least to make
+  // room again, as Space-Saving would (see ChooseEvictions); new
+  // stacks must then have been sampled more often than any evicted.
+  //
+  // The sketch also bounds the error: no stack folded away has had
+  // more samples than the largest estimate of any folded sample, plus
+  // the most that any evicted site had, which dumps report.
+  bool AdmitSite(long h, const jmethodID* methods, jint nframes) {
+    if (max_sites_ == 0)
+      return true;
+
+    // <other> is inserted up front, and counts as a bucket.
+    if (IsBucket(methods, nframes))
+      return nframes == 1 || num_buckets_ <= MaxBuckets();
+
+    const uint32_t n = NumStackSites();
+    if (n >= MaxStackSites())
+      return false;
+    if (n < MaxStackSites() / 2)
+      return true;
+
+    const jlong evicted = evicted_max_;
+    return sketch_->Estimate(h) >= max(kAdmitSamples, evicted + 1);
+  }
+
+  static bool IsBucket(const jmethodID* methods, jint nframes) {
+    return nframes > 0 && methods[nframes - 1] == kOtherFrame;
+  }
+
+  uint32_t MaxBuckets() const { return max_sites_ / 4; }
+  uint32_t MaxStackSites() const { return max_sites_ - MaxBuckets() - 1; }
+
+  // The sites of stacks, rather than buckets; read racily.
+  uint32_t NumStackSites() const {
+    const uint32_t size = sites_->size(), buckets = num_buckets_;
+    return size > buckets ? size - buckets : 0;
+  }
+
+  // The most sites the table may hold.
+  uint32_t SiteLimit() const {
+    return max_sites_ > 0 ? max_sites_ : ~0u;
+  }
+
+  Site* FoldSite(long h, const jmethodID* methods, jint nframes,
+                 bool* inserted) {
+    const jlong estimate = sketch_->Add(h, 1);
+    __sync_add_and_fetch(&folded_samples_, 1);
+    for (jlong max = folded_max_; estimate > max;  max = folded_max_) {
+      if (__sync_bool_compare_and_swap(&folded_max_, max, estimate))
+        break;
+    }
+    return BucketSite(methods, nframes, inserted);
+  }
+
+  // The bucket for a stack's allocating method, or, if there's no
+  // room for it, <other>.
+  Site* BucketSite(const jmethodID* methods, jint nframes, bool* inserted) {
+    jmethodID bucket[2];
+    jint n = 0;
+    if (nframes > 0)
+      bucket[n++] = methods[0];
+    bucket[n++] = kOtherFrame;
+
+    Site* s = FindOrInsertSite(StackHash(bucket, n), bucket, n, inserted);
+    if (s == NULL) {
+      s = FindOrInsertSite(StackHash(bucket + n - 1, 1), bucket + n - 1, 1,
+                           inserted);
+    }
+    return s;
+  }
+
+  // Marks a site as changed since the last delta dump. We read the
+  // dump id after updating the counts: a delta dump bumps the id
+  // before reading them, so an update that it misses is always
+  // marked for the next one.
+  void MarkChanged(Site* s) {
+    __sync_synchronize();
+    s->changed = dump_id_;
+  }
+
+  // Lookups and inserts take no lock (see heapster_sites.h), and
+  // return NULL for stacks that aren't admitted (see AdmitSite).
+  Site* FindOrInsertSite(long h, const jmethodID* methods, jint nframes,
+                         bool* inserted) {
+    *inserted = false;
+    Site* s = sites_->Find(h, methods, nframes);
+    if (s != NULL || !AdmitSite(h, methods, nframes))
+      return s;
+
+    s = sites_->Insert(h, methods, nframes, SiteLimit(), inserted);
+    if (*inserted && max_sites_ > 0 && IsBucket(methods, nframes))
+      __sync_add_and_fetch(&num_buckets_, 1);
+    return s;
+  }
+
+  // Methods are named ("Lfoo/Bar;baz") when first seen in a stack,
+  // so that dumps make no JVMTI calls, and so that we can still name
+  // them after their class is unloaded. Class signatures are shared
+  // by the class's methods, and found through the class's tag.
+  //
+  // We may be called with a stack's worth of new methods, and from
+  // agent threads that never return to Java, so we delete the local
+  // references to their classes as we go.
+  void NameMethods(const Site* s) {
+    JNIEnv* env;
+    if (jvm_->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_2) != JNI_OK)
+      env = NULL;
+
+    Lock l(method_monitor_);
+    for (int i = 0; i < s->nframes; ++i) {
+      const jmethodID method = s->stack[i];
+      if (method_names_.find(method) != method_names_.end())
+        continue;
+
+      // Read before the site's counts are first updated, so that
+      // deltas name methods no later than their first site.
+      const uint32_t dump = dump_id_;
+
+      char* method_name;
+      jvmtiError error =
+          jvmti_->GetMethodName(method, &method_name, NULL, NULL);
+      if (error != JVMTI_ERROR_NONE)
+        continue;
+
+      jclass declaring_class;
+      error = jvmti_->GetMethodDeclaringClass(method, &declaring_class);
+      if (error == JVMTI_ERROR_NONE) {
+        const string* signature = ClassSignature(declaring_class);
+        if (signature != NULL) {
+          NamedMethod& named = method_names_[method];
+          named = NamedMethod(*signature + method_name, dump);
+          named.file = SourceFile(declaring_class, *signature);
+          named.line = FirstLine(method);
+        }
+        if (env != NULL)
+          env->DeleteLocalRef(declaring_class);
+      }
+
+      jvmti_->Deallocate(reinterpret_cast<unsigned char*>(method_name));
+    }
+  }
+
+  // The path of the class's source file, as javac would lay it out
+  // by package; empty if the class doesn't say.
+  string SourceFile(jclass klass, const string& signature) {
+    char* file;
+    if (!source_info_ ||
+        jvmti_->GetSourceFileName(klass, &file) != JVMTI_ERROR_NONE)
+      return "";
+
+    // "Lfoo/bar/Baz;" is in foo/bar.
+    string path;
+    const size_t slash = signature.rfind('/');
+    if (signature.size() > 1 && signature[0] == 'L' && slash != string::npos)
+      path = signature.substr(1, slash);
+
+    path += file;
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(file));
+    return path;
+  }
+
+  // The line the method starts at, or 0 if unknown (as for native
+  // methods).
+  jint FirstLine(jmethodID method) {
+    jint count;
+    jvmtiLineNumberEntry* table;
+    if (!source_info_ ||
+        jvmti_->GetLineNumberTable(method, &count, &table) != JVMTI_ERROR_NONE)
+      return 0;
+
+    jint line = 0;
+    jlocation first = 0;
+    for (jint i = 0; i < count; ++i) {
+      if (line == 0 || table[i].start_location < first) {
+        first = table[i].start_location;
+        line = table[i].line_number;
+      }
+    }
+
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(table));
+    return line;
+  }
+
+  // Called with method_monitor_ held.
+  const string* ClassSignature(jclass klass) {
+    jlong tag;
+    if (jvmti_->GetTag(klass, &tag) == JVMTI_ERROR_NONE && (tag & kTagClass))
+      return &class_signatures_[tag & kTagClassIndex];
+
+    char* signature;
+    if (jvmti_->GetClassSignature(klass, &signature, NULL) != JVMTI_ERROR_NONE)
+      return NULL;
+
+    const jlong index = class_signatures_.size();
+    class_signatures_.push_back(signature);
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(signature));
+    jvmti_->SetTag(klass, kTagClass | index);
+    return &class_signatures_.back();
+  }
+
+  // Profiles count allocations since the profile was last cleared,
+  // or, if lifetime is set, since the site was first seen. They're
+  // written in the perftools heap profile format, or, if proto is
+  // set, as a gzipped profile.proto for pprof. Returns false if the
+  // profile couldn't be written out.
+  bool DumpProfile(JNIEnv* env, Sink* sink, bool force_gc, bool lifetime,
+                   bool proto) {
+    if (force_gc) {
+      jvmtiError error = jvmti_->ForceGarbageCollection();
+      if (error != JVMTI_ERROR_NONE)
+        warnx("Failed to force garbage collection.\n");
+      else if (deferred_frees_)
+        SettleFrees();
+    }
+
+    DrainFrees();
+
+    Lock l(dump_monitor_);
+    EvictSites();
+    SnapshotProfile(lifetime, 0);
+
+    if (proto) {
+      GzipSink gzip(sink);
+      ProfileWriter out(&gzip);
+      WriteProto(&out);
+      return out.Flush() && gzip.Finish();
+    }
+
+    ProfileWriter out(sink);
+    WriteSymbols(&out, false, 0);
+    out.Append("--- heap\n");
+
+    // Write out the sites in the heap profiler's text format. The
+    // header holds the totals, so we make two passes.
+    long long total_inuse_objects = 0, total_inuse_bytes = 0;
+    long long total_alloc_objects = 0, total_alloc_bytes = 0;
+
+    for (size_t n = 0; n < snapshot_.size(); ++n) {
+      const SiteSnapshot& snap = snapshot_[n];
+      total_inuse_objects += snap.inuse_objects;
+      total_inuse_bytes += snap.inuse_bytes;
+      total_alloc_objects += snap.alloc_objects;
+      total_alloc_bytes += snap.alloc_bytes;
+    }
+
+    // The counts are already unsampled, as they are for perftools'
+    // own heap profiler, so pprof mustn't adjust them.
+    out.Printf("heap profile: %6lld: %8lld [%6lld: %8lld] @ heapprofile\n",
+               total_inuse_objects, total_inuse_bytes,
+               total_alloc_objects, total_alloc_bytes);
+    WriteSites(&out);
+
+    // Extra sections go in place of the memory map, which pprof
+    // doesn't need for us.
+    if (counting_ || max_sites_ > 0)
+      out.Append("\nMAPPED_LIBRARIES:\n");
+    if (counting_)
+      DumpCounts(env, &out);
+    if (max_sites_ > 0)
+      DumpFolded(&out);
+
+    return out.Flush();
+  }
+
+  // Describes how much of the profile was folded away.
+  void DumpFolded(ProfileWriter* out) {
+    const vector<string> lines = FoldedSummary();
+    out->Append("--- folded\n");
+    for (size_t i = 0; i < lines.size(); ++i)
+      out->Printf("%s\n", lines[i].c_str());
+  }
+
+  vector<string> FoldedSummary() {
+    const uint32_t buckets = num_buckets_;
+    const uint32_t sites = sites_->size();
+
+    // Most samples are of objects smaller than the period, and so
+    // stand for about a period's worth of bytes.
+    const jlong max = folded_max_ + evicted_max_;
+    vector<string> lines;
+    lines.push_back(StringPrintf("sites: %u of at most %u, %u of them folded",
+                                 sites, max_sites_, buckets));
+    lines.push_back(StringPrintf("folded samples: %lld",
+                                 (long long)folded_samples_));
+    lines.push_back(StringPrintf("evicted sites: %lld",
+                                 (long long)evictions_));
+    lines.push_back(StringPrintf(
+        "error bound: no stack folded away has more than %lld samples "
+        "(about %lld bytes) since the start",
+        (long long)max, (long long)max * sample_period_));
+    return lines;
+  }
+
+  // Delta dumps are numbered, and hold only what changed since an
+  // earlier one: the sites whose counts changed (their counts in
+  // full, which may now be zero) and the methods named since. Dump 0
+  // is the empty profile, so a delta since 0 is complete.
+  // heapster-merge applies deltas to reconstruct full profiles.
+  bool DumpProfileDelta(JNIEnv* env, Sink* sink, uint32_t since) {
+    DrainFrees();
+
+    Lock l(dump_monitor_);
+    EvictSites();
+    const uint32_t dump = __sync_fetch_and_add(&dump_id_, 1);
+    SnapshotProfile(false, since);
+
+    ProfileWriter out(sink);
+    WriteSymbols(&out, true, since);
+    out.Append("--- heap delta\n");
+    out.Printf("dump: %u\nsince: %u\n", dump, since);
+    WriteSites(&out);
+    return out.Flush();
+  }
+
+  // Writes the snapshot as a profile.proto message. Frames are kept
+  // by method, so each method has a single location, at its first
+  // line. Messages are encoded into reused buffers and written out
+  // as top-level fields, which may come in any order; the string
+  // table comes last, once we know all of its strings.
+  void WriteProto(ProfileWriter* out) {
+    enum {
+      kProfileSampleType = 1,
+      kProfileSample = 2,
+      kProfileLocation = 4,
+      kProfileFunction = 5,
+      kProfileStringTable = 6,
+      kProfileTimeNanos = 9,
+      kProfilePeriodType = 11,
+      kProfilePeriod = 12,
+      kProfileComment = 13,
+      kProfileDefaultSampleType = 14,
+
+      kValueTypeType = 1,
+      kValueTypeUnit = 2,
+
+      kSampleLocationId = 1,
+      kSampleValue = 2,
+
+      kLocationId = 1,
+      kLocationLine = 4,
+
+      kLineFunctionId = 1,
+      kLineLine = 2,
+
+      kFunctionId = 1,
+      kFunctionName = 2,
+      kFunctionSystemName = 3,
+      kFunctionFilename = 4,
+      kFunctionStartLine = 5
+    };
+
+    map<string, jlong> string_ids;
+    vector<const string*> strings;
+    Intern(&string_ids, &strings, "");
+
+    ProtoBuffer message, field, values;
+
+    vector<jlong> comments;
+    if (max_sites_ > 0) {
+      const vector<string> lines = FoldedSummary();
+      for (size_t i = 0; i < lines.size(); ++i)
+        comments.push_back(Intern(&string_ids, &strings, lines[i]));
+    }
+
+    // The sample values, in the order of the snapshot's counts.
+    static const char* const kSampleTypes[][2] = {
+      {"inuse_objects", "count"},
+      {"inuse_space", "bytes"},
+      {"alloc_objects", "count"},
+      {"alloc_space", "bytes"}
+    };
+
+    for (size_t i = 0; i < arraysize(kSampleTypes); ++i) {
+      field.clear();
+      field.Int(kValueTypeType, Intern(&string_ids, &strings, kSampleTypes[i][0]));
+      field.Int(kValueTypeUnit, Intern(&string_ids, &strings, kSampleTypes[i][1]));
+      message.clear();
+      message.Bytes(kProfileSampleType, field);
+      out->Append(message.data());
+    }
+
+    // Locations (and functions) are numbered from 1, by method.
+    map<jmethodID, uint64_t> location_ids;
+    vector<jmethodID> locations;
+
+    for (size_t n = 0; n < snapshot_.size(); ++n) {
+      const SiteSnapshot& snap = snapshot_[n];
+      const Site* s = snap.site;
+
+      values.clear();
+      for (int i = 0; i < s->nframes; ++i) {
+        map<jmethodID, uint64_t>::iterator it = location_ids.find(s->stack[i]);
+        if (it == location_ids.end()) {
+          locations.push_back(s->stack[i]);
+          it = location_ids.insert(
+              make_pair(s->stack[i], locations.size())).first;
+        }
+        values.Varint(it->second);
+      }
+
+      field.clear();
+      field.Bytes(kSampleLocationId, values);
+
+      values.clear();
+      values.Varint(snap.inuse_objects);
+      values.Varint(snap.inuse_bytes);
+      values.Varint(snap.alloc_objects);
+      values.Varint(snap.alloc_bytes);
+      field.Bytes(kSampleValue, values);
+
+      message.clear();
+      message.Bytes(kProfileSample, field);
+      out->Append(message.data());
+    }
+
+    vector<NamedMethod> names;
+    CopyMethodNames(locations, &names);
+
+    for (size_t i = 0; i < locations.size(); ++i) {
+      const uint64_t id = i + 1;
+      const NamedMethod* named = !names[i].name.empty() ? &names[i] : NULL;
+
+      values.clear();
+      values.Int(kLineFunctionId, id);
+      if (named != NULL && named->line > 0)
+        values.Int(kLineLine, named->line);
+
+      field.clear();
+      field.Int(kLocationId, id);
+      field.Bytes(kLocationLine, values);
+      message.clear();
+      message.Bytes(kProfileLocation, field);
+      out->Append(message.data());
+
+      // Unnamed methods are left for pprof to show by address.
+      const jlong name = named != NULL
+          ? Intern(&string_ids, &strings, named->name) : 0;
+      const jlong file = named != NULL
+          ? Intern(&string_ids, &strings, named->file) : 0;
+
+      field.clear();
+      field.Int(kFunctionId, id);
+      field.Int(kFunctionName, name);
+      field.Int(kFunctionSystemName, name);
+      field.Int(kFunctionFilename, file);
+      if (named != NULL && named->line > 0)
+        field.Int(kFunctionStartLine, named->line);
+      message.clear();
+      message.Bytes(kProfileFunction, field);
+      out->Append(message.data());
+    }
+
+    for (size_t i = 0; i < strings.size(); ++i) {
+      message.clear();
+      message.Bytes(kProfileStringTable, *strings[i]);
+      out->Append(message.data());
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    message.clear();
+    message.Int(kProfileTimeNanos,
+                now.tv_sec * 1000000000LL + now.tv_usec * 1000LL);
+
+    field.clear();
+    field.Int(kValueTypeType, string_ids["inuse_space"]);
+    field.Int(kValueTypeUnit, string_ids["bytes"]);
+    message.Bytes(kProfilePeriodType, field);
+    message.Int(kProfilePeriod, sample_period_);
+    message.Int(kProfileDefaultSampleType, string_ids["inuse_space"]);
+    for (size_t i = 0; i < comments.size(); ++i)
+      message.Int(kProfileComment, comments[i]);
+    out->Append(message.data());
+  }
+
+  // Numbers strings for the string table, which points to the
+  // copies kept as keys of the map.
+  static jlong Intern(map<string, jlong>* ids, vector<const string*>* strings,
+                      const string& s) {
+    map<string, jlong>::iterator it = ids->find(s);
+    if (it == ids->end()) {
+      it = ids->insert(make_pair(s, static_cast<jlong>(strings->size()))).first;
+      strings->push_back(&it->first);
+    }
+    return it->second;
+  }
+
+  // Writes the symbol section: the methods in the snapshot's stacks,
+  // or, for deltas, those named since the given dump.
+  // Names are copied out first, so that method_monitor_ (and with
+  // it, sampling) isn't held while we write.
+  void WriteSymbols(ProfileWriter* out, bool delta, uint32_t since) {
+    vector<jmethodID> methods;
+    vector<NamedMethod> names;
+
+    if (delta) {
+      Lock l(method_monitor_);
+      for (map<jmethodID, NamedMethod>::const_iterator it = method_names_.begin();
+           it != method_names_.end(); ++it) {
+        if (it->second.dump > since) {
+          methods.push_back(it->first);
+          names.push_back(it->second);
+        }
+      }
+    } else {
+      set<jmethodID> seen_methods;
+      for (size_t n = 0; n < snapshot_.size(); ++n) {
+        const Site* s = snapshot_[n].site;
+        for (int i = 0; i < s->nframes; ++i) {
+          if (seen_methods.insert(s->stack[i]).second)
+            methods.push_back(s->stack[i]);
+        }
+      }
+
+      CopyMethodNames(methods, &names);
+    }
+
+    // TODO: change "binary" to main class name?
+    out->Append("--- symbol\nbinary=heapster\n");
+
+    for (size_t i = 0; i < methods.size(); ++i) {
+      if (!names[i].name.empty())
+        WriteSymbol(out, methods[i], names[i].name);
+    }
+
+    out->Append("---\n");
+  }
+
+  // Unnamed methods are given an empty name.
+  void CopyMethodNames(const vector<jmethodID>& methods,
+                       vector<NamedMethod>* names) {
+    names->assign(methods.size(), NamedMethod());
+
+    Lock l(method_monitor_);
+    for (size_t i = 0; i < methods.size(); ++i) {
+      map<jmethodID, NamedMethod>::const_iterator it =
+          method_names_.find(methods[i]);
+      if (it != method_names_.end())
+        (*names)[i] = it->second;
+    }
+  }
+
+  static void WriteSymbol(ProfileWriter* out, jmethodID method,
+                          const string& name) {
+    // pprof looks callers up one byte before their address (at the
+    // call instruction, in native code), so name both.
+    uintptr_t frame = reinterpret_cast<uintptr_t>(method);
+    out->Printf(FRAME_FORMAT " %s\n", frame, name.c_str());
+    out->Printf(FRAME_FORMAT " %s\n", frame - 1, name.c_str());
+  }
+
+  void WriteSites(ProfileWriter* out) {
+    for (size_t n = 0; n < snapshot_.size(); ++n) {
+      const SiteSnapshot& snap = snapshot_[n];
+      out->Printf("%6lld: %8lld [%6lld: %8lld] @",
+                  snap.inuse_objects, snap.inuse_bytes,
+                  snap.alloc_objects, snap.alloc_bytes);
+
+      const Site* s = snap.site;
+      for (int i = 0; i < s->nframes; ++i)
+        out->Printf(" " FRAME_FORMAT, reinterpret_cast<uintptr_t>(s->stack[i]));
+      out->Append("\n");
+    }
+  }
+
+  // Sampling picks an allocation of s bytes with probability
+  // 1 - e^(-s/period); each sample of a site, whose allocations we
+  // take to be of its average size, thus stands for 1/(that) of
+  // them.
+  static void Unsample(jlong objects, jlong bytes, int period,
+                       long long* unsampled_objects,
+                       long long* unsampled_bytes) {
+    // Counts may briefly dip below zero, should a free be accounted
+    // for before its allocation.
+    if (objects < 0)
+      objects = 0;
+    if (bytes < 0)
+      bytes = 0;
+
+    double scale = 1;
+    if (objects > 0 && bytes > 0 && period > 0) {
+      const double size = static_cast<double>(bytes) / objects;
+      scale = 1 / (1 - exp(-size / period));
+    }
+
+    *unsampled_objects = static_cast<long long>(objects * scale + 0.5);
+    *unsampled_bytes = static_cast<long long>(bytes * scale + 0.5);
+  }
+
+  // Exact counts are written as text in place of the memory map
+  // that pprof expects (and skips what it doesn't recognize of) at
+  // the end of a heap profile: one line per site, then one per
+  // class.
+  void DumpCounts(JNIEnv* env, ProfileWriter* out) {
+    jclass klass = env->FindClass(HELPER_CLASS);
+    if (klass == NULL)
+      return;
+
+    jmethodID method = env->GetStaticMethodID(
+        klass, HELPER_METHOD_SITECOUNTS, "()[J");
+    if (method == NULL)
+      return;
+
+    jlongArray array = static_cast<jlongArray>(
+        env->CallStaticObjectMethod(klass, method));
+    if (array == NULL)
+      return;
+
+    vector<jlong> counts(env->GetArrayLength(array));
+    if (!counts.empty())
+      env->GetLongArrayRegion(array, 0, counts.size(), &counts[0]);
+    env->DeleteLocalRef(array);
+
+    const size_t nsites = counts.size() / 2;
+    map<string, pair<jlong, jlong> > classes;
+
+    // Format the lines under the lock, which instrumentation takes to
+    // add sites, and write them out once it's released.
+    vector<string> lines;
+    {
+      Lock l(monitor_);
+      for (size_t i = 0; i < nsites; ++i) {
+        const jlong objects = counts[2*i], bytes = counts[2*i + 1];
+        if (objects == 0)
+          continue;
+
+        if (i >= alloc_sites_.size())
+          continue;
+
+        const AllocationSite& site = alloc_sites_[i];
+        const string& type = types_[site.type];
+        lines.push_back(StringPrintf("%lld %lld %s.%s%s@%d %s\n",
+                                     (long long)objects, (long long)bytes,
+                                     site.class_name.c_str(),
+                                     site.method_name.c_str(),
+                                     site.method_signature.c_str(),
+                                     site.bci, type.c_str()));
+
+        pair<jlong, jlong>& c = classes[type];
+        c.first += objects;
+        c.second += bytes;
+      }
+    }
+
+    out->Append("--- counts\n");
+    out->Append("# objects bytes site\n");
+    for (size_t i = 0; i < lines.size(); ++i)
+      out->Append(lines[i]);
+
+    out->Append("--- class counts\n");
+    out->Append("# objects bytes class\n");
+    for (map<string, pair<jlong, jlong> >::const_iterator it = classes.begin();
+         it != classes.end(); ++it) {
+      out->Printf("%lld %lld %s\n",
+                  (long long)it->second.first,
+                  (long long)it->second.second,
+                  it->first.c_str());
+    }
+  }
+
+  // Clearing the profile reclaims the sites that have been idle
+  // since it was last cleared (and evicts as dumps do), and zeroes
+  // the rest in place. Allocations from earlier epochs are then
+  // ignored when freed. Empty sites are left out of profiles. Dumps
+  // hold on to sites, so we exclude them.
+  void ClearProfile() {
+    DrainFrees();
+
+    Lock dump_lock(dump_monitor_);
+    const uint32_t epoch = epoch_;
+    vector<const Site*> victims;
+    ChooseEvictions(&victims);
+    SiteReclaimer reclaimer(this, victims, true);
+    sites_->Reclaim(&reclaimer);
+
+    Lock l(monitor_);
+    if (epoch_ == epoch)
+      __sync_add_and_fetch(&epoch_, 1);
+    const SiteTable::Slots* table = sites_->slots();
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+      Site* site = table->At(i);
+      if (site == NULL)
+        continue;
+
+      __sync_lock_test_and_set(&site->alloc_objects, 0);
+      __sync_lock_test_and_set(&site->alloc_bytes, 0);
+      __sync_lock_test_and_set(&site->inuse_objects, 0);
+      __sync_lock_test_and_set(&site->inuse_bytes, 0);
+      MarkChanged(site);
+    }
+  }
+
+  // A site is idle if nothing was sampled there since the profile was
+  // last cleared, and if the last delta dump (if any) has reported
+  // that. Idle sites are reclaimed, but for the last <other>, which
+  // keeps their lifetime counts, and for those in the event log,
+  // which refers to them by index for good.
+  bool IsIdle(const Site* s) const {
+    if (s->alloc_objects != 0 || s->inuse_objects != 0 || s->logged)
+      return false;
+    if (dump_id_ > 1 && s->changed >= dump_id_)
+      return false;
+    return !(s->nframes == 1 && s->stack[0] == kOtherFrame);
+  }
+
+  // With HEAPSTER_MAX_SITES, once stacks have used nearly all of
+  // their room, and more have been folded away since we last looked,
+  // picks the stack sites sampled least (in their lifetime) to evict,
+  // as long as they were sampled less than the busiest stack folded
+  // away: up to an eighth of the room. Sites with objects in use are
+  // kept, as their tags refer to them, as are those in the event log.
+  // Delta dumps report sites by stack, so once they're in use, only
+  // sites whose last report was of nothing allocated are evicted.
+  // Called with dump_monitor_ held; returns the victims sorted.
+  void ChooseEvictions(vector<const Site*>* victims) {
+    victims->clear();
+    if (max_sites_ == 0 || NumStackSites() < MaxStackSites() * 7 / 8)
+      return;
+
+    const jlong folded = folded_samples_;
+    if (folded == folded_at_eviction_)
+      return;
+    folded_at_eviction_ = folded;
+
+    const jlong busiest = folded_max_;
+    vector<pair<jlong, const Site*> > candidates;
+    const SiteTable::Slots* table = sites_->slots();
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+      const Site* s = table->At(i);
+      if (s == NULL || IsBucket(s->stack, s->nframes))
+        continue;
+      if (s->lifetime_objects >= busiest || s->inuse_objects != 0 ||
+          s->logged)
+        continue;
+      if (dump_id_ > 1 && (s->alloc_objects != 0 || s->changed >= dump_id_))
+        continue;
+      candidates.push_back(make_pair(jlong(s->lifetime_objects), s));
+    }
+
+    const size_t n = min(candidates.size(),
+                         static_cast<size_t>(max(MaxStackSites() / 8, 1u)));
+    nth_element(candidates.begin(), candidates.begin() + n, candidates.end());
+    for (size_t i = 0; i < n; ++i)
+      victims->push_back(candidates[i].second);
+    sort(victims->begin(), victims->end());
+  }
+
+  // Called with dump_monitor_ held, before dumps take their
+  // snapshot.
+  void EvictSites() {
+    vector<const Site*> victims;
+    ChooseEvictions(&victims);
+    if (victims.empty())
+      return;
+
+    SiteReclaimer reclaimer(this, victims, false);
+    sites_->Reclaim(&reclaimer);
+  }
+
+  // Starts a new epoch, once samplers can no longer reach the sites
+  // reclaimed when clearing the profile, before their indices are
+  // reused: objects tagged with them meanwhile must be of an old
+  // epoch by then.
+  void StartEpoch() {
+    __sync_add_and_fetch(&epoch_, 1);
+  }
+
+  // Folds the counts of a site that samplers can no longer reach:
+  // those of evicted sites into their buckets, so that profiles keep
+  // their totals, and the lifetime counts of idle ones into <other>.
+  // Objects sampled in evicted sites since they were picked are
+  // counted as allocated only; their frees are ignored.
+  void RetireSite(const Site* s, bool evicted) {
+    if (max_sites_ > 0 && IsBucket(s->stack, s->nframes))
+      __sync_sub_and_fetch(&num_buckets_, 1);
+    if (evicted) {
+      __sync_add_and_fetch(&evictions_, 1);
+      if (s->lifetime_objects > evicted_max_)
+        evicted_max_ = s->lifetime_objects;
+    }
+    if (s->lifetime_objects == 0)
+      return;
+
+    bool inserted;
+    Site* into = evicted
+        ? BucketSite(s->stack, s->nframes, &inserted)
+        : sites_->Insert(StackHash(&kOtherFrame, 1), &kOtherFrame, 1, ~0u,
+                         &inserted);
+    if (inserted)
+      NameMethods(into);
+
+    __sync_add_and_fetch(&into->alloc_objects, s->alloc_objects);
+    __sync_add_and_fetch(&into->alloc_bytes, s->alloc_bytes);
+    __sync_add_and_fetch(&into->lifetime_objects, s->lifetime_objects);
+    __sync_add_and_fetch(&into->lifetime_bytes, s->lifetime_bytes);
+    MarkChanged(into);
+  }
+
+  // Reclaims the victims chosen for eviction, and, when clearing the
+  // profile, idle sites. Evicted sites' objects were all freed when
+  // they were picked, but samplers may have tagged more since; their
+  // indices are only reused once the epoch has changed.
+  class SiteReclaimer : public SiteTable::Reclaimer {
+   public:
+    SiteReclaimer(Heapster* heapster, const vector<const Site*>& victims,
+                  bool clearing)
+        : heapster_(heapster), victims_(victims), clearing_(clearing) {}
+
+    virtual bool ShouldReclaim(const Site* s) {
+      return IsVictim(s) || (clearing_ && heapster_->IsIdle(s));
+    }
+
+    virtual void Reclaimed(Site* const* sites, size_t n) {
+      if (clearing_)
+        heapster_->StartEpoch();
+      for (size_t i = 0; i < n; ++i)
+        heapster_->RetireSite(sites[i], IsVictim(sites[i]));
+    }
+
+    virtual bool ReuseIndices() { return clearing_; }
+
+   private:
+    bool IsVictim(const Site* s) const {
+      return binary_search(victims_.begin(), victims_.end(), s);
+    }
+
+    Heapster*                  heapster_;
+    const vector<const Site*>& victims_;
+    bool                       clearing_;
+  };
+
+  // <other> stands for the stacks of reclaimed sites, and, with
+  // HEAPSTER_MAX_SITES, of those folded away; it then always has a
+  // site, so that there's room for it.
+  void AllocProfile() {
+    sites_ = new SiteTable(kInitialSiteTableSize);
+    method_names_[kOtherFrame] = NamedMethod("<other>", 1);
+
+    if (max_sites_ > 0) {
+      bool inserted;
+      FindOrInsertSite(StackHash(&kOtherFrame, 1), &kOtherFrame, 1,
+                       &inserted);
+    }
+  }
+
+  // Takes the (unsampled) counts of the non-empty sites for a dump,
+  // or, with since set, of those changed since that delta dump.
+  // Stacks never change, so they're shared rather than copied, and
+  // samplers aren't blocked: each counter is read once, atomically,
+  // though sites are read one by one. The snapshot's storage is
+  // reused from dump to dump. Called with dump_monitor_ held.
+  void SnapshotProfile(bool lifetime, uint32_t since) {
+    const int period = sample_period_;
+    const SiteTable::Slots* table = sites_->slots();
+
+    snapshot_.clear();
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+      const Site* site = table->At(i);
+      if (site == NULL)
+        continue;
+
+      const jlong alloc_objects =
+          lifetime ? site->lifetime_objects : site->alloc_objects;
+      const jlong alloc_bytes =
+          lifetime ? site->lifetime_bytes : site->alloc_bytes;
+      const jlong inuse_objects = site->inuse_objects;
+      const jlong inuse_bytes = site->inuse_bytes;
+      if (since > 0 ? site->changed <= since
+                    : alloc_objects <= 0 && inuse_objects <= 0)
+        continue;
+
+      SiteSnapshot snap;
+      snap.site = site;
+      Unsample(inuse_objects, inuse_bytes, period,
+               &snap.inuse_objects, &snap.inuse_bytes);
+      Unsample(alloc_objects, alloc_bytes, period,
+               &snap.alloc_objects, &snap.alloc_bytes);
+      snapshot_.push_back(snap);
+    }
+  }
+
+  void SetSamplingPeriod(int period) {
+    sample_period_ = period;
+
+#ifdef HAVE_SAMPLED_OBJECT_ALLOC
+    if (engine_ == kEngineJVMTI) {
+      Assert(jvmti_->SetHeapSamplingInterval(period),
+             "failed to set heap sampling interval");
+    }
+#endif
+  }
+
+  // With the JVMTI engine, the VM only samples while we're profiling.
+  // Otherwise, classes carry instrumentation only while profiling.
+  void SetProfiling(bool on) {
+#ifdef HAVE_SAMPLED_OBJECT_ALLOC
+    if (engine_ == kEngineJVMTI) {
+      Assert(jvmti_->SetEventNotificationMode(
+                 on ? JVMTI_ENABLE : JVMTI_DISABLE,
+                 JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL),
+             "failed to set event notification mode");
+      return;
+    }
+#endif
+
+    // Held across the retransform, so that concurrent starts and
+    // stops leave classes instrumented just when profiling is on.
+    Lock l(profiling_monitor_);
+    if (instrumenting_ == on)
+      return;
+
+    instrumenting_ = on;
+    RetransformLoadedClasses();
+  }
+
+  void RetransformLoadedClasses() {
+    jint nclasses;
+    jclass* classes;
+    Assert(jvmti_->GetLoadedClasses(&nclasses, &classes),
+           "failed to get loaded classes");
+
+    // Arrays, primitives and some VM internals can't be modified.
+    jint nmodifiable = 0;
+    for (jint i = 0; i < nclasses; ++i) {
+      jboolean modifiable;
+      if (jvmti_->IsModifiableClass(classes[i], &modifiable) == JVMTI_ERROR_NONE &&
+          modifiable)
+        classes[nmodifiable++] = classes[i];
+    }
+
+    // If the batch fails, retry class by class so that one bad class
+    // doesn't leave the rest alone.
+    if (jvmti_->RetransformClasses(nmodifiable, classes) != JVMTI_ERROR_NONE) {
+      warnx("Failed to retransform classes, retrying individually\n");
+      for (jint i = 0; i < nmodifiable; ++i)
+        jvmti_->RetransformClasses(1, &classes[i]);
+    }
+
+    jvmti_->Deallocate(reinterpret_cast<unsigned char*>(classes));
   }
 
   jvmtiEnv* jvmti() { return jvmti_; }
 
  private:
+  // Measure the layout of a few objects so that the helper can
+  // estimate allocation sizes without calling GetObjectSize.
+  void SetSizeEstimates(JNIEnv* env, jclass klass) {
+    jclass object_class = env->FindClass("java/lang/Object");
+    if (object_class == NULL)
+      errx(3, "Failed to find java/lang/Object\n");
+
+    const jint kNumReferences = 16;
+    jlong object_size = ObjectSize(env->AllocObject(object_class));
+    jlong array_header_size = ObjectSize(env->NewByteArray(0));
+    jlong references_size = ObjectSize(
+        env->NewObjectArray(kNumReferences, object_class, NULL));
+
+    // The alignment is the smallest step in the size of byte arrays.
+    jlong alignment = 8;
+    for (jint n = 1; n <= 64; ++n) {
+      jlong size = ObjectSize(env->NewByteArray(n));
+      if (size > array_header_size) {
+        alignment = size - array_header_size;
+        break;
+      }
+    }
+
+    SetStaticIntField(env, klass, HELPER_FIELD_OBJECTSIZE, object_size);
+    SetStaticIntField(env, klass, HELPER_FIELD_ARRAYHEADERSIZE,
+                      array_header_size);
+    SetStaticIntField(env, klass, HELPER_FIELD_REFERENCESIZE,
+                      (references_size - array_header_size) / kNumReferences);
+    SetStaticIntField(env, klass, HELPER_FIELD_OBJECTALIGNMENT, alignment);
+
+    reference_size_ = (references_size - array_header_size) / kNumReferences;
+    object_alignment_ = alignment;
+  }
+
+  // Estimate the size of instances from the fields of a class: a
+  // header (assuming compressed class pointers go with compressed
+  // references) and every instance field, aligned.
+  jint EstimateInstanceSize(JNIEnv* env, jclass klass) {
+    const jint kAccStatic = 0x0008;
+    jlong size = reference_size_ == 4 ? 12 : 16;
+
+    jclass k = klass;
+    while (k != NULL) {
+      jint nfields;
+      jfieldID* fields;
+      if (jvmti_->GetClassFields(k, &nfields, &fields) == JVMTI_ERROR_NONE) {
+        for (jint i = 0; i < nfields; ++i) {
+          jint modifiers;
+          char* signature;
+          if (jvmti_->GetFieldModifiers(k, fields[i], &modifiers) != JVMTI_ERROR_NONE ||
+              (modifiers & kAccStatic) ||
+              jvmti_->GetFieldName(k, fields[i], NULL, &signature, NULL) != JVMTI_ERROR_NONE)
+            continue;
+
+          size += FieldSize(signature[0]);
+          jvmti_->Deallocate(reinterpret_cast<unsigned char*>(signature));
+        }
+
+        jvmti_->Deallocate(reinterpret_cast<unsigned char*>(fields));
+      }
+
+      jclass super = env->GetSuperclass(k);
+      if (k != klass)
+        env->DeleteLocalRef(k);
+      k = super;
+    }
+
+    return (size + object_alignment_ - 1) & ~(jlong)(object_alignment_ - 1);
+  }
+
+  // The size of a field (or array element) by its type signature.
+  jint FieldSize(char type) {
+    switch (type) {
+      case 'J': case 'D': return 8;
+      case 'I': case 'F': return 4;
+      case 'S': case 'C': return 2;
+      case 'B': case 'Z': return 1;
+      default:            return reference_size_;
+    }
+  }
+
+  void SetStaticIntField(JNIEnv* env, jclass klass, const char* name, jint value) {
+    jfieldID field = env->GetStaticFieldID(klass, name, "I");
+    if (field == NULL)
+      errx(3, "Failed to get %s field\n", name);
+    env->SetStaticIntField(klass, field, value);
+  }
+
+  // Allocations are captured either by rewriting bytecode to call
+  // into the helper (the default), or, with HEAPSTER_ENGINE=jvmti,
+  // from the VM's own sampling (JDK 11+). We fall back to the former
+  // if the VM can't sample, or if we were built against headers that
+  // don't have it (see HAVE_SAMPLED_OBJECT_ALLOC in the Makefile).
+  enum Engine {
+    kEngineBCI,
+    kEngineJVMTI
+  };
+
+  Engine ChooseEngine() {
+    const char* engine = getenv("HEAPSTER_ENGINE");
+    if (engine == NULL || strcmp(engine, "bci") == 0)
+      return kEngineBCI;
+
+    if (strcmp(engine, "jvmti") != 0)
+      errx(3, "Unknown HEAPSTER_ENGINE: %s\n", engine);
+
+#ifdef HAVE_SAMPLED_OBJECT_ALLOC
+    // Older VMs' capabilities end before the one we'd look at.
+    jint version;
+    Assert(jvmti_->GetVersionNumber(&version), "failed to get version");
+    const jint major =
+        (version & JVMTI_VERSION_MASK_MAJOR) >> JVMTI_VERSION_SHIFT_MAJOR;
+
+    jvmtiCapabilities potential;
+    memset(&potential, 0, sizeof(potential));
+    Assert(jvmti_->GetPotentialCapabilities(&potential),
+           "failed to get potential capabilities");
+    if (major >= 11 && potential.can_generate_sampled_object_alloc_events)
+      return kEngineJVMTI;
+#endif
+
+    warnx("SampledObjectAlloc is unavailable, "
+          "falling back to bytecode instrumentation\n");
+    return kEngineBCI;
+  }
+
+  // The bytecode engine either hands each new object to the helper
+  // (from Object.<init>, and after array allocations), or, with
+  // HEAPSTER_INJECTION=tick, reports only the allocation site's type
+  // number (and array length), and hands over only the objects of
+  // sampled allocations, behind a guard, so that objects otherwise
+  // don't escape into the helper.
+  enum Injection {
+    kInjectObject,
+    kInjectTick
+  };
+
+  // With HEAPSTER_STACK=top, samples from the tick injection are
+  // attributed to the allocating method alone, as known from the site
+  // number, without walking the stack.
+  bool ChooseTopFrameOnly() {
+    const char* stack = getenv("HEAPSTER_STACK");
+    if (stack == NULL || strcmp(stack, "full") == 0)
+      return false;
+    if (strcmp(stack, "top") == 0)
+      return true;
+
+    errx(3, "Unknown HEAPSTER_STACK: %s\n", stack);
+    return false;
+  }
+
+  // Stacks are walked with JVMTI's GetStackTrace, or, with
+  // HEAPSTER_STACK_WALKER=asgct, HotSpot's (cheaper)
+  // AsyncGetCallTrace if the VM has it; individual walks that fail
+  // fall back to JVMTI.
+  AsyncGetCallTraceFunc ChooseStackWalker() {
+    const char* walker = getenv("HEAPSTER_STACK_WALKER");
+    if (walker == NULL || strcmp(walker, "jvmti") == 0)
+      return NULL;
+    if (strcmp(walker, "asgct") != 0)
+      errx(3, "Unknown HEAPSTER_STACK_WALKER: %s\n", walker);
+
+    AsyncGetCallTraceFunc f = reinterpret_cast<AsyncGetCallTraceFunc>(
+        dlsym(RTLD_DEFAULT, "AsyncGetCallTrace"));
+    if (f == NULL)
+      warnx("AsyncGetCallTrace is unavailable, falling back to JVMTI\n");
+    return f;
+  }
+
+  // With HEAPSTER_COUNT=exact, the tick injection also counts every
+  // allocation, by site, in addition to sampling.
+  bool ChooseCounting() {
+    const char* count = getenv("HEAPSTER_COUNT");
+    if (count == NULL || strcmp(count, "sampled") == 0)
+      return false;
+    if (strcmp(count, "exact") != 0)
+      errx(3, "Unknown HEAPSTER_COUNT: %s\n", count);
+
+    if (engine_ != kEngineBCI || injection_ != kInjectTick)
+      errx(3, "HEAPSTER_COUNT=exact requires HEAPSTER_INJECTION=tick\n");
+    return true;
+  }
+
+  void ChooseDumps() {
+    dump_dir_ = getenv("HEAPSTER_DUMP_DIR");
+    if (dump_dir_ == NULL)
+      return;
+
+    const char* interval = getenv("HEAPSTER_DUMP_INTERVAL");
+    dump_interval_millis_ =
+        1000LL * (interval != NULL ? strtoll(interval, NULL, 10) : 60);
+    if (dump_interval_millis_ <= 0)
+      errx(3, "Bad HEAPSTER_DUMP_INTERVAL: %s\n", interval);
+
+    const char* keep = getenv("HEAPSTER_DUMP_KEEP");
+    dump_keep_ = keep != NULL ? strtoul(keep, NULL, 10) : 10;
+    if (dump_keep_ == 0)
+      errx(3, "Bad HEAPSTER_DUMP_KEEP: %s\n", keep);
+
+    const char* max_bytes = getenv("HEAPSTER_DUMP_MAX_BYTES");
+    if (max_bytes != NULL)
+      dump_max_bytes_ = strtoll(max_bytes, NULL, 10);
+
+    const char* format = getenv("HEAPSTER_DUMP_FORMAT");
+    if (format == NULL || strcmp(format, "text") == 0)
+      dump_proto_ = false;
+    else if (strcmp(format, "proto") == 0)
+      dump_proto_ = true;
+    else
+      errx(3, "Unknown HEAPSTER_DUMP_FORMAT: %s\n", format);
+  }
+
+  void ChooseShm() {
+    const char* shm = getenv("HEAPSTER_SHM");
+    if (shm == NULL)
+      return;
+
+    shm_path_ = strcmp(shm, "1") == 0
+        ? StringPrintf("/dev/shm/heapster.%d", static_cast<int>(getpid()))
+        : shm;
+
+    const char* interval = getenv("HEAPSTER_SHM_INTERVAL");
+    shm_interval_millis_ = interval != NULL ? strtoll(interval, NULL, 10) : 1000;
+    if (shm_interval_millis_ <= 0)
+      errx(3, "Bad HEAPSTER_SHM_INTERVAL: %s\n", interval);
+
+    const char* bytes = getenv("HEAPSTER_SHM_BYTES");
+    shm_size_ = bytes != NULL ? strtoull(bytes, NULL, 10) : 16 << 20;
+    if (shm_size_ < sizeof(ShmHeader))
+      errx(3, "Bad HEAPSTER_SHM_BYTES: %s\n", bytes);
+
+    // We make the file afresh, so that we never write through a link
+    // (or to a file) someone else left there. tmpfs allocates the
+    // pages as they are first written.
+    unlink(shm_path_.c_str());
+    const mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP;
+    int fd = open(shm_path_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+                  mode);
+    if (fd < 0 || fchmod(fd, mode) < 0 || ftruncate(fd, shm_size_) < 0) {
+      warnx("Failed to create %s; profiles won't be exported",
+            shm_path_.c_str());
+      if (fd >= 0) {
+        close(fd);
+        unlink(shm_path_.c_str());
+      }
+      return;
+    }
+
+    void* base = mmap(NULL, shm_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      warnx("Failed to map %s; profiles won't be exported",
+            shm_path_.c_str());
+      unlink(shm_path_.c_str());
+      return;
+    }
+
+    shm_ = static_cast<char*>(base);
+    ShmHeader* header = reinterpret_cast<ShmHeader*>(shm_);
+    header->version = kShmVersion;
+    header->pid = getpid();
+    __sync_synchronize();
+    header->magic = kShmMagic;
+  }
+
+  void ChooseSocket() {
+    const char* path = getenv("HEAPSTER_SOCKET");
+    if (path == NULL)
+      return;
+
+    // The socket is made in a directory only we can enter, where it
+    // is made private before it's linked into place.
+    string dir = string(path) + ".XXXXXX";
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (dir.size() + sizeof("/socket") > sizeof(addr.sun_path))
+      errx(3, "HEAPSTER_SOCKET is too long: %s\n", path);
+
+    // Replace any socket left behind by an earlier process, but
+    // nothing else.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        warnx("%s exists and isn't a socket; not listening", path);
+        return;
+      }
+      unlink(path);
+    }
+
+    if (mkdtemp(&dir[0]) == NULL) {
+      warnx("Failed to make a directory for %s", path);
+      return;
+    }
+    strcpy(addr.sun_path, (dir + "/socket").c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    const bool ok = fd >= 0 &&
+        bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 &&
+        chmod(addr.sun_path, S_IRUSR | S_IWUSR) == 0 &&
+        listen(fd, 8) == 0 &&
+        link(addr.sun_path, path) == 0;
+
+    unlink(addr.sun_path);
+    rmdir(dir.c_str());
+
+    if (!ok) {
+      warnx("Failed to listen on %s", path);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+
+    control_path_ = path;
+    control_fd_ = fd;
+  }
+
+  void ChooseEventLog() {
+    const char* path = getenv("HEAPSTER_EVENT_LOG");
+    if (path == NULL)
+      return;
+
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+      errx(3, "Failed to open %s: %s\n", path, strerror(errno));
+
+    event_sink_ = new FdSink(fd);
+    event_out_ = new ProfileWriter(event_sink_);
+
+    char header[8];
+    PutLittleEndian32(header, kEventLogMagic);
+    PutLittleEndian32(header + 4, kEventLogVersion);
+    event_out_->Append(header, sizeof(header));
+
+    event_start_micros_ = 0;
+    event_start_micros_ = EventTime();
+  }
+
+  void ChooseMaxSites() {
+    const char* max_sites = getenv("HEAPSTER_MAX_SITES");
+    if (max_sites == NULL)
+      return;
+
+    char* end;
+    const unsigned long n = strtoul(max_sites, &end, 10);
+    if (*end != '\0' || n < 4 || n >= kMaxSites / 2)
+      errx(3, "Bad HEAPSTER_MAX_SITES: %s\n", max_sites);
+
+    max_sites_ = n;
+    sketch_ = new CountMinSketch();
+  }
+
+  Injection ChooseInjection() {
+    const char* injection = getenv("HEAPSTER_INJECTION");
+    if (injection == NULL || strcmp(injection, "object") == 0)
+      return kInjectObject;
+    if (strcmp(injection, "tick") == 0)
+      return kInjectTick;
+
+    errx(3, "Unknown HEAPSTER_INJECTION: %s\n", injection);
+    return kInjectObject;
+  }
+
   void Assert(jvmtiError err, string message) {
     char* strerr;
 
@@ -628,18 +3268,50 @@ class Heapster {
   }
 
   void Setup() {
-    // Initialize the sampler.  If we have multiple samplers (eg. one
-    // per thread), we need to initialize them with different seeds.
+    // Per-thread samplers are initialized lazily with this period.
     char* sample_period_env = getenv("HEAPSTER_SAMPLE_PERIOD");
     int sample_period = 1<<19;  // default: 512 KB
     if (sample_period_env != NULL)
       sample_period = strtoll(sample_period_env, NULL, 10);
 
+    engine_ = ChooseEngine();
+    injection_ = ChooseInjection();
+    top_frame_only_ = ChooseTopFrameOnly();
+    counting_ = ChooseCounting();
+    async_get_call_trace_ = ChooseStackWalker();
+    ChooseDumps();
+    ChooseMaxSites();
+
+    // See SettleFrees.
+    jint version;
+    Assert(jvmti_->GetVersionNumber(&version), "failed to get version");
+    deferred_frees_ =
+        (version & JVMTI_VERSION_MASK_MAJOR) >> JVMTI_VERSION_SHIFT_MAJOR >= 16;
+
     jvmtiCapabilities c;
     memset(&c, 0, sizeof(c));
-    c.can_generate_all_class_hook_events = 1;
     c.can_tag_objects                    = 1;
     c.can_generate_object_free_events    = 1;
+    if (engine_ == kEngineBCI) {
+      c.can_generate_all_class_hook_events = 1;
+      c.can_retransform_classes            = 1;
+    }
+#ifdef HAVE_SAMPLED_OBJECT_ALLOC
+    else
+      c.can_generate_sampled_object_alloc_events = 1;
+#endif
+
+    // Proto profiles give methods' source files and lines, if we can
+    // get them.
+    jvmtiCapabilities potential;
+    Assert(jvmti_->GetPotentialCapabilities(&potential),
+           "failed to get potential capabilities");
+    source_info_ = potential.can_get_source_file_name &&
+                   potential.can_get_line_numbers;
+    if (source_info_) {
+      c.can_get_source_file_name = 1;
+      c.can_get_line_numbers     = 1;
+    }
     Assert(jvmti_->AddCapabilities(&c), "failed to add capabilities");
 
     jvmtiEventCallbacks cb;
@@ -647,8 +3319,13 @@ class Heapster {
     cb.VMStart           = &Heapster::JVMTI_VMStart;
     cb.VMInit            = &Heapster::JVMTI_VMInit;
     cb.VMDeath           = &Heapster::JVMTI_VMDeath;
+    cb.ThreadEnd         = &Heapster::JVMTI_ThreadEnd;
     cb.ObjectFree        = &Heapster::JVMTI_ObjectFree;
     cb.ClassFileLoadHook = &Heapster::JVMTI_ClassFileLoadHook;
+    cb.ClassPrepare      = &Heapster::JVMTI_ClassPrepare;
+#ifdef HAVE_SAMPLED_OBJECT_ALLOC
+    cb.SampledObjectAlloc = &Heapster::JVMTI_SampledObjectAlloc;
+#endif
     Assert(jvmti_->SetEventCallbacks(&cb, (jint)sizeof(cb)),
            "failed to set callbacks");
 
@@ -656,17 +3333,40 @@ class Heapster {
       JVMTI_EVENT_VM_START,
       JVMTI_EVENT_VM_INIT,
       JVMTI_EVENT_VM_DEATH,
+      JVMTI_EVENT_THREAD_END,
       JVMTI_EVENT_CLASS_FILE_LOAD_HOOK,
+      JVMTI_EVENT_CLASS_PREPARE,
       JVMTI_EVENT_OBJECT_FREE
     };
 
     for (uint32_t i = 0; i < arraysize(events); i++) {
+      if (events[i] == JVMTI_EVENT_CLASS_FILE_LOAD_HOOK &&
+          engine_ != kEngineBCI)
+        continue;
+      if (events[i] == JVMTI_EVENT_CLASS_PREPARE &&
+          (engine_ != kEngineBCI || injection_ != kInjectTick) &&
+          async_get_call_trace_ == NULL)
+        continue;
+
       Assert(jvmti_->SetEventNotificationMode(JVMTI_ENABLE, events[i], NULL),
              "failed to set event notification mode");
     }
 
     monitor_ = new Monitor(jvmti_, "heapster state");
-    sampler_monitor_ = new Monitor(jvmti_, "sampler state");
+    free_monitor_ = new Monitor(jvmti_, "heapster frees");
+    method_monitor_ = new Monitor(jvmti_, "heapster methods");
+    dump_monitor_ = new Monitor(jvmti_, "heapster dumps");
+    profiling_monitor_ = new Monitor(jvmti_, "heapster profiling");
+    dumper_monitor_ = new Monitor(jvmti_, "heapster dumper");
+    exporter_monitor_ = new Monitor(jvmti_, "heapster exporter");
+    control_monitor_ = new Monitor(jvmti_, "heapster control");
+
+    ChooseShm();
+    ChooseSocket();
+
+    event_monitor_ = new Monitor(jvmti_, "heapster events");
+    event_buffers_monitor_ = new Monitor(jvmti_, "heapster event buffers");
+    ChooseEventLog();
 
     SetSamplingPeriod(sample_period);
 
@@ -674,13 +3374,127 @@ class Heapster {
     AllocProfile();
   }
 
+  JavaVM*           jvm_;
   jvmtiEnv*         jvmti_;
+  AsyncGetCallTraceFunc async_get_call_trace_;
+  Engine            engine_;
+  Injection         injection_;
+  bool              top_frame_only_;
+  bool              counting_;
+  bool              source_info_;  // Source files and line numbers.
+  volatile bool     instrumenting_;
+  Monitor*          profiling_monitor_;  // Serializes SetProfiling.
+
+  // Layout, as measured at VM init.
+  jint              reference_size_;
+  jint              object_alignment_;
+
+  // An allocation bytecode, as numbered for the tick injection.
+  struct AllocationSite {
+    string    class_name;
+    string    method_name;
+    string    method_signature;
+    unsigned  method_num;
+    int       bci;
+    unsigned  type;
+    jmethodID method;  // Once the class is prepared.
+  };
+
+  // Names of the classes we've rewritten, by class number, and
+  // their numbers by name.
+  vector<string>             class_names_;
+  map<string, unsigned>      class_numbers_;
+
+  // Allocation sites by number, and their numbers by location. Sites
+  // are resolved to methods in two steps: they are named once their
+  // class has been rewritten, and resolved when it is prepared.
+  vector<AllocationSite>     alloc_sites_;
+  map<string, unsigned>      alloc_site_numbers_;
+  map<unsigned, vector<unsigned> > unnamed_sites_;
+  map<string, vector<unsigned> >   unresolved_sites_;
+
+  // Types allocated at these sites, by number, and the estimated
+  // instance size of prepared classes, by name.
+  vector<string>             types_;
+  map<string, unsigned>      type_numbers_;
+  map<string, jint>          instance_sizes_;
   Monitor*          monitor_;
-  Monitor*          sampler_monitor_;
-  Site**            sites_;
-  tcmalloc::Sampler sampler_;
+  // Frees queued by the threads reporting them, one buffer per
+  // thread; the first num_free_buffers_ of the pool are in use.
+  Monitor*          free_monitor_;
+  FreeBuffer*       free_buffers_;
+  volatile uint32_t max_free_buffers_;
+  volatile uint32_t num_free_buffers_;
+  bool              deferred_frees_;  // See SettleFrees.
+
+  // Method names, and the signatures of their classes, by class tag.
+  Monitor*                method_monitor_;
+  map<jmethodID, NamedMethod> method_names_;
+  vector<string>          class_signatures_;
+
+  // Serializes dumps, which share the snapshot.
+  Monitor*                dump_monitor_;
+  volatile uint32_t       dump_id_;  // Of the next delta dump.
+  vector<SiteSnapshot>    snapshot_;
+
+  // Periodic dumps; see DumpForever. The files are touched only by
+  // the dumper thread.
+  const char*             dump_dir_;
+  jlong                   dump_interval_millis_;
+  size_t                  dump_keep_;
+  off_t                   dump_max_bytes_;
+  bool                    dump_proto_;
+  Monitor*                dumper_monitor_;
+  deque<pair<string, off_t> > dump_files_;
+  off_t                   dump_files_bytes_;
+
+  // The profile in shared memory; see ExportForever.
+  string                  shm_path_;
+  char*                   shm_;
+  size_t                  shm_size_;
+  jlong                   shm_interval_millis_;
+  Monitor*                exporter_monitor_;
+
+  // The control socket; see ServeForever.
+  string                  control_path_;
+  int                     control_fd_;
+  Monitor*                control_monitor_;
+
+  // The event log; see LogEvent.
+  Monitor*                event_monitor_;
+  FdSink*                 event_sink_;
+  ProfileWriter*          event_out_;
+  EventBuffer* volatile   event_buffers_;
+  volatile uint64_t       num_event_buffers_;
+  // Buffers not in use: those of ended threads, and the reserve for
+  // threads that can't allocate. event_buffers_monitor_ guards both.
+  Monitor*                event_buffers_monitor_;
+  EventBuffer*            free_event_buffers_;
+  EventBuffer*            reserve_event_buffers_;
+  uint32_t                num_reserve_event_buffers_;
+  uint32_t                max_reserve_event_buffers_;
+  volatile uint64_t       events_dropped_;
+  uint64_t                events_reported_dropped_;
+  uint64_t                event_start_micros_;
+  vector<char>            event_scratch_;
+
+  SiteTable*        sites_;
+
+  // Capped sites; see AdmitSite.
+  uint32_t          max_sites_;
+  volatile uint32_t num_buckets_;
+  CountMinSketch*   sketch_;
+  volatile jlong    folded_samples_;
+  volatile jlong    folded_max_;
+  jlong             folded_at_eviction_;
+  volatile jlong    evictions_;
+  volatile jlong    evicted_max_;
+
+  volatile uint32_t* site_types_[kMaxSites / kSiteChunkSize];
+  volatile uint32_t epoch_;
+  volatile int      sample_period_;
+  uint32_t          sampler_seed_;
 
-  int  class_count_;
   bool vm_started_;
 };
 
@@ -691,32 +3505,128 @@ extern "C" {
 /*
  * Class:     Heapster
  * Method:    _dumpProfile
- * Signature: (Z)[B
+ * Signature: (ZZZ)[B
  */
 JNIEXPORT jbyteArray JNICALL FUNC_IMPL(dumpProfile)(JNIEnv   *env,
                                                     jclass    klass,
-                                                    jboolean  force_gc)
+                                                    jboolean  force_gc,
+                                                    jboolean  lifetime,
+                                                    jboolean  proto)
 {
-  const string profile = Heapster::instance->DumpProfile(force_gc);
+  ChunkSink sink;
+  Heapster::instance->DumpProfile(env, &sink, force_gc, lifetime, proto);
+  return sink.ToByteArray(env);
+}
 
-  jbyteArray buf = env->NewByteArray(profile.size());
-  // TODO: check error here?
-  env->SetByteArrayRegion(buf, 0, profile.size(), (jbyte*)profile.data());
+/*
+ * Class:     Heapster
+ * Method:    _dumpProfileDelta
+ * Signature: (I)[B
+ */
+JNIEXPORT jbyteArray JNICALL FUNC_IMPL(dumpProfileDelta)(JNIEnv *env,
+                                                         jclass  klass,
+                                                         jint    since)
+{
+  ChunkSink sink;
+  Heapster::instance->DumpProfileDelta(env, &sink, since);
+  return sink.ToByteArray(env);
+}
 
-  return buf;
+/*
+ * Class:     Heapster
+ * Method:    _writeProfile
+ * Signature: (Ljava/lang/String;ZZZ)Z
+ */
+JNIEXPORT jboolean JNICALL FUNC_IMPL(writeProfile)(JNIEnv   *env,
+                                                   jclass    klass,
+                                                   jstring   path,
+                                                   jboolean  force_gc,
+                                                   jboolean  lifetime,
+                                                   jboolean  proto)
+{
+  const char* cpath = env->GetStringUTFChars(path, NULL);
+  if (cpath == NULL)
+    return JNI_FALSE;
+
+  const bool ok =
+      Heapster::instance->WriteProfile(env, cpath, force_gc, lifetime, proto);
+  env->ReleaseStringUTFChars(path, cpath);
+  return ok ? JNI_TRUE : JNI_FALSE;
 }
 
 /*
  * Class:     Heapster
  * Method:    _newObject
- * Signature: (Ljava/lang/Object;Ljava/lang/Object;)V
+ * Signature: (Ljava/lang/Object;Ljava/lang/Object;)J
+ */
+JNIEXPORT jlong JNICALL FUNC_IMPL(newObject)(JNIEnv  *env,
+                                             jclass   klass,
+                                             jobject  thread,
+                                             jobject  object)
+{
+  return Heapster::instance->NewObject(env, klass, thread, object);
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _newAllocation
+ * Signature: (Ljava/lang/Object;IJ)J
+ */
+JNIEXPORT jlong JNICALL FUNC_IMPL(newAllocation)(JNIEnv  *env,
+                                                 jclass   klass,
+                                                 jobject  thread,
+                                                 jint     site,
+                                                 jlong    size)
+{
+  return Heapster::instance->NewAllocation(env, thread, site, size);
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _handOver
+ * Signature: (Ljava/lang/Object;Ljava/lang/Object;)Z
+ */
+JNIEXPORT jboolean JNICALL FUNC_IMPL(handOver)(JNIEnv  *env,
+                                               jclass   klass,
+                                               jobject  thread,
+                                               jobject  o)
+{
+  return Heapster::instance->HandOver(env, o);
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _siteSize
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL FUNC_IMPL(siteSize)(JNIEnv *env,
+                                           jclass  klass,
+                                           jint    site)
+{
+  return Heapster::instance->SiteSize(site);
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _nextSamplingPoint
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL FUNC_IMPL(nextSamplingPoint)(JNIEnv *env,
+                                                     jclass  klass)
+{
+  return Heapster::instance->NextSamplingPoint();
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _objectSize
+ * Signature: (Ljava/lang/Object;)J
  */
-JNIEXPORT void JNICALL FUNC_IMPL(newObject)(JNIEnv  *env,
-                                            jclass   klass,
-                                            jobject  thread,
-                                            jobject  object)
+JNIEXPORT jlong JNICALL FUNC_IMPL(objectSize)(JNIEnv  *env,
+                                              jclass   klass,
+                                              jobject  object)
 {
-  Heapster::instance->NewObject(env, klass, thread, object);
+  return Heapster::instance->ObjectSize(object);
 }
 
 /*
@@ -729,6 +3639,29 @@ JNIEXPORT void JNICALL FUNC_IMPL(clearProfile)(JNIEnv *env, jclass klass)
   Heapster::instance->ClearProfile();
 }
 
+/*
+ * Class:     Heapster
+ * Method:    _setProfiling
+ * Signature: (Z)V
+ */
+JNIEXPORT void JNICALL FUNC_IMPL(setProfiling)(JNIEnv   *env,
+                                               jclass    klass,
+                                               jboolean  on)
+{
+  Heapster::instance->SetProfiling(on);
+}
+
+/*
+ * Class:     Heapster
+ * Method:    _stackWalker
+ * Signature: ()Ljava/lang/String;
+ */
+JNIEXPORT jstring JNICALL FUNC_IMPL(stackWalker)(JNIEnv *env,
+                                                 jclass  klass)
+{
+  return env->NewStringUTF(Heapster::instance->StackWalkerName());
+}
+
 /*
  * Class:     Heapster
  * Method:    _setSamplingPeriod
@@ -744,9 +3677,20 @@ JNIEXPORT void JNICALL FUNC_IMPL(setSamplingPeriod)(JNIEnv *env,
 }
 #undef FUNC_IMPL
 
-// Same hash table size as TCMalloc.
-const uint32_t Heapster::kHashTableSize = 179999;
+// Small enough to cost nothing when few stacks are sampled; the
+// table doubles as it fills.
+const uint32_t Heapster::kInitialSiteTableSize = 1024;
 const uint32_t Heapster::kMaxStackFrames = 100;
+const uint32_t Heapster::kMaxSkipFrames = 3;
+const jlong Heapster::kFreeDrainPeriodMillis = 100;
+const jlong Heapster::kFreeQuietMillis = 100;
+const jlong Heapster::kFreeSettleMillis = 2000;
+const jlong Heapster::kClientTimeoutMillis = 10000;
+const jlong Heapster::kAcceptBackoffMillis = 1000;
+const jlong Heapster::kAdmitSamples = 4;
+// As the helper's MAX_HAND_OVERS.
+const uint32_t Heapster::kMaxHandOvers = 16;
+const jmethodID Heapster::kOtherFrame = reinterpret_cast<jmethodID>(1);
 Heapster* Heapster::instance = NULL;
 
 // This instantiates a singleton for the above heapster class, which
@@ -765,7 +3709,7 @@ JNIEXPORT jint JNICALL Agent_OnLoad(
   tcmalloc::Sampler::InitStatics();
 
   // Create the actual heapster instance & run with it!
-  Heapster::instance = new Heapster(jvmti);
+  Heapster::instance = new Heapster(jvm, jvmti);
 
   return JNI_OK;
 }
@@ -0,0 +1,172 @@
+// Reads the event logs written by the agent; see heapster_events.h.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "heapster_events.h"
+
+using namespace std;
+
+static const size_t kHeaderSize = 8;
+
+EventLogReader::EventLogReader()
+    : base_(NULL), size_(0), p_(NULL), chunk_end_(NULL),
+      thread_(0), time_(0), error_(NULL), dropped_(0) {}
+
+EventLogReader::~EventLogReader() {
+  if (base_ != NULL)
+    munmap(const_cast<char*>(base_), size_);
+}
+
+bool EventLogReader::Open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+
+  if (static_cast<size_t>(st.st_size) < kHeaderSize) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+
+  base_ = static_cast<const char*>(base);
+  size_ = st.st_size;
+
+  if (GetLittleEndian32(base_) != kEventLogMagic ||
+      GetLittleEndian32(base_ + 4) != kEventLogVersion) {
+    errno = EINVAL;
+    return false;
+  }
+
+  p_ = chunk_end_ = base_ + kHeaderSize;
+  return true;
+}
+
+bool EventLogReader::Next(Event* event) {
+  const char* end = base_ + size_;
+
+  for (;;) {
+    // A log cut short (say, by a crash) ends at its last whole chunk.
+    if (p_ == chunk_end_) {
+      uint64_t length;
+      size_t n, m, k;
+      if (p_ == end ||
+          (n = GetVarint(p_, end, &thread_)) == 0 ||
+          (m = GetVarint(p_ + n, end, &time_)) == 0 ||
+          (k = GetVarint(p_ + n + m, end, &length)) == 0 ||
+          length > static_cast<uint64_t>(end - (p_ + n + m + k)))
+        return false;
+
+      p_ += n + m + k;
+      chunk_end_ = p_ + length;
+      continue;
+    }
+
+    bool is_event;
+    if (!ReadRecord(event, &is_event))
+      return false;
+    if (is_event)
+      return true;
+  }
+}
+
+bool EventLogReader::ReadRecord(Event* event, bool* is_event) {
+  uint64_t length;
+  size_t n = GetVarint(p_, chunk_end_, &length);
+  if (n == 0 || length > static_cast<uint64_t>(chunk_end_ - (p_ + n)))
+    return Fail("truncated record");
+
+  const char* p = p_ + n;
+  const char* end = p + length;
+  p_ = end;
+
+  uint64_t fields[4] = {0, 0, 0, 0};
+  for (size_t i = 0; i < 2; ++i) {
+    if ((n = GetVarint(p, end, &fields[i])) == 0)
+      return Fail("truncated record");
+    p += n;
+  }
+
+  time_ += fields[0];
+  const uint64_t kind = fields[1];
+  *is_event = kind == kEventAlloc || kind == kEventFree;
+
+  if (*is_event) {
+    for (size_t i = 0; i < (kind == kEventAlloc ? 3 : 2); ++i) {
+      if ((n = GetVarint(p, end, &fields[i])) == 0)
+        return Fail("truncated event");
+      p += n;
+    }
+
+    event->kind = static_cast<EventKind>(kind);
+    event->time_micros = time_;
+    event->thread = thread_;
+    event->site = fields[0];
+    event->size = fields[1];
+    event->type = kind == kEventAlloc ? fields[2] : 0;
+    return true;
+  }
+
+  if (kind == kEventSite) {
+    uint64_t site, nframes;
+    if ((n = GetVarint(p, end, &site)) == 0 ||
+        (p += n, n = GetVarint(p, end, &nframes)) == 0)
+      return Fail("truncated site");
+    p += n;
+
+    vector<uint64_t>& frames = sites_[site];
+    frames.clear();
+    for (uint64_t i = 0; i < nframes; ++i) {
+      uint64_t method;
+      if ((n = GetVarint(p, end, &method)) == 0)
+        return Fail("truncated site");
+      p += n;
+      frames.push_back(method);
+    }
+  } else if (kind == kEventDropped) {
+    uint64_t count;
+    if ((n = GetVarint(p, end, &count)) == 0)
+      return Fail("truncated count");
+    dropped_ += count;
+  } else if (kind == kEventMethod || kind == kEventType ||
+             kind == kEventThread) {
+    uint64_t id = thread_, name_length;
+    if (kind != kEventThread) {
+      if ((n = GetVarint(p, end, &id)) == 0)
+        return Fail("truncated name");
+      p += n;
+    }
+    if ((n = GetVarint(p, end, &name_length)) == 0 ||
+        name_length > static_cast<uint64_t>(end - (p + n)))
+      return Fail("truncated name");
+    p += n;
+
+    map<uint64_t, string>& names =
+        kind == kEventMethod ? methods_ : kind == kEventType ? types_ : threads_;
+    names[id] = string(p, name_length);
+  }
+
+  // Unknown kinds are skipped, as are fields we don't know of.
+  return true;
+}
+
+bool EventLogReader::Fail(const char* error) {
+  error_ = error;
+  return false;
+}
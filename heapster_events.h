@@ -0,0 +1,145 @@
+// The format of the event log the agent writes (with
+// HEAPSTER_EVENT_LOG), and a reader for it.
+//
+// The log records every sampled allocation and every free of a
+// sampled object, in the order they happened on each thread. After
+// an 8-byte header (the magic and version, as 32-bit little-endian
+// words), it is a sequence of chunks, each holding a run of one
+// thread's events:
+//
+//   chunk:  thread, time, length, then length bytes of records
+//   record: length, then (within length) time delta, kind, fields
+//
+// All numbers are varints. Threads are numbered by the agent, from
+// 1; chunks of thread 0 hold records that belong to no thread. Times
+// are in microseconds since the log was started; a chunk's time is
+// that of the thread's previous event, and each record's is relative
+// to the one before it. Records are framed by length so that fields
+// can be added to them.
+//
+// Allocations and frees refer to sites, methods and types by number;
+// these are defined by their own records, somewhere in the log.
+// Threads whose buffers fill up before the agent writes them out drop
+// events (and definitions), which the log counts.
+
+#ifndef HEAPSTER_EVENTS_H_
+#define HEAPSTER_EVENTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+static const uint32_t kEventLogMagic = 0x56455048;  // "HPEV"
+static const uint32_t kEventLogVersion = 1;
+
+enum EventKind {
+  kEventAlloc = 1,   // site, size, type
+  kEventFree = 2,    // site, size
+  kEventSite = 3,    // site, nframes, nframes methods
+  kEventMethod = 4,  // method, name length, name
+  kEventType = 5,    // type, name length, name
+  kEventThread = 6,  // name length, name (of the chunk's thread)
+  kEventDropped = 7  // count, of records dropped since the last count
+};
+
+static const uint64_t kEventNoThread = 0;
+
+// Sites past the agent's limit are all numbered this, and types the
+// agent couldn't name this.
+static const uint64_t kEventUnknownSite = 1 << 24;
+static const uint64_t kEventUnknownType = 1ULL << 32;
+
+static inline size_t PutVarint(char* p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = static_cast<char>(v);
+  return n;
+}
+
+static inline void PutLittleEndian32(char* p, uint32_t v) {
+  for (size_t i = 0; i < 4; ++i)
+    p[i] = static_cast<char>(v >> (8 * i));
+}
+
+static inline uint32_t GetLittleEndian32(const char* p) {
+  uint32_t v = 0;
+  for (size_t i = 0; i < 4; ++i)
+    v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+// Returns the number of bytes read, or 0 if the varint runs past end.
+static inline size_t GetVarint(const char* p, const char* end, uint64_t* v) {
+  *v = 0;
+  for (size_t n = 0; p + n < end && n < 10; ++n) {
+    *v |= static_cast<uint64_t>(p[n] & 0x7f) << (7 * n);
+    if ((p[n] & 0x80) == 0)
+      return n + 1;
+  }
+  return 0;
+}
+
+// An allocation or free.
+struct Event {
+  EventKind kind;
+  uint64_t  time_micros;
+  uint64_t  thread;
+  uint64_t  site;
+  uint64_t  size;
+  uint64_t  type;  // Of allocations.
+};
+
+// Reads a whole log, mapped into memory. Events come out in the
+// order of their threads' chunks; sort by time to merge threads.
+class EventLogReader {
+ public:
+  EventLogReader();
+  ~EventLogReader();
+
+  // Returns false (with errno set) if the file can't be mapped.
+  bool Open(const char* path);
+
+  // Reads the next allocation or free, gathering definitions on the
+  // way. Returns false at the end of the log, or if it is corrupt;
+  // see error().
+  bool Next(Event* event);
+
+  const char* error() const { return error_; }
+
+  // The number of records the agent dropped, as counted so far.
+  uint64_t dropped() const { return dropped_; }
+
+  // Definitions read so far; all of them, at the end of the log.
+  const std::map<uint64_t, std::vector<uint64_t> >& sites() const {
+    return sites_;
+  }
+  const std::map<uint64_t, std::string>& methods() const { return methods_; }
+  const std::map<uint64_t, std::string>& types() const { return types_; }
+  const std::map<uint64_t, std::string>& threads() const { return threads_; }
+
+ private:
+  bool Fail(const char* error);
+  bool ReadRecord(Event* event, bool* is_event);
+
+  const char* base_;
+  size_t      size_;
+  const char* p_;
+  const char* chunk_end_;
+  uint64_t    thread_;
+  uint64_t    time_;
+  const char* error_;
+  uint64_t    dropped_;
+
+  std::map<uint64_t, std::vector<uint64_t> > sites_;
+  std::map<uint64_t, std::string> methods_;
+  std::map<uint64_t, std::string> types_;
+  std::map<uint64_t, std::string> threads_;
+};
+
+#endif  // HEAPSTER_EVENTS_H_
@@ -0,0 +1,76 @@
+// heapster-events prints an event log (as written with
+// HEAPSTER_EVENT_LOG) as text: a line per allocation or free,
+//
+//   <micros> <thread> alloc <site> <bytes> <type>
+//   <micros> <thread> free <site> <bytes>
+//
+// followed by the sites' stacks, from the innermost frame out:
+//
+//   site <site> <method> <method> ...
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "heapster_events.h"
+
+using namespace std;
+
+static const char*
+Name(const map<uint64_t, string>& names, uint64_t id)
+{
+  map<uint64_t, string>::const_iterator it = names.find(id);
+  return it != names.end() ? it->second.c_str() : "?";
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s log\n", argv[0]);
+    return 2;
+  }
+
+  EventLogReader reader;
+  if (!reader.Open(argv[1]))
+    err(1, "%s", argv[1]);
+
+  // Types may be defined after their first use, so allocations are
+  // named once the whole log is read.
+  vector<Event> events;
+  Event event;
+  while (reader.Next(&event))
+    events.push_back(event);
+
+  if (reader.error() != NULL)
+    warnx("%s: %s; stopped reading", argv[1], reader.error());
+  if (reader.dropped() > 0)
+    warnx("%s: the agent dropped %" PRIu64 " records", argv[1],
+          reader.dropped());
+
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event& e = events[i];
+    if (e.kind == kEventAlloc) {
+      printf("%" PRIu64 " %" PRIu64 " alloc %" PRIu64 " %" PRIu64 " %s\n",
+             e.time_micros, e.thread, e.site, e.size,
+             Name(reader.types(), e.type));
+    } else {
+      printf("%" PRIu64 " %" PRIu64 " free %" PRIu64 " %" PRIu64 "\n",
+             e.time_micros, e.thread, e.site, e.size);
+    }
+  }
+
+  const map<uint64_t, vector<uint64_t> >& sites = reader.sites();
+  for (map<uint64_t, vector<uint64_t> >::const_iterator it = sites.begin();
+       it != sites.end(); ++it) {
+    printf("site %" PRIu64, it->first);
+    for (size_t i = 0; i < it->second.size(); ++i)
+      printf(" %s", Name(reader.methods(), it->second[i]));
+    printf("\n");
+  }
+
+  if (fflush(stdout) != 0 || ferror(stdout))
+    err(1, "stdout");
+
+  return 0;
+}
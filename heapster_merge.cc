@@ -0,0 +1,157 @@
+// heapster-merge folds a chain of delta profiles, as dumped by
+// Heapster.dumpProfileDelta, back into a full profile that pprof
+// reads:
+//
+//   heapster-merge delta0 delta1 ... > profile
+//
+// The first delta must be complete (since 0), and each one after it
+// since a dump no later than its predecessor. Deltas carry the full
+// counts of the sites they hold, so later ones simply replace the
+// earlier records.
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+struct Counts {
+  long long inuse_objects, inuse_bytes, alloc_objects, alloc_bytes;
+};
+
+static map<string, string> symbols;  // Frame -> method name.
+static map<string, Counts> records;  // Stack -> counts.
+
+enum Section { kNone, kSymbol, kHeap };
+
+// Reads a line, without its newline, into `line`. Returns false at
+// end of file.
+static bool
+ReadLine(FILE* fp, string* line)
+{
+  char buf[4096];
+
+  line->clear();
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    line->append(buf);
+    if (!line->empty() && (*line)[line->size() - 1] == '\n') {
+      line->erase(line->size() - 1);
+      return true;
+    }
+  }
+
+  return !line->empty();
+}
+
+// Applies one delta; returns its dump id.
+static unsigned
+ApplyDelta(const char* path, unsigned last)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL)
+    err(1, "%s", path);
+
+  Section section = kNone;
+  unsigned dump = 0, since = 0;
+  bool have_dump = false, have_since = false;
+  string line;
+
+  while (ReadLine(fp, &line)) {
+    if (line == "--- symbol") {
+      section = kSymbol;
+    } else if (line == "--- heap delta") {
+      section = kHeap;
+    } else if (line.compare(0, 3, "---") == 0) {
+      section = kNone;
+    } else if (section == kSymbol) {
+      size_t space = line.find(' ');
+      if (space != string::npos)
+        symbols[line.substr(0, space)] = line.substr(space + 1);
+    } else if (section == kHeap && sscanf(line.c_str(), "dump: %u", &dump) == 1) {
+      have_dump = true;
+    } else if (section == kHeap && sscanf(line.c_str(), "since: %u", &since) == 1) {
+      have_since = true;
+
+      if (last == 0 && since != 0)
+        errx(1, "%s: the first delta must be since 0, not %u", path, since);
+      if (since > last)
+        warnx("%s: missing dumps %u to %u; "
+              "sites that changed only then are stale", path, last + 1, since);
+    } else if (section == kHeap) {
+      Counts c;
+      size_t at = line.find(" @");
+      if (at == string::npos ||
+          sscanf(line.c_str(), "%lld: %lld [%lld: %lld]",
+                 &c.inuse_objects, &c.inuse_bytes,
+                 &c.alloc_objects, &c.alloc_bytes) != 4) {
+        warnx("%s: skipping malformed record: %s", path, line.c_str());
+        continue;
+      }
+
+      const string stack = line.substr(at);
+      if (c.inuse_objects <= 0 && c.alloc_objects <= 0)
+        records.erase(stack);
+      else
+        records[stack] = c;
+    }
+  }
+
+  if (ferror(fp))
+    err(1, "%s", path);
+  fclose(fp);
+
+  if (!have_dump || !have_since)
+    errx(1, "%s: not a heapster delta profile", path);
+
+  return dump;
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s delta0 [delta1 ...]\n", argv[0]);
+    return 2;
+  }
+
+  unsigned last = 0;
+  for (int i = 1; i < argc; ++i)
+    last = ApplyDelta(argv[i], last);
+
+  printf("--- symbol\nbinary=heapster\n");
+  for (map<string, string>::const_iterator it = symbols.begin();
+       it != symbols.end(); ++it)
+    printf("%s %s\n", it->first.c_str(), it->second.c_str());
+  printf("---\n--- heap\n");
+
+  Counts total;
+  memset(&total, 0, sizeof(total));
+  for (map<string, Counts>::const_iterator it = records.begin();
+       it != records.end(); ++it) {
+    total.inuse_objects += it->second.inuse_objects;
+    total.inuse_bytes += it->second.inuse_bytes;
+    total.alloc_objects += it->second.alloc_objects;
+    total.alloc_bytes += it->second.alloc_bytes;
+  }
+
+  printf("heap profile: %6lld: %8lld [%6lld: %8lld] @ heapprofile\n",
+         total.inuse_objects, total.inuse_bytes,
+         total.alloc_objects, total.alloc_bytes);
+
+  for (map<string, Counts>::const_iterator it = records.begin();
+       it != records.end(); ++it) {
+    const Counts& c = it->second;
+    printf("%6lld: %8lld [%6lld: %8lld]%s\n",
+           c.inuse_objects, c.inuse_bytes,
+           c.alloc_objects, c.alloc_bytes, it->first.c_str());
+  }
+
+  if (fflush(stdout) != 0 || ferror(stdout))
+    err(1, "stdout");
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+// The single-producer, single-consumer rings that threads hand their
+// frees and events to the agent's background threads through. The
+// producer only writes tail, and the consumer only head; both count
+// up forever, and wrap, so that the ring is full when they're kSize
+// apart.
+
+#ifndef HEAPSTER_RINGS_H_
+#define HEAPSTER_RINGS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+// Freed objects' tags.
+struct FreeBuffer {
+  static const uint32_t kSize = 1 << 14;
+
+  FreeBuffer() : head(0), tail(0) {}
+
+  bool Push(int64_t tag) {
+    const uint32_t t = tail;
+    if (t - head == kSize)
+      return false;
+
+    tags[t % kSize] = tag;
+    __sync_synchronize();
+    tail = t + 1;
+    return true;
+  }
+
+  bool Pop(int64_t* tag) {
+    const uint32_t h = head;
+    if (h == tail)
+      return false;
+
+    __sync_synchronize();
+    *tag = tags[h % kSize];
+    __sync_synchronize();
+    head = h + 1;
+    return true;
+  }
+
+  volatile uint32_t head;  // Written by the consumer.
+  volatile uint32_t tail;  // Written by the producer.
+  int64_t           tags[kSize];
+};
+
+// A thread's encoded events (see heapster_events.h); consumers hold
+// the event monitor. Once its thread has ended, the buffer is reused
+// for another.
+struct EventBuffer {
+  static const uint32_t kSize = 1 << 14;
+
+  EventBuffer()
+      : next(NULL), id(0), head(0), tail(0), dead(false),
+        last_time(0), flushed_time(0) {}
+
+  // Appends a record, given in two parts, whole or not at all.
+  bool Push(const char* a, uint32_t na, const char* b, uint32_t nb) {
+    const uint32_t t = tail;
+    if (kSize - (t - head) < na + nb)
+      return false;
+
+    Put(t, a, na);
+    Put(t + na, b, nb);
+    __sync_synchronize();
+    tail = t + na + nb;
+    return true;
+  }
+
+  // Copies out what's been pushed, returning how much; its room is
+  // only given back by Consume.
+  uint32_t Copy(std::vector<char>* out) const {
+    const uint32_t h = head, t = tail;
+    const uint32_t n = t - h;
+    out->resize(n);
+    if (n == 0)
+      return 0;
+
+    __sync_synchronize();
+    const uint32_t at = h % kSize;
+    const uint32_t first = n < kSize - at ? n : kSize - at;
+    memcpy(&(*out)[0], bytes + at, first);
+    memcpy(&(*out)[0] + first, bytes, n - first);
+    return n;
+  }
+
+  void Consume(uint32_t n) {
+    __sync_synchronize();
+    head = head + n;
+  }
+
+  EventBuffer*      next;
+  uint64_t          id;            // Of its thread.
+  volatile uint32_t head;          // Written by the consumer.
+  volatile uint32_t tail;          // Written by the producer.
+  volatile bool     dead;          // Its thread has ended.
+  uint64_t          last_time;     // Of the last event pushed.
+  uint64_t          flushed_time;  // Of the last event flushed.
+  char              bytes[kSize];
+
+ private:
+  // Copies in n bytes at position t, wrapping at most once.
+  void Put(uint32_t t, const char* p, uint32_t n) {
+    const uint32_t at = t % kSize;
+    const uint32_t first = n < kSize - at ? n : kSize - at;
+    memcpy(bytes + at, p, first);
+    memcpy(bytes, p + first, n - first);
+  }
+};
+
+#endif  // HEAPSTER_RINGS_H_
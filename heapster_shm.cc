@@ -0,0 +1,128 @@
+// Reads the profiles agents publish in shared memory; see
+// heapster_shm.h.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heapster_shm.h"
+
+using namespace std;
+
+static const int kMaxReadAttempts = 100;
+
+ShmReader::ShmReader() : base_(NULL), size_(0) {}
+
+ShmReader::~ShmReader() {
+  if (base_ != NULL)
+    munmap(const_cast<char*>(base_), size_);
+}
+
+bool ShmReader::Open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+
+  if (static_cast<size_t>(st.st_size) < sizeof(ShmHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+
+  base_ = static_cast<const char*>(base);
+  size_ = st.st_size;
+  return true;
+}
+
+bool ShmReader::Read(ShmProfile* profile) {
+  const ShmHeader* header = reinterpret_cast<const ShmHeader*>(base_);
+  if (base_ == NULL || header->magic != kShmMagic ||
+      header->version != kShmVersion)
+    return false;
+
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    const uint64_t seq = header->seq;
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+
+    // The header says how much to copy, but may be changing under us;
+    // the seqlock tells us afterwards whether to believe it.
+    uint64_t n = sizeof(ShmHeader) + header->data_bytes;
+    if (n > size_)
+      n = size_;
+    copy_.resize(n);
+    memcpy(&copy_[0], base_, n);
+
+    __sync_synchronize();
+    if (header->seq == seq)
+      return Parse(profile);
+  }
+
+  return false;
+}
+
+// Parses our copy, which is consistent, but checked anyway.
+bool ShmReader::Parse(ShmProfile* profile) const {
+  const ShmHeader* header = reinterpret_cast<const ShmHeader*>(&copy_[0]);
+  const char* p = &copy_[0] + sizeof(ShmHeader);
+  const char* end = &copy_[0] + copy_.size();
+
+  if (sizeof(ShmHeader) + header->data_bytes != copy_.size())
+    return false;
+
+  profile->pid = header->pid;
+  profile->time_millis = header->time_millis;
+  profile->sample_period = header->sample_period;
+  profile->truncated = header->truncated != 0;
+  profile->sites.clear();
+  profile->symbols.clear();
+
+  for (uint32_t i = 0; i < header->nsites; ++i) {
+    const ShmSite* s = reinterpret_cast<const ShmSite*>(p);
+    if (static_cast<size_t>(end - p) < ShmSite::Size(0) ||
+        static_cast<size_t>(end - p) < ShmSite::Size(s->nframes))
+      return false;
+
+    profile->sites.push_back(ShmProfile::Site());
+    ShmProfile::Site& site = profile->sites.back();
+    site.inuse_objects = s->inuse_objects;
+    site.inuse_bytes = s->inuse_bytes;
+    site.alloc_objects = s->alloc_objects;
+    site.alloc_bytes = s->alloc_bytes;
+    site.frames.assign(s->frames, s->frames + s->nframes);
+    p += ShmSite::Size(s->nframes);
+  }
+
+  for (uint32_t i = 0; i < header->nsymbols; ++i) {
+    const ShmSymbol* s = reinterpret_cast<const ShmSymbol*>(p);
+    if (static_cast<size_t>(end - p) < ShmSymbol::Size(0) ||
+        static_cast<size_t>(end - p) < ShmSymbol::Size(s->name_length))
+      return false;
+
+    profile->symbols[s->method] =
+        string(reinterpret_cast<const char*>(s + 1), s->name_length);
+    p += ShmSymbol::Size(s->name_length);
+  }
+
+  return true;
+}
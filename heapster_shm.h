@@ -0,0 +1,99 @@
+// The layout of the profiles the agent publishes in shared memory
+// (with HEAPSTER_SHM), and a reader for other processes.
+//
+// The file starts with a header, followed by the sites and then the
+// symbols, as 8-byte aligned records. The agent rewrites it all
+// periodically, under a seqlock: seq is odd while it's being
+// written, so readers copy it out and retry if seq was odd or
+// changed meanwhile.
+
+#ifndef HEAPSTER_SHM_H_
+#define HEAPSTER_SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+static const uint32_t kShmMagic = 0x54535048;  // "HPST"
+static const uint32_t kShmVersion = 1;
+
+struct ShmHeader {
+  uint32_t magic;
+  uint32_t version;
+  volatile uint64_t seq;
+  uint64_t pid;
+  uint64_t time_millis;  // Of the last update.
+  uint64_t sample_period;
+  uint64_t data_bytes;   // Of the records, following the header.
+  uint32_t nsites;
+  uint32_t nsymbols;
+  uint32_t truncated;    // Set if some sites didn't fit.
+  uint32_t unused;
+};
+
+// Counts are unsampled, and frames are method IDs.
+struct ShmSite {
+  int64_t  inuse_objects;
+  int64_t  inuse_bytes;
+  int64_t  alloc_objects;
+  int64_t  alloc_bytes;
+  uint32_t nframes;
+  uint32_t unused;
+  uint64_t frames[1];
+
+  static size_t Size(uint32_t nframes) {
+    return offsetof(ShmSite, frames) + nframes * sizeof(uint64_t);
+  }
+};
+
+// Names the methods in the sites' frames; name_length bytes of name
+// follow, padded to a multiple of 8.
+struct ShmSymbol {
+  uint64_t method;
+  uint32_t name_length;
+  uint32_t unused;
+
+  static size_t Size(uint32_t name_length) {
+    return (sizeof(ShmSymbol) + name_length + 7) & ~static_cast<size_t>(7);
+  }
+};
+
+struct ShmProfile {
+  struct Site {
+    long long inuse_objects, inuse_bytes, alloc_objects, alloc_bytes;
+    std::vector<uint64_t> frames;
+  };
+
+  uint64_t pid;
+  uint64_t time_millis;
+  uint64_t sample_period;
+  bool truncated;
+  std::vector<Site> sites;
+  std::map<uint64_t, std::string> symbols;
+};
+
+// Reads profiles published by an agent, without its cooperation.
+class ShmReader {
+ public:
+  ShmReader();
+  ~ShmReader();
+
+  // Returns false (with errno set) if the file can't be mapped.
+  bool Open(const char* path);
+
+  // Takes a consistent copy of the profile. Returns false if the
+  // file isn't a profile, or is changing too fast to copy.
+  bool Read(ShmProfile* profile);
+
+ private:
+  bool Parse(ShmProfile* profile) const;
+
+  const char*       base_;
+  size_t            size_;
+  std::vector<char> copy_;
+};
+
+#endif  // HEAPSTER_SHM_H_
@@ -0,0 +1,68 @@
+// heapster-shm prints the profile an agent publishes in shared
+// memory (with HEAPSTER_SHM) in the perftools heap profile format,
+// for pprof:
+//
+//   heapster-shm /dev/shm/heapster.<pid> > profile
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "heapster_shm.h"
+
+using namespace std;
+
+int
+main(int argc, char** argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s path\n", argv[0]);
+    return 2;
+  }
+
+  ShmReader reader;
+  if (!reader.Open(argv[1]))
+    err(1, "%s", argv[1]);
+
+  ShmProfile profile;
+  if (!reader.Read(&profile))
+    errx(1, "%s: failed to read a profile", argv[1]);
+
+  if (profile.truncated)
+    warnx("%s: profile truncated; some sites are missing", argv[1]);
+
+  printf("--- symbol\nbinary=heapster\n");
+  for (map<uint64_t, string>::const_iterator it = profile.symbols.begin();
+       it != profile.symbols.end(); ++it) {
+    printf("0x%016" PRIx64 " %s\n", it->first, it->second.c_str());
+    printf("0x%016" PRIx64 " %s\n", it->first - 1, it->second.c_str());
+  }
+  printf("---\n--- heap\n");
+
+  long long inuse_objects = 0, inuse_bytes = 0;
+  long long alloc_objects = 0, alloc_bytes = 0;
+  for (size_t i = 0; i < profile.sites.size(); ++i) {
+    const ShmProfile::Site& s = profile.sites[i];
+    inuse_objects += s.inuse_objects;
+    inuse_bytes += s.inuse_bytes;
+    alloc_objects += s.alloc_objects;
+    alloc_bytes += s.alloc_bytes;
+  }
+
+  printf("heap profile: %6lld: %8lld [%6lld: %8lld] @ heapprofile\n",
+         inuse_objects, inuse_bytes, alloc_objects, alloc_bytes);
+
+  for (size_t i = 0; i < profile.sites.size(); ++i) {
+    const ShmProfile::Site& s = profile.sites[i];
+    printf("%6lld: %8lld [%6lld: %8lld] @",
+           s.inuse_objects, s.inuse_bytes, s.alloc_objects, s.alloc_bytes);
+    for (size_t j = 0; j < s.frames.size(); ++j)
+      printf(" 0x%016" PRIx64, s.frames[j]);
+    printf("\n");
+  }
+
+  if (fflush(stdout) != 0 || ferror(stdout))
+    err(1, "stdout");
+
+  return 0;
+}
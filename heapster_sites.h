@@ -0,0 +1,557 @@
+// Allocation sites, the table that finds them by stack, and the
+// tags that sampled objects carry back to them when freed.
+//
+// Samplers find and insert sites without a lock. A site is built in
+// full before a compare-and-swap claims its slot, which publishes it;
+// losing the race to an insert of the same stack frees it again. The
+// table is grown under a lock of its own, taken only to grow: the
+// grower marks each empty slot of the old table as moved, so that
+// inserts racing with it can't land where it has already looked, and
+// wait for the new table instead.
+//
+// Sites can be reclaimed too, at points where the caller knows no
+// one will look for them by tag: Reclaim unpublishes them (and their
+// indices), then waits out the readers that may still hold them
+// before freeing them. Readers announce themselves in counters
+// striped by thread, so that they share no cache line in the common
+// case, and in two sets, so that waiting on one set isn't starved by
+// new readers, which count in the other.
+
+#ifndef HEAPSTER_SITES_H_
+#define HEAPSTER_SITES_H_
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+// Sampled objects are tagged with what we need to account for them
+// when they're freed, packed so that tagging allocates nothing:
+//
+//   [63] 0  [62:56] epoch  [55:32] site index  [31:0] size/8
+//
+// The epoch is that of the profile the object was counted in, mod
+// 128. Object sizes are multiples of 8. Tags with bit 63 set are
+// left to other uses.
+static const int      kTagEpochShift = 56;
+static const uint32_t kTagEpochMask  = 0x7f;
+static const int      kTagSiteShift  = 32;
+static const uint32_t kMaxSites      = 1 << 24;
+
+inline int64_t MakeSiteTag(uint32_t epoch, uint32_t site, int64_t size) {
+  return static_cast<int64_t>(epoch & kTagEpochMask) << kTagEpochShift |
+      static_cast<int64_t>(site) << kTagSiteShift |
+      ((size + 7) >> 3 & 0xffffffffLL);
+}
+
+inline uint32_t SiteTagEpoch(int64_t tag) {
+  return tag >> kTagEpochShift & kTagEpochMask;
+}
+
+inline uint32_t SiteTagIndex(int64_t tag) {
+  return tag >> kTagSiteShift & (kMaxSites - 1);
+}
+
+inline int64_t SiteTagSize(int64_t tag) {
+  return (tag & 0xffffffffLL) << 3;
+}
+
+// Zeroed memory, or we exit as the agent's errx would (the agent
+// defines its own, so we don't include err.h).
+inline void* SiteAlloc(size_t n) {
+  void* p = calloc(1, n);
+  if (p == NULL) {
+    fputs("Out of memory\n", stderr);
+    exit(3);
+  }
+  return p;
+}
+
+// A site's counts and stack are laid out together, in a record of
+// Size(nframes) bytes.
+template <typename Frame>
+struct SiteRecord {
+  long     hash;
+  uint32_t index;    // For tags; kMaxSites if it has none.
+  int      nframes;
+
+  // Stats, updated atomically.
+  volatile int64_t alloc_objects;
+  volatile int64_t alloc_bytes;
+  volatile int64_t inuse_objects;
+  volatile int64_t inuse_bytes;
+
+  // Allocations since the site was first seen; these survive
+  // clearing the profile.
+  volatile int64_t lifetime_objects;
+  volatile int64_t lifetime_bytes;
+
+  // The id of the next delta dump as of the last change to the
+  // counts (see Heapster::MarkChanged).
+  volatile uint32_t changed;
+
+  // Whether the site is defined in the event log.
+  volatile uint32_t logged;
+
+  Frame stack[1];  // nframes long.
+
+  static size_t Size(int nframes) {
+    return offsetof(SiteRecord, stack) +
+        sizeof(Frame) * (nframes > 0 ? nframes : 1);
+  }
+};
+
+template <typename Frame>
+class SiteTable {
+ public:
+  typedef SiteRecord<Frame> Site;
+
+  static const uint32_t kChunkSize = 1 << 12;
+  static const uint32_t kReaderStripes = 64;
+
+  // Slots keep the hash of their site, so that probing only touches
+  // site records that are likely to match. The hash is stored after
+  // the site is published, so 0 only means it isn't known yet.
+  struct Slot {
+    volatile long  hash;
+    Site* volatile site;
+  };
+
+  struct Slots {
+    uint32_t capacity;  // A power of two.
+    Slots*   retired;   // The slots these replaced.
+    Slot     slots[1];  // capacity long.
+
+    // The site in slot i, if any.
+    Site* At(uint32_t i) const {
+      Site* s = slots[i].site;
+      return s != Moved() ? s : NULL;
+    }
+  };
+
+  // Lookups, inserts, and any use of the sites they return must be
+  // made in a Reader's scope if sites may be reclaimed meanwhile.
+  class Reader {
+   public:
+    explicit Reader(SiteTable* table) : count_(table->Enter()) {}
+    ~Reader() { __sync_sub_and_fetch(count_, 1); }
+
+   private:
+    volatile long* count_;
+  };
+
+  // Picks the sites to reclaim, and takes their final counts.
+  class Reclaimer {
+   public:
+    virtual ~Reclaimer() {}
+
+    // Whether to reclaim the site. Readers may still be counting in
+    // it, until it's handed to Reclaimed.
+    virtual bool ShouldReclaim(const Site* s) = 0;
+
+    // Called with the reclaimed sites once no reader can reach them,
+    // before they're freed and their indices reused.
+    virtual void Reclaimed(Site* const* sites, size_t n) = 0;
+
+    // Whether indices may be reused once Reclaimed returns: objects
+    // tagged with them may outlive their sites. Those that mayn't
+    // yet are held until a reclaim that says they may.
+    virtual bool ReuseIndices() { return true; }
+  };
+
+  explicit SiteTable(uint32_t capacity)
+      : slots_(NewSlots(capacity)), min_capacity_(capacity), size_(0),
+        next_index_(0), free_indices_(0), growing_(0), phase_(0) {
+    memset((void*)chunks_, 0, sizeof(chunks_));
+    memset((void*)readers_, 0, sizeof(readers_));
+  }
+
+  // Slots we've outgrown are kept for lookups that may still be
+  // probing them, as are the sites.
+  ~SiteTable() {
+    for (Slots* t = slots_; t != NULL;) {
+      Slots* retired = t->retired;
+      if (t == slots_) {
+        for (uint32_t i = 0; i < t->capacity; ++i)
+          free(t->At(i));
+      }
+      free(t);
+      t = retired;
+    }
+    for (uint32_t i = 0; i < kMaxSites / kChunkSize; ++i)
+      free((void*)chunks_[i]);
+  }
+
+  Site* Find(long h, const Frame* frames, int nframes) const {
+    return Find(slots_, h, frames, nframes);
+  }
+
+  // Finds the site for a stack, or inserts one if the table has
+  // fewer than max_size sites; returns NULL if it's full. Sets
+  // inserted if the site is new.
+  Site* Insert(long h, const Frame* frames, int nframes, uint32_t max_size,
+               bool* inserted) {
+    *inserted = false;
+
+    // Reserving room first keeps the table within max_size however
+    // many insert at once, and at most half full.
+    for (uint32_t size = size_;; size = size_) {
+      if (size >= max_size)
+        return Find(h, frames, nframes);
+      if (__sync_bool_compare_and_swap(&size_, size, size + 1))
+        break;
+    }
+
+    Site* s = NewSite(h, frames, nframes);
+    for (;;) {
+      Slots* t = slots_;
+      if (2 * size_ > t->capacity) {
+        Grow(t);
+        continue;
+      }
+
+      Site* found = Claim(t, s);
+      if (found == s) {
+        *inserted = true;
+        return s;
+      }
+
+      if (found != Moved()) {
+        __sync_sub_and_fetch(&size_, 1);
+        if (s->index < kMaxSites) {
+          Entry(s->index) = NULL;
+          Recycle(s->index);
+        }
+        free(s);
+        return found;
+      }
+
+      // Someone is growing the table: wait for the new slots.
+      while (slots_ == t)
+        sched_yield();
+    }
+  }
+
+  // Sites are numbered for tags, and can be looked up by number
+  // without a lock from a directory of chunks. Numbers of reclaimed
+  // sites are reused; past kMaxSites live sites, sites get none.
+  Site* ByIndex(uint32_t index) const {
+    if (index >= kMaxSites)
+      return NULL;
+    Site* volatile* chunk = chunks_[index / kChunkSize];
+    if (chunk == NULL)
+      return NULL;
+
+    // Free numbers' entries link them, and are odd.
+    Site* s = chunk[index % kChunkSize];
+    return reinterpret_cast<uintptr_t>(s) & 1 ? NULL : s;
+  }
+
+  // Removes the sites the reclaimer picks, and shrinks the slots to
+  // fit the rest; returns how many were removed. Their indices are
+  // reused only as the reclaimer allows. Waits for readers,
+  // so it must not be called in a Reader's scope, nor by two threads
+  // at once.
+  size_t Reclaim(Reclaimer* reclaimer) {
+    std::vector<Site*> live, dead;
+    while (__sync_lock_test_and_set(&growing_, 1))
+      sched_yield();
+
+    // As when growing, inserts either land before we look or wait.
+    Slots* old = slots_;
+    for (uint32_t i = 0; i < old->capacity; ++i) {
+      Site* s = old->slots[i].site;
+      if (s == NULL)
+        s = __sync_val_compare_and_swap(&old->slots[i].site, (Site*)NULL,
+                                        Moved());
+      if (s == NULL)
+        continue;
+      if (reclaimer->ShouldReclaim(s))
+        dead.push_back(s);
+      else
+        live.push_back(s);
+    }
+
+    const uint32_t size = __sync_sub_and_fetch(&size_, dead.size());
+    uint32_t capacity = min_capacity_;
+    while (capacity < 2 * size)
+      capacity *= 2;
+
+    Slots* t = NewSlots(capacity);
+    for (size_t i = 0; i < live.size(); ++i)
+      Place(t, live[i]);
+    for (size_t i = 0; i < dead.size(); ++i) {
+      if (dead[i]->index < kMaxSites)
+        Entry(dead[i]->index) = NULL;
+    }
+
+    __sync_synchronize();
+    slots_ = t;
+    __sync_lock_release(&growing_);
+
+    // Readers that started before we unpublished may still hold the
+    // dead sites, or be probing the old slots.
+    Synchronize();
+    if (!dead.empty())
+      reclaimer->Reclaimed(&dead[0], dead.size());
+
+    for (size_t i = 0; i < dead.size(); ++i) {
+      if (dead[i]->index < kMaxSites)
+        held_.push_back(dead[i]->index);
+      free(dead[i]);
+    }
+    if (reclaimer->ReuseIndices()) {
+      for (size_t i = 0; i < held_.size(); ++i)
+        Recycle(held_[i]);
+      held_.clear();
+    }
+    while (old != NULL) {
+      Slots* retired = old->retired;
+      free(old);
+      old = retired;
+    }
+    return dead.size();
+  }
+
+  uint32_t size() const { return size_; }
+
+  // For walking the sites; see Slots::At.
+  const Slots* slots() const { return slots_; }
+
+ private:
+  // Marks empty slots of tables being grown. Sites are aligned, so
+  // this is never one.
+  static Site* Moved() { return reinterpret_cast<Site*>(1); }
+
+  static uint32_t SlotIndex(long h, uint32_t capacity) {
+    return static_cast<uint32_t>(h ^ (h >> 16)) & (capacity - 1);
+  }
+
+  static bool Matches(const Slot& slot, const Site* s,
+                      long h, const Frame* frames, int nframes) {
+    const long slot_hash = slot.hash;
+    if (slot_hash != 0 ? slot_hash != h : s->hash != h)
+      return false;
+    if (s->nframes != nframes)
+      return false;
+
+    for (int j = 0; j < nframes; j++) {
+      if (frames[j] != s->stack[j])
+        return false;
+    }
+    return true;
+  }
+
+  // Slots are at most half full, so probing always ends at an empty
+  // (or moved) slot.
+  static Site* Find(const Slots* t, long h, const Frame* frames,
+                    int nframes) {
+    const uint32_t mask = t->capacity - 1;
+    for (uint32_t i = SlotIndex(h, t->capacity);; i = (i + 1) & mask) {
+      Site* s = t->slots[i].site;
+      if (s == NULL || s == Moved())
+        return NULL;
+      if (Matches(t->slots[i], s, h, frames, nframes))
+        return s;
+    }
+  }
+
+  // Returns s if it claimed a slot for s, the site already there for
+  // its stack, or Moved() if the slots are being grown.
+  static Site* Claim(Slots* t, Site* s) {
+    const uint32_t mask = t->capacity - 1;
+    for (uint32_t i = SlotIndex(s->hash, t->capacity);; i = (i + 1) & mask) {
+      Slot& slot = t->slots[i];
+      Site* other = slot.site;
+      if (other == NULL) {
+        // The swap is a full barrier, so the site is complete before
+        // anyone can see it.
+        other = __sync_val_compare_and_swap(&slot.site, (Site*)NULL, s);
+        if (other == NULL) {
+          slot.hash = s->hash;
+          return s;
+        }
+      }
+
+      if (other == Moved())
+        return other;
+      if (Matches(slot, other, s->hash, s->stack, s->nframes))
+        return other;
+    }
+  }
+
+  // Only one thread grows the table at a time; inserts meanwhile
+  // either claimed their slots before the grower looked at them, and
+  // are moved with the rest, or find them moved.
+  void Grow(Slots* old) {
+    while (__sync_lock_test_and_set(&growing_, 1))
+      sched_yield();
+
+    if (slots_ == old) {
+      Slots* t = NewSlots(2 * old->capacity);
+      for (uint32_t i = 0; i < old->capacity; ++i) {
+        Site* s = old->slots[i].site;
+        if (s == NULL)
+          s = __sync_val_compare_and_swap(&old->slots[i].site, (Site*)NULL,
+                                          Moved());
+        if (s != NULL)
+          Place(t, s);
+      }
+
+      t->retired = old;
+      __sync_synchronize();
+      slots_ = t;
+    }
+
+    __sync_lock_release(&growing_);
+  }
+
+  // Places a site in slots no one else can see yet.
+  static void Place(Slots* t, Site* s) {
+    const uint32_t mask = t->capacity - 1;
+    uint32_t i = SlotIndex(s->hash, t->capacity);
+    while (t->slots[i].site != NULL)
+      i = (i + 1) & mask;
+    t->slots[i].hash = s->hash;
+    t->slots[i].site = s;
+  }
+
+  static Slots* NewSlots(uint32_t capacity) {
+    const size_t size = offsetof(Slots, slots) + sizeof(Slot) * capacity;
+    Slots* t = static_cast<Slots*>(SiteAlloc(size));
+    t->capacity = capacity;
+    return t;
+  }
+
+  Site* NewSite(long h, const Frame* frames, int nframes) {
+    Site* s = static_cast<Site*>(SiteAlloc(Site::Size(nframes)));
+
+    s->hash = h;
+    s->nframes = nframes;
+    for (int i = 0; i < nframes; ++i)
+      s->stack[i] = frames[i];
+    s->index = Index(s);
+    return s;
+  }
+
+  // Free numbers are reused first, from a stack linked through
+  // their directory entries: an entry holds the next number + 1,
+  // shifted left and or'ed with 1. The head holds the top number + 1
+  // in its low 32 bits, and, above them, a count of pushes, so that
+  // a pop can't succeed against a head that was popped and pushed
+  // back meanwhile.
+  uint32_t Index(Site* s) {
+    uint32_t index = Reuse();
+    if (index == kMaxSites) {
+      do {
+        index = next_index_;
+        if (index >= kMaxSites)
+          return kMaxSites;
+      } while (!__sync_bool_compare_and_swap(&next_index_, index, index + 1));
+    }
+
+    Site* volatile* chunk = chunks_[index / kChunkSize];
+    if (chunk == NULL) {
+      Site* volatile* fresh =
+          static_cast<Site* volatile*>(SiteAlloc(kChunkSize * sizeof(Site*)));
+      chunk = __sync_val_compare_and_swap(&chunks_[index / kChunkSize],
+                                          (Site* volatile*)NULL, fresh);
+      if (chunk == NULL)
+        chunk = fresh;
+      else
+        free((void*)fresh);
+    }
+
+    chunk[index % kChunkSize] = s;
+    return index;
+  }
+
+  // Of a number that's been handed out, so its chunk exists.
+  Site* volatile& Entry(uint32_t index) {
+    return chunks_[index / kChunkSize][index % kChunkSize];
+  }
+
+  uint32_t Reuse() {
+    for (;;) {
+      const uint64_t head = free_indices_;
+      const uint32_t top = static_cast<uint32_t>(head);
+      if (top == 0)
+        return kMaxSites;
+
+      const uintptr_t link = reinterpret_cast<uintptr_t>(Entry(top - 1));
+      if (!(link & 1))
+        continue;  // Popped under us.
+
+      const uint64_t next = (head >> 32 << 32) | (link >> 1);
+      if (__sync_bool_compare_and_swap(&free_indices_, head, next))
+        return top - 1;
+    }
+  }
+
+  void Recycle(uint32_t index) {
+    for (;;) {
+      const uint64_t head = free_indices_;
+      Entry(index) = reinterpret_cast<Site*>(
+          static_cast<uintptr_t>(static_cast<uint32_t>(head)) << 1 | 1);
+      const uint64_t next = ((head >> 32) + 1) << 32 | (index + 1);
+      if (__sync_bool_compare_and_swap(&free_indices_, head, next))
+        return;
+    }
+  }
+
+  volatile long* Enter() {
+    if (reader_stripe_ == 0)
+      reader_stripe_ = __sync_add_and_fetch(&next_reader_stripe_, 1);
+
+    // The add is a full barrier, so our reads of the table follow it.
+    volatile long* count =
+        &readers_[phase_ & 1][reader_stripe_ % kReaderStripes].count;
+    __sync_add_and_fetch(count, 1);
+    return count;
+  }
+
+  // Waits for the readers that started before we were called. A
+  // reader may read the phase just before we flip it and count in
+  // the set we then wait on only after we've looked; so we wait on
+  // both sets in turn, flipping before each.
+  void Synchronize() {
+    for (int i = 0; i < 2; ++i) {
+      const uint32_t phase = __sync_fetch_and_add(&phase_, 1);
+      for (uint32_t j = 0; j < kReaderStripes; ++j) {
+        while (readers_[phase & 1][j].count != 0)
+          sched_yield();
+      }
+    }
+  }
+
+  struct ReaderCount {
+    volatile long count;
+    char          pad[64 - sizeof(long)];
+  };
+
+  static __thread uint32_t reader_stripe_;
+  static volatile uint32_t next_reader_stripe_;
+
+  Slots* volatile   slots_;
+  const uint32_t    min_capacity_;
+  volatile uint32_t size_;
+  volatile uint32_t next_index_;
+  volatile uint64_t free_indices_;
+  volatile int      growing_;
+  volatile uint32_t phase_;
+  std::vector<uint32_t> held_;  // Indices not yet reused; see Reclaim.
+  ReaderCount       readers_[2][kReaderStripes];
+  Site* volatile* volatile chunks_[kMaxSites / kChunkSize];
+};
+
+template <typename Frame>
+__thread uint32_t SiteTable<Frame>::reader_stripe_ = 0;
+
+template <typename Frame>
+volatile uint32_t SiteTable<Frame>::next_reader_stripe_ = 0;
+
+#endif  // HEAPSTER_SITES_H_
@@ -172,6 +172,10 @@ typedef struct CrwClassImage {
     char* obj_init_sig;         /* Signature of this method */
     char* newarray_name;        /* Method name to call after newarray opcodes */
     char* newarray_sig;         /* Signature of this method */
+    char* alloc_name;           /* Method name to call after new opcodes */
+    char* alloc_sig;            /* Signature of this method */
+    char* array_alloc_name;     /* Method name to call before newarray opcodes */
+    char* array_alloc_sig;      /* Signature of this method */
 
     /* Constant pool index values for new entries */
     CrwCpoolIndex               tracker_class_index;
@@ -179,6 +183,8 @@ typedef struct CrwClassImage {
     CrwCpoolIndex               newarray_tracker_index;
     CrwCpoolIndex               call_tracker_index;
     CrwCpoolIndex               return_tracker_index;
+    CrwCpoolIndex               alloc_tracker_index;
+    CrwCpoolIndex               array_alloc_tracker_index;
     CrwCpoolIndex               class_number_index; /* Class number in pool */
 
     /* Count of injections made into this class */
@@ -193,6 +199,7 @@ typedef struct CrwClassImage {
     /* Callback functions */
     FatalErrorHandler           fatal_error_handler;
     MethodNumberRegister        mnum_callback;
+    AllocationSiteRegister      site_callback;
 
     /* Table of method names and descr's */
     int                         method_count;
@@ -759,6 +766,18 @@ cpool_setup(CrwClassImage *ci)
                     ci->return_name,
                     ci->return_sig);
     }
+    if (ci->alloc_name != NULL) {
+        ci->alloc_tracker_index = add_new_method_cpool_entry(ci,
+                    ci->tracker_class_index,
+                    ci->alloc_name,
+                    ci->alloc_sig);
+    }
+    if (ci->array_alloc_name != NULL) {
+        ci->array_alloc_tracker_index = add_new_method_cpool_entry(ci,
+                    ci->tracker_class_index,
+                    ci->array_alloc_name,
+                    ci->array_alloc_sig);
+    }
 
     random_writeU2(ci, cpool_output_position, ci->cpool_count_plus_one);
 }
@@ -872,6 +891,105 @@ injection_template(MethodImage *mi, ByteCode *bytecodes, ByteOffset max_nbytes,
     return nbytes;
 }
 
+/* Push an allocation site number as two 15 bit halves */
+static ByteOffset
+push_site_number_bytecodes(ByteCode *bytecodes, unsigned number)
+{
+    ByteOffset nbytes = 0;
+
+    nbytes += push_short_constant_bytecodes(bytecodes+nbytes,
+                                        (number >> 15) & 0x7FFF);
+    nbytes += push_short_constant_bytecodes(bytecodes+nbytes,
+                                        number & 0x7FFF);
+    return nbytes;
+}
+
+/* Name the type allocated by the new, newarray or anewarray opcode at
+ *   this input bytecode offset. Returns space that must be deallocated.
+ */
+static char *
+allocation_type(MethodImage *mi, ClassOpcode opcode, ByteOffset at)
+{
+    static const char *primitive_arrays[] = {
+        "[Z", "[C", "[F", "[D", "[B", "[S", "[I", "[J"
+    };
+    CrwClassImage *      ci;
+    const unsigned char *operand;
+    CrwConstantPoolEntry cs;
+    char *               type;
+    unsigned             atype;
+
+    ci = mi->ci;
+    operand = ci->input + mi->start_of_input_bytecodes + at + 1;
+
+    if ( opcode == JVM_OPC_newarray ) {
+        atype = operand[0];
+        CRW_ASSERT(ci, atype >= 4 && atype <= 11);
+        return (char *)duplicate(ci, primitive_arrays[atype - 4], 2);
+    }
+
+    cs = cpool_entry(ci, (CrwCpoolIndex)(cpool_entry(ci,
+                (CrwCpoolIndex)((operand[0] << 8) | operand[1])).index1));
+    if ( opcode == JVM_OPC_new ) {
+        return (char *)duplicate(ci, cs.ptr, cs.len);
+    }
+
+    /* anewarray: an array of arrays, or of objects */
+    type = (char *)allocate(ci, cs.len + 4);
+    if ( cs.ptr[0] == '[' ) {
+        (void)snprintf(type, cs.len + 4, "[%.*s", (int)cs.len, cs.ptr);
+    } else {
+        (void)snprintf(type, cs.len + 4, "[L%.*s;", (int)cs.len, cs.ptr);
+    }
+    return type;
+}
+
+/* Called to create injection code that reports an allocation site */
+static ByteOffset
+site_injection_code(MethodImage *mi, ClassOpcode opcode, ByteOffset at,
+                    ByteCode *bytecodes, ByteOffset max_nbytes)
+{
+    CrwClassImage *     ci;
+    CrwCpoolIndex       method_index;
+    ByteOffset          nbytes = 0;
+    unsigned            max_stack;
+    unsigned            site;
+    char *              type;
+
+    ci = mi->ci;
+    if ( opcode == JVM_OPC_new ) {
+        method_index = ci->alloc_tracker_index;
+        max_stack = mi->max_stack + 2;
+    } else {
+        method_index = ci->array_alloc_tracker_index;
+        max_stack = mi->max_stack + 3;
+    }
+    if ( method_index == 0 ) {
+        return 0;
+    }
+
+    type = allocation_type(mi, opcode, at);
+    site = (*(ci->site_callback))(ci->number, mi->number, at, type);
+    deallocate(ci, (void*)type);
+    CRW_ASSERT(ci, site < (1U << 30));
+
+    /* Arrays report their length, which is on the stack */
+    if ( opcode != JVM_OPC_new ) {
+        bytecodes[nbytes++] = (ByteCode)JVM_OPC_dup;
+    }
+    nbytes += push_site_number_bytecodes(bytecodes+nbytes, site);
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_invokestatic;
+    bytecodes[nbytes++] = (ByteCode)(method_index >> 8);
+    bytecodes[nbytes++] = (ByteCode)method_index;
+    bytecodes[nbytes]   = 0;
+    CRW_ASSERT(ci, nbytes<max_nbytes);
+
+    if ( max_stack > mi->new_max_stack ) {
+        mi->new_max_stack = max_stack;
+    }
+    return nbytes;
+}
+
 /* Called to create injection code at entry to a method */
 static ByteOffset
 entry_injection_code(MethodImage *mi, ByteCode *bytecodes, ByteOffset len)
@@ -896,7 +1014,7 @@ entry_injection_code(MethodImage *mi, ByteCode *bytecodes, ByteOffset len)
 
 /* Called to create injection code before an opcode */
 static ByteOffset
-before_injection_code(MethodImage *mi, ClassOpcode opcode,
+before_injection_code(MethodImage *mi, ClassOpcode opcode, ByteOffset at,
                       ByteCode *bytecodes, ByteOffset len)
 {
     ByteOffset nbytes = 0;
@@ -904,6 +1022,11 @@ before_injection_code(MethodImage *mi, ClassOpcode opcode,
 
     CRW_ASSERT_MI(mi);
     switch ( opcode ) {
+        case JVM_OPC_newarray:
+        case JVM_OPC_anewarray:
+            /* The length is only on the stack before the opcode */
+            nbytes = site_injection_code(mi, opcode, at, bytecodes, len);
+            break;
         case JVM_OPC_return:
         case JVM_OPC_ireturn:
         case JVM_OPC_lreturn:
@@ -923,7 +1046,7 @@ before_injection_code(MethodImage *mi, ClassOpcode opcode,
 
 /* Called to create injection code after an opcode */
 static ByteOffset
-after_injection_code(MethodImage *mi, ClassOpcode opcode,
+after_injection_code(MethodImage *mi, ClassOpcode opcode, ByteOffset at,
                      ByteCode *bytecodes, ByteOffset len)
 {
     CrwClassImage* ci;
@@ -935,7 +1058,11 @@ after_injection_code(MethodImage *mi, ClassOpcode opcode,
     CRW_ASSERT_MI(mi);
     switch ( opcode ) {
         case JVM_OPC_new:
-            /* Can't inject here cannot pass around uninitialized object */
+            /* Can't pass around the uninitialized object, but we can
+             *   report the site. (Injecting before the new would move
+             *   the target of Uninitialized stack map entries.)
+             */
+            nbytes = site_injection_code(mi, opcode, at, bytecodes, len);
             break;
         case JVM_OPC_newarray:
         case JVM_OPC_anewarray:
@@ -1144,9 +1271,13 @@ inject_for_opcode(MethodImage *mi)
         int             high;
         int             npairs;
         ByteOffset      len;
+        ByteOffset      opcode_pos;
+
+        opcode_pos = pos;
 
         /* Get bytecodes to inject before this opcode */
-        len = before_injection_code(mi, opcode, bytecodes, (int)sizeof(bytecodes));
+        len = before_injection_code(mi, opcode, opcode_pos,
+                                    bytecodes, (int)sizeof(bytecodes));
         if ( len > 0 ) {
             inject_bytecodes(mi, pos, bytecodes, len);
             /* Adjust map after processing this opcode */
@@ -1195,7 +1326,8 @@ inject_for_opcode(MethodImage *mi)
         }
 
         /* Get bytecodes to inject after this opcode */
-        len = after_injection_code(mi, opcode, bytecodes, (int)sizeof(bytecodes));
+        len = after_injection_code(mi, opcode, opcode_pos,
+                                   bytecodes, (int)sizeof(bytecodes));
         if ( len > 0 ) {
             inject_bytecodes(mi, pos, bytecodes, len);
 
@@ -2256,6 +2388,10 @@ inject_class(struct CrwClassImage *ci,
                  char* obj_init_sig,
                  char* newarray_name,
                  char* newarray_sig,
+                 char* alloc_name,
+                 char* alloc_sig,
+                 char* array_alloc_name,
+                 char* array_alloc_sig,
                  unsigned char *buf,
                  long buf_len)
 {
@@ -2285,6 +2421,10 @@ inject_class(struct CrwClassImage *ci,
     ci->obj_init_sig            = obj_init_sig;
     ci->newarray_name           = newarray_name;
     ci->newarray_sig            = newarray_sig;
+    ci->alloc_name              = alloc_name;
+    ci->alloc_sig               = alloc_sig;
+    ci->array_alloc_name        = array_alloc_name;
+    ci->array_alloc_sig         = array_alloc_sig;
     ci->output                  = buf;
     ci->output_len              = buf_len;
 
@@ -2359,10 +2499,15 @@ java_crw_demo(unsigned class_number,
          char* obj_init_sig,    /* Signature of this method */
          char* newarray_name,   /* Method name to call after newarray opcodes */
          char* newarray_sig,    /* Signature of this method */
+         char* alloc_name,      /* Method name to call after new opcodes */
+         char* alloc_sig,       /* Signature of this method */
+         char* array_alloc_name,/* Method name to call before newarray opcodes */
+         char* array_alloc_sig, /* Signature of this method */
          unsigned char **pnew_file_image,
          long *pnew_file_len,
          FatalErrorHandler fatal_error_handler,
-         MethodNumberRegister mnum_callback)
+         MethodNumberRegister mnum_callback,
+         AllocationSiteRegister site_callback)
 {
     CrwClassImage ci;
     long          max_length;
@@ -2374,6 +2519,7 @@ java_crw_demo(unsigned class_number,
     (void)memset(&ci, 0, (int)sizeof(CrwClassImage));
     ci.fatal_error_handler = fatal_error_handler;
     ci.mnum_callback       = mnum_callback;
+    ci.site_callback       = site_callback;
 
     /* Do some interface error checks */
     if ( pnew_file_image==NULL ) {
@@ -2431,6 +2577,21 @@ java_crw_demo(unsigned class_number,
         }
     }
 
+    if ( alloc_name != NULL ) {
+        if ( alloc_sig == NULL || strcmp(alloc_sig, "(II)V") != 0 ) {
+            CRW_FATAL(&ci, "alloc_sig is not (II)V");
+        }
+    }
+    if ( array_alloc_name != NULL ) {
+        if ( array_alloc_sig == NULL || strcmp(array_alloc_sig, "(III)V") != 0 ) {
+            CRW_FATAL(&ci, "array_alloc_sig is not (III)V");
+        }
+    }
+    if ( (alloc_name != NULL || array_alloc_name != NULL) &&
+         site_callback == NULL ) {
+        CRW_FATAL(&ci, "site_callback == NULL");
+    }
+
     /* Finish setup the CrwClassImage structure */
     ci.is_thread_class = JNI_FALSE;
     if ( name != NULL ) {
@@ -2460,6 +2621,10 @@ java_crw_demo(unsigned class_number,
                                  obj_init_sig,
                                  newarray_name,
                                  newarray_sig,
+                                 alloc_name,
+                                 alloc_sig,
+                                 array_alloc_name,
+                                 array_alloc_sig,
                                  new_image,
                                  max_length);
 
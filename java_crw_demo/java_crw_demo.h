@@ -52,6 +52,17 @@ typedef void (*FatalErrorHandler)(const char*message, const char*file, int line)
 
 typedef void (*MethodNumberRegister)(unsigned, const char**, const char**, int);
 
+/* This callback is used to number allocation sites.
+ *   It is called for every new, newarray and anewarray opcode that is
+ *   injected, with the class number, method number and bytecode offset
+ *   of the opcode, and the type allocated (an internal class name,
+ *   e.g. java/lang/String, or an array signature, e.g. [I). The number
+ *   returned (which must be less than 2^30) is passed to the injected
+ *   call as two 15 bit halves.
+ */
+
+typedef unsigned (*AllocationSiteRegister)(unsigned, unsigned, int, const char*);
+
 /* Class file reader/writer interface. Basic input is a classfile image
  *     and details about what to inject. The output is a new classfile image
  *     that was allocated with malloc(), and should be freed by the caller.
@@ -60,7 +71,7 @@ typedef void (*MethodNumberRegister)(unsigned, const char**, const char**, int);
 /* Names of external symbols to look for. These are the names that we
  *   try and lookup in the shared library. On Windows 2000, the naming
  *   convention is to prefix a "_" and suffix a "@N" where N is 4 times
- *   the number or arguments supplied.It has 19 args, so 76 = 19*4.
+ *   the number or arguments supplied.It has 24 args, so 96 = 24*4.
  *   On Windows 2003, Linux, and Solaris, the first name will be
  *   found, on Windows 2000 a second try should find the second name.
  *
@@ -68,7 +79,7 @@ typedef void (*MethodNumberRegister)(unsigned, const char**, const char**, int);
  *            multiple things in this file, including this name.
  */
 
-#define JAVA_CRW_DEMO_SYMBOLS { "java_crw_demo", "_java_crw_demo@76" }
+#define JAVA_CRW_DEMO_SYMBOLS { "java_crw_demo", "_java_crw_demo@96" }
 
 /* Typedef needed for type casting in dynamic access situations. */
 
@@ -88,10 +99,15 @@ typedef void (JNICALL *JavaCrwDemo)(
          char* obj_init_sig,
          char* newarray_name,
          char* newarray_sig,
+         char* alloc_name,
+         char* alloc_sig,
+         char* array_alloc_name,
+         char* array_alloc_sig,
          unsigned char **pnew_file_image,
          long *pnew_file_len,
          FatalErrorHandler fatal_error_handler,
-         MethodNumberRegister mnum_callback
+         MethodNumberRegister mnum_callback,
+         AllocationSiteRegister site_callback
 );
 
 /* Function export (should match typedef above) */
@@ -142,6 +158,21 @@ JNIEXPORT void JNICALL java_crw_demo(
          char* newarray_sig,    /* Signature of this method */
                                 /*  (Must be "(Ljava/lang/Object;II)V") */
 
+         char* alloc_name,      /* Method name in tclass to call after every */
+                                /*   new opcode in every method, with the */
+                                /*   allocation site number */
+
+         char* alloc_sig,       /* Signature of this method */
+                                /*  (Must be "(II)V") */
+
+         char* array_alloc_name,/* Method name in tclass to call before */
+                                /*   every newarray and anewarray opcode, */
+                                /*   with the array length and the */
+                                /*   allocation site number */
+
+         char* array_alloc_sig, /* Signature of this method */
+                                /*  (Must be "(III)V") */
+
          unsigned char
            **pnew_file_image,   /* Returns a pointer to new classfile image */
 
@@ -152,10 +183,16 @@ JNIEXPORT void JNICALL java_crw_demo(
                                 /*  fatal error. NULL sends error to stderr */
 
          MethodNumberRegister
-           mnum_callback        /* Pointer to function that gets called */
+           mnum_callback,       /* Pointer to function that gets called */
                                 /*   with all details on methods in this */
                                 /*   class. NULL means skip this call. */
 
+         AllocationSiteRegister
+           site_callback        /* Pointer to function that numbers */
+                                /*   allocation sites. Required if */
+                                /*   alloc_name or array_alloc_name is */
+                                /*   given. */
+
            );
 
 
@@ -0,0 +1,92 @@
+// Measures what each injection costs allocations, with JMH. The
+// injection is chosen when the agent is loaded, so the benchmark is
+// run once per injection, and once without the agent:
+//
+//   $ javac -cp jmh-core.jar:jmh-generator-annprocess.jar \
+//       -d bench tests/InjectionBenchmark.java
+//   $ java -cp jmh-core.jar:bench org.openjdk.jmh.Main \
+//       -jvmArgsAppend -agentpath:$PWD/libheapster.so
+//
+// with HEAPSTER_INJECTION=object, then =tick, in the environment
+// (forks inherit it). Objects that don't escape show whether the
+// injection defeats escape analysis; those that do, what it adds to
+// a real allocation.
+
+import java.util.concurrent.TimeUnit;
+
+import org.openjdk.jmh.annotations.Benchmark;
+import org.openjdk.jmh.annotations.BenchmarkMode;
+import org.openjdk.jmh.annotations.Fork;
+import org.openjdk.jmh.annotations.Measurement;
+import org.openjdk.jmh.annotations.Mode;
+import org.openjdk.jmh.annotations.OutputTimeUnit;
+import org.openjdk.jmh.annotations.Param;
+import org.openjdk.jmh.annotations.Scope;
+import org.openjdk.jmh.annotations.Setup;
+import org.openjdk.jmh.annotations.State;
+import org.openjdk.jmh.annotations.Threads;
+import org.openjdk.jmh.annotations.Warmup;
+import org.openjdk.jmh.infra.Blackhole;
+
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.NANOSECONDS)
+@Warmup(iterations = 5, time = 1)
+@Measurement(iterations = 5, time = 1)
+@Fork(3)
+@State(Scope.Thread)
+public class InjectionBenchmark {
+  static final class Point {
+    final long x, y;
+
+    Point(long x, long y) {
+      this.x = x;
+      this.y = y;
+    }
+  }
+
+  // Profiling samples, and so hands over objects, only once started.
+  @Param({"false", "true"})
+  public boolean profiling;
+
+  @Param({"16"})
+  public int length;
+
+  private long i;
+
+  @Setup
+  public void setUp() throws Exception {
+    if (!profiling)
+      return;
+
+    // Without the agent, there's no helper to start.
+    try {
+      Class.forName("Heapster").getMethod("start").invoke(null);
+    } catch (ClassNotFoundException e) {
+    }
+  }
+
+  @Benchmark
+  public long pointNotEscaping() {
+    Point p = new Point(i, i + 1);
+    i++;
+    return p.x + p.y;
+  }
+
+  @Benchmark
+  public void pointEscaping(Blackhole bh) {
+    bh.consume(new Point(i, i + 1));
+    i++;
+  }
+
+  @Benchmark
+  public void arrayEscaping(Blackhole bh) {
+    bh.consume(new long[length]);
+  }
+
+  @Benchmark
+  @Threads(4)
+  public void pointEscapingContended(Blackhole bh) {
+    bh.consume(new Point(i, i + 1));
+    i++;
+  }
+}
@@ -0,0 +1,282 @@
+// Tests EventLogReader against logs encoded as the agent's LogEvent
+// and FlushEvents encode them.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "heapster_events.h"
+
+using namespace std;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+static void AppendVarint(string* s, uint64_t v) {
+  char buf[10];
+  s->append(buf, PutVarint(buf, v));
+}
+
+// Encodes a log: a header, then chunks of records.
+class LogBuilder {
+ public:
+  LogBuilder() {
+    char header[8];
+    PutLittleEndian32(header, kEventLogMagic);
+    PutLittleEndian32(header + 4, kEventLogVersion);
+    log_.assign(header, sizeof(header));
+  }
+
+  // Records are gathered into a chunk until EndChunk.
+  void Record(uint64_t delta, uint64_t kind, const vector<uint64_t>& fields,
+              const string& name = "", bool named = false) {
+    string body;
+    AppendVarint(&body, delta);
+    AppendVarint(&body, kind);
+    for (size_t i = 0; i < fields.size(); ++i)
+      AppendVarint(&body, fields[i]);
+    if (named) {
+      AppendVarint(&body, name.size());
+      body += name;
+    }
+
+    AppendVarint(&chunk_, body.size());
+    chunk_ += body;
+  }
+
+  void EndChunk(uint64_t thread, uint64_t time) {
+    AppendVarint(&log_, thread);
+    AppendVarint(&log_, time);
+    AppendVarint(&log_, chunk_.size());
+    log_ += chunk_;
+    chunk_.clear();
+  }
+
+  string& log() { return log_; }
+
+ private:
+  string log_;
+  string chunk_;
+};
+
+static vector<uint64_t> Fields(uint64_t a) {
+  return vector<uint64_t>(1, a);
+}
+
+static vector<uint64_t> Fields(uint64_t a, uint64_t b) {
+  vector<uint64_t> fields;
+  fields.push_back(a);
+  fields.push_back(b);
+  return fields;
+}
+
+static vector<uint64_t> Fields(uint64_t a, uint64_t b, uint64_t c) {
+  vector<uint64_t> fields = Fields(a, b);
+  fields.push_back(c);
+  return fields;
+}
+
+static string Write(const string& log) {
+  char path[] = "/tmp/heapster_events_test.XXXXXX";
+  const int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  CHECK(write(fd, log.data(), log.size()) == static_cast<ssize_t>(log.size()));
+  close(fd);
+  return path;
+}
+
+// Reads every event in the log.
+static vector<Event> ReadAll(const string& log, EventLogReader* reader) {
+  const string path = Write(log);
+  CHECK(reader->Open(path.c_str()));
+  unlink(path.c_str());
+
+  vector<Event> events;
+  Event event;
+  while (reader->Next(&event))
+    events.push_back(event);
+  return events;
+}
+
+static void TestHeaderIsLittleEndian() {
+  LogBuilder builder;
+  CHECK(builder.log().compare(0, 4, "HPEV") == 0);
+  CHECK(builder.log()[4] == kEventLogVersion);
+}
+
+static void TestReadsEventsAndDefinitions() {
+  LogBuilder builder;
+  builder.Record(0, kEventThread, vector<uint64_t>(), "main", true);
+  builder.Record(5, kEventMethod, Fields(0x10), "Lfoo/Bar;baz", true);
+  vector<uint64_t> site = Fields(7, 2, 0x10);
+  site.push_back(0x20);
+  builder.Record(0, kEventSite, site);
+  builder.Record(0, kEventType, Fields(3), "Lfoo/Bar;", true);
+  builder.Record(10, kEventAlloc, Fields(7, 24, 3));
+  builder.Record(200, kEventAlloc, Fields(7, 48, 3));
+  builder.EndChunk(1, 100);
+
+  // Another thread's chunk starts from its own time.
+  builder.Record(1, kEventFree, Fields(7, 24));
+  builder.EndChunk(2, 1000);
+
+  EventLogReader reader;
+  vector<Event> events = ReadAll(builder.log(), &reader);
+  CHECK(reader.error() == NULL);
+  CHECK(events.size() == 3);
+
+  CHECK(events[0].kind == kEventAlloc);
+  CHECK(events[0].time_micros == 115);
+  CHECK(events[0].thread == 1);
+  CHECK(events[0].site == 7);
+  CHECK(events[0].size == 24);
+  CHECK(events[0].type == 3);
+
+  CHECK(events[1].time_micros == 315);
+  CHECK(events[1].size == 48);
+
+  CHECK(events[2].kind == kEventFree);
+  CHECK(events[2].time_micros == 1001);
+  CHECK(events[2].thread == 2);
+  CHECK(events[2].site == 7);
+  CHECK(events[2].size == 24);
+  CHECK(events[2].type == 0);
+
+  CHECK(reader.threads().find(1)->second == "main");
+  CHECK(reader.methods().find(0x10)->second == "Lfoo/Bar;baz");
+  CHECK(reader.types().find(3)->second == "Lfoo/Bar;");
+  const vector<uint64_t>& frames = reader.sites().find(7)->second;
+  CHECK(frames.size() == 2);
+  CHECK(frames[0] == 0x10);
+  CHECK(frames[1] == 0x20);  // Frames needn't be named.
+  CHECK(reader.dropped() == 0);
+}
+
+static void TestCountsDrops() {
+  LogBuilder builder;
+  builder.Record(0, kEventAlloc, Fields(1, 8, 0));
+  builder.EndChunk(1, 0);
+  builder.Record(0, kEventDropped, Fields(5));
+  builder.EndChunk(kEventNoThread, 50);
+  builder.Record(0, kEventDropped, Fields(2));
+  builder.EndChunk(kEventNoThread, 60);
+
+  EventLogReader reader;
+  vector<Event> events = ReadAll(builder.log(), &reader);
+  CHECK(reader.error() == NULL);
+  CHECK(events.size() == 1);
+  CHECK(reader.dropped() == 7);
+}
+
+// Unknown kinds, and fields past those we know, are skipped.
+static void TestSkipsWhatItDoesNotKnow() {
+  LogBuilder builder;
+  builder.Record(0, 99, Fields(1, 2, 3));
+  vector<uint64_t> fields = Fields(1, 8, 0);
+  fields.push_back(12345);
+  builder.Record(1, kEventAlloc, fields);
+  builder.Record(1, kEventFree, Fields(1, 8, 6789));
+  builder.EndChunk(1, 0);
+
+  EventLogReader reader;
+  vector<Event> events = ReadAll(builder.log(), &reader);
+  CHECK(reader.error() == NULL);
+  CHECK(events.size() == 2);
+  CHECK(events[0].kind == kEventAlloc);
+  CHECK(events[0].time_micros == 1);
+  CHECK(events[1].kind == kEventFree);
+  CHECK(events[1].time_micros == 2);
+}
+
+// A log cut short ends at its last whole chunk, without error.
+static void TestStopsAtCutChunk() {
+  LogBuilder builder;
+  builder.Record(0, kEventAlloc, Fields(1, 8, 0));
+  builder.EndChunk(1, 0);
+  builder.Record(0, kEventAlloc, Fields(2, 8, 0));
+  builder.EndChunk(1, 0);
+  builder.log().resize(builder.log().size() - 2);
+
+  EventLogReader reader;
+  vector<Event> events = ReadAll(builder.log(), &reader);
+  CHECK(reader.error() == NULL);
+  CHECK(events.size() == 1);
+  CHECK(events[0].site == 1);
+}
+
+// Records that run past their chunk are errors.
+static void TestRejectsCorruptRecords() {
+  LogBuilder builder;
+  builder.Record(0, kEventAlloc, Fields(1, 8, 0));
+  builder.EndChunk(1, 0);
+
+  // Claim the record is longer than its chunk.
+  string log = builder.log();
+  const size_t record = 8 + 3;
+  log[record] = 100;
+
+  EventLogReader reader;
+  vector<Event> events = ReadAll(log, &reader);
+  CHECK(events.empty());
+  CHECK(reader.error() != NULL);
+
+  LogBuilder names;
+  names.Record(0, kEventType, Fields(1, 1000));
+  names.EndChunk(1, 0);
+  EventLogReader names_reader;
+  ReadAll(names.log(), &names_reader);
+  CHECK(names_reader.error() != NULL);
+
+  LogBuilder alloc;
+  alloc.Record(0, kEventAlloc, Fields(1, 8));
+  alloc.EndChunk(1, 0);
+  EventLogReader alloc_reader;
+  CHECK(ReadAll(alloc.log(), &alloc_reader).empty());
+  CHECK(alloc_reader.error() != NULL);
+}
+
+static void TestRejectsOtherFiles() {
+  EventLogReader reader;
+  CHECK(!reader.Open("/nonexistent/heapster"));
+
+  string path = Write("HPE");
+  errno = 0;
+  CHECK(!reader.Open(path.c_str()));
+  CHECK(errno == EINVAL);
+  unlink(path.c_str());
+
+  LogBuilder builder;
+  builder.log()[4] = kEventLogVersion + 1;
+  path = Write(builder.log());
+  EventLogReader other;
+  errno = 0;
+  CHECK(!other.Open(path.c_str()));
+  CHECK(errno == EINVAL);
+  unlink(path.c_str());
+}
+
+int
+main()
+{
+  TestHeaderIsLittleEndian();
+  TestReadsEventsAndDefinitions();
+  TestCountsDrops();
+  TestSkipsWhatItDoesNotKnow();
+  TestStopsAtCutChunk();
+  TestRejectsCorruptRecords();
+  TestRejectsOtherFiles();
+
+  printf("PASS\n");
+  return 0;
+}
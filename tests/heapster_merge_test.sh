@@ -0,0 +1,106 @@
+#!/bin/sh
+# Tests heapster-merge on chains of delta profiles, laid out as
+# Heapster.dumpProfileDelta dumps them.
+#
+#   tests/heapster_merge_test.sh ./heapster-merge
+
+MERGE=${1:-./heapster-merge}
+DIR=$(mktemp -d /tmp/heapster_merge_test.XXXXXX) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+cat > "$DIR/delta0" <<'END'
+--- symbol
+binary=heapster
+0x0000000000000010 Lfoo/Bar;baz
+0x000000000000000f Lfoo/Bar;baz
+0x0000000000000020 Lfoo/Bar;qux
+0x000000000000001f Lfoo/Bar;qux
+---
+--- heap delta
+dump: 1
+since: 0
+     2:       64 [     4:      128] @ 0x0000000000000010
+     1:       24 [     1:       24] @ 0x0000000000000020 0x0000000000000010
+END
+
+# Replaces the first site's counts, empties the second, and adds a
+# third, with a method named since.
+cat > "$DIR/delta1" <<'END'
+--- symbol
+binary=heapster
+0x0000000000000030 Lfoo/Quux;run
+0x000000000000002f Lfoo/Quux;run
+---
+--- heap delta
+dump: 2
+since: 1
+     3:       96 [     6:      192] @ 0x0000000000000010
+     0:        0 [     0:        0] @ 0x0000000000000020 0x0000000000000010
+     1:        8 [     1:        8] @ 0x0000000000000030
+END
+
+cat > "$DIR/expected" <<'END'
+--- symbol
+binary=heapster
+0x000000000000000f Lfoo/Bar;baz
+0x0000000000000010 Lfoo/Bar;baz
+0x000000000000001f Lfoo/Bar;qux
+0x0000000000000020 Lfoo/Bar;qux
+0x000000000000002f Lfoo/Quux;run
+0x0000000000000030 Lfoo/Quux;run
+---
+--- heap
+heap profile:      4:      104 [     7:      200] @ heapprofile
+     3:       96 [     6:      192] @ 0x0000000000000010
+     1:        8 [     1:        8] @ 0x0000000000000030
+END
+
+"$MERGE" "$DIR/delta0" "$DIR/delta1" > "$DIR/out" 2> "$DIR/err" ||
+  fail "merging a chain failed: $(cat "$DIR/err")"
+diff -u "$DIR/expected" "$DIR/out" || fail "merging a chain"
+[ -s "$DIR/err" ] && fail "merging a chain warned: $(cat "$DIR/err")"
+
+# A lone complete delta is a full profile.
+"$MERGE" "$DIR/delta0" > "$DIR/out" 2>&1 || fail "merging one delta"
+grep -q '^heap profile:      3:       88 \[     5:      152\] @ heapprofile$' \
+  "$DIR/out" || fail "merging one delta: $(cat "$DIR/out")"
+
+# The chain must start from a complete delta.
+if "$MERGE" "$DIR/delta1" > /dev/null 2> "$DIR/err"; then
+  fail "accepted a chain starting since 1"
+fi
+grep -q 'must be since 0' "$DIR/err" || fail "no error for an incomplete start"
+
+# Gaps in the chain are merged, with a warning.
+sed 's/^since: 1$/since: 5/' "$DIR/delta1" > "$DIR/gap"
+"$MERGE" "$DIR/delta0" "$DIR/gap" > "$DIR/out" 2> "$DIR/err" ||
+  fail "merging across a gap"
+grep -q 'missing dumps 2 to 5' "$DIR/err" || fail "no warning for a gap"
+diff -u "$DIR/expected" "$DIR/out" || fail "merging across a gap"
+
+# Malformed records are skipped, with a warning.
+sed 's/^     1:        8 \[/     1:        8 /' "$DIR/delta1" > "$DIR/malformed"
+"$MERGE" "$DIR/delta0" "$DIR/malformed" > "$DIR/out" 2> "$DIR/err" ||
+  fail "merging a malformed record"
+grep -q 'skipping malformed record' "$DIR/err" ||
+  fail "no warning for a malformed record"
+grep -q '0x0000000000000030$' "$DIR/out" && fail "kept a malformed record"
+
+# Full profiles aren't deltas.
+sed -e 's/^--- heap delta$/--- heap/' "$DIR/delta0" > "$DIR/full"
+if "$MERGE" "$DIR/full" > /dev/null 2> "$DIR/err"; then
+  fail "accepted a full profile"
+fi
+grep -q 'not a heapster delta profile' "$DIR/err" ||
+  fail "no error for a full profile"
+
+if "$MERGE" "$DIR/nonexistent" > /dev/null 2>&1; then
+  fail "accepted a missing file"
+fi
+
+echo PASS
@@ -0,0 +1,258 @@
+// Benchmarks the size of a profile in the text format, as is and
+// gzipped, against the gzipped profile.proto, encoded as the agent
+// encodes it, for synthetic sites.
+//
+//   $ make bench
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+using namespace std;
+
+#ifdef __x86_64
+#define FRAME_FORMAT "0x%016lx"
+#else
+#define FRAME_FORMAT "0x%08lx"
+#endif
+
+static const int kDepth = 16;
+static const uint32_t kMethods = 10000;
+
+static double NowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Counts what's written to it.
+class CountingSink : public Sink {
+ public:
+  CountingSink() : bytes_(0) {}
+
+  virtual bool Write(const char*, size_t n) {
+    bytes_ += n;
+    return true;
+  }
+
+  size_t bytes() const { return bytes_; }
+
+ private:
+  size_t bytes_;
+};
+
+struct Site {
+  long long inuse_objects, inuse_bytes, alloc_objects, alloc_bytes;
+  uint32_t  stack[kDepth];  // Method numbers.
+};
+
+struct Method {
+  string name;
+  string file;
+  int    line;
+};
+
+struct Profile {
+  explicit Profile(uint32_t nsites) : sites(nsites), methods(kMethods) {
+    uint64_t state = 88172645463325252ULL;
+    for (uint32_t i = 0; i < nsites; ++i) {
+      Site* s = &sites[i];
+      s->inuse_objects = i % 100;
+      s->inuse_bytes = s->inuse_objects * 24;
+      s->alloc_objects = i % 1000 + 1;
+      s->alloc_bytes = s->alloc_objects * 24;
+      for (int j = 0; j < kDepth; ++j) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        s->stack[j] = state % kMethods;
+      }
+    }
+    for (uint32_t i = 0; i < kMethods; ++i) {
+      methods[i].name = StringPrintf("Lcom/example/Class%u;method%u", i / 10, i);
+      methods[i].file = StringPrintf("com/example/Class%u.java", i / 10);
+      methods[i].line = 10 + i % 10 * 20;
+    }
+  }
+
+  uintptr_t Address(uint32_t i) const { return 0x7f0000000000ULL + i * 8; }
+
+  vector<Site>   sites;
+  vector<Method> methods;
+};
+
+static void WriteText(const Profile& profile, Sink* sink) {
+  ProfileWriter out(sink);
+
+  // Only the methods in the stacks are named, as the agent does.
+  vector<bool> seen(kMethods);
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    for (int i = 0; i < kDepth; ++i)
+      seen[profile.sites[n].stack[i]] = true;
+  }
+
+  out.Append("--- symbol\nbinary=heapster\n");
+  for (uint32_t i = 0; i < kMethods; ++i) {
+    if (seen[i]) {
+      out.Printf(FRAME_FORMAT " %s\n", profile.Address(i),
+                 profile.methods[i].name.c_str());
+    }
+  }
+  out.Append("---\n");
+  out.Append("--- heap\n");
+  out.Printf("heap profile: %6lld: %8lld [%6lld: %8lld] @ heapprofile\n",
+             0LL, 0LL, 0LL, 0LL);
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    const Site& s = profile.sites[n];
+    out.Printf("%6lld: %8lld [%6lld: %8lld] @",
+               s.inuse_objects, s.inuse_bytes,
+               s.alloc_objects, s.alloc_bytes);
+    for (int i = 0; i < kDepth; ++i)
+      out.Printf(" " FRAME_FORMAT, profile.Address(s.stack[i]));
+    out.Append("\n");
+  }
+  out.Flush();
+}
+
+static int64_t Intern(map<string, int64_t>* ids, vector<const string*>* strings,
+                      const string& s) {
+  map<string, int64_t>::iterator it = ids->find(s);
+  if (it == ids->end()) {
+    it = ids->insert(make_pair(s, static_cast<int64_t>(strings->size()))).first;
+    strings->push_back(&it->first);
+  }
+  return it->second;
+}
+
+// As Heapster::WriteProto, less the comments and the period.
+static void WriteProto(const Profile& profile, Sink* sink) {
+  ProfileWriter out(sink);
+  map<string, int64_t> string_ids;
+  vector<const string*> strings;
+  Intern(&string_ids, &strings, "");
+
+  ProtoBuffer message, field, values;
+
+  static const char* const kSampleTypes[][2] = {
+    {"inuse_objects", "count"},
+    {"inuse_space", "bytes"},
+    {"alloc_objects", "count"},
+    {"alloc_space", "bytes"}
+  };
+  for (size_t i = 0; i < 4; ++i) {
+    field.clear();
+    field.Int(1, Intern(&string_ids, &strings, kSampleTypes[i][0]));
+    field.Int(2, Intern(&string_ids, &strings, kSampleTypes[i][1]));
+    message.clear();
+    message.Bytes(1, field);
+    out.Append(message.data());
+  }
+
+  map<uint32_t, uint64_t> location_ids;
+  vector<uint32_t> locations;
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    const Site& s = profile.sites[n];
+    values.clear();
+    for (int i = 0; i < kDepth; ++i) {
+      map<uint32_t, uint64_t>::iterator it = location_ids.find(s.stack[i]);
+      if (it == location_ids.end()) {
+        locations.push_back(s.stack[i]);
+        it = location_ids.insert(
+            make_pair(s.stack[i], locations.size())).first;
+      }
+      values.Varint(it->second);
+    }
+    field.clear();
+    field.Bytes(1, values);
+
+    values.clear();
+    values.Varint(s.inuse_objects);
+    values.Varint(s.inuse_bytes);
+    values.Varint(s.alloc_objects);
+    values.Varint(s.alloc_bytes);
+    field.Bytes(2, values);
+
+    message.clear();
+    message.Bytes(2, field);
+    out.Append(message.data());
+  }
+
+  for (size_t i = 0; i < locations.size(); ++i) {
+    const uint64_t id = i + 1;
+    const Method& method = profile.methods[locations[i]];
+
+    values.clear();
+    values.Int(1, id);
+    values.Int(2, method.line);
+    field.clear();
+    field.Int(1, id);
+    field.Bytes(4, values);
+    message.clear();
+    message.Bytes(4, field);
+    out.Append(message.data());
+
+    const int64_t name = Intern(&string_ids, &strings, method.name);
+    field.clear();
+    field.Int(1, id);
+    field.Int(2, name);
+    field.Int(3, name);
+    field.Int(4, Intern(&string_ids, &strings, method.file));
+    field.Int(5, method.line);
+    message.clear();
+    message.Bytes(5, field);
+    out.Append(message.data());
+  }
+
+  for (size_t i = 0; i < strings.size(); ++i) {
+    message.clear();
+    message.Bytes(6, *strings[i]);
+    out.Append(message.data());
+  }
+  out.Flush();
+}
+
+// Returns the size written, and the time taken.
+static size_t Measure(void (*write)(const Profile&, Sink*),
+                      const Profile& profile, bool gzip, double* seconds) {
+  CountingSink counted;
+  const double start = NowSeconds();
+  if (gzip) {
+    GzipSink gzipped(&counted);
+    write(profile, &gzipped);
+    gzipped.Finish();
+  } else {
+    write(profile, &counted);
+  }
+  *seconds = NowSeconds() - start;
+  return counted.bytes();
+}
+
+static void BenchSizes(uint32_t nsites) {
+  const Profile profile(nsites);
+  double text_time, text_gz_time, proto_time;
+  const size_t text = Measure(WriteText, profile, false, &text_time);
+  const size_t text_gz = Measure(WriteText, profile, true, &text_gz_time);
+  const size_t proto = Measure(WriteProto, profile, true, &proto_time);
+
+  printf("%8u sites  text %8.2f MB  text.gz %7.2f MB  proto.gz %7.2f MB"
+         "  (%4.1fx smaller)  %6.1f vs %6.1f ms\n",
+         nsites, text / 1e6, text_gz / 1e6, proto / 1e6,
+         static_cast<double>(text) / proto, text_time * 1e3, proto_time * 1e3);
+}
+
+int
+main()
+{
+  printf("# stacks of %d frames over %u methods; times are text vs proto.gz\n",
+         kDepth, kMethods);
+  BenchSizes(1000);
+  BenchSizes(10000);
+  BenchSizes(100000);
+  return 0;
+}
@@ -0,0 +1,152 @@
+// Benchmarks what a free costs the thread reporting it: pushing its
+// tag onto the thread's free ring, for a drainer thread to apply, or
+// applying it in place under a lock, as the agent did before.
+//
+//   $ make bench
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "heapster_rings.h"
+
+using namespace std;
+
+static const uint32_t kSites = 1000;
+static const uint32_t kFrees = 2000000;
+
+// The drainer's period. The agent's is 100ms; a burst of frees fills
+// the rings well within either.
+static const useconds_t kDrainMicros = 1000;
+
+static double NowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct Counts {
+  int64_t inuse_objects;
+  int64_t inuse_bytes;
+};
+
+struct Profile {
+  Profile() : counts(kSites), fallbacks(0), done(false) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+  ~Profile() { pthread_mutex_destroy(&mutex); }
+
+  // As the agent applies a free; the tag is the site and the size.
+  void Apply(int64_t tag) {
+    Counts* c = &counts[tag % kSites];
+    __sync_sub_and_fetch(&c->inuse_objects, 1);
+    __sync_sub_and_fetch(&c->inuse_bytes, tag / kSites);
+  }
+
+  vector<Counts>      counts;
+  pthread_mutex_t     mutex;
+  vector<FreeBuffer*> buffers;
+  volatile uint64_t   fallbacks;  // Frees applied in place.
+  volatile bool       done;
+};
+
+struct Producer {
+  Profile*    profile;
+  FreeBuffer* buffer;
+  uint32_t    n;
+};
+
+static void* FreeLocked(void* arg) {
+  Producer* p = static_cast<Producer*>(arg);
+  for (uint32_t i = 0; i < p->n; ++i) {
+    pthread_mutex_lock(&p->profile->mutex);
+    Counts* c = &p->profile->counts[i % kSites];
+    c->inuse_objects--;
+    c->inuse_bytes -= 24;
+    pthread_mutex_unlock(&p->profile->mutex);
+  }
+  return NULL;
+}
+
+// As the agent's ObjectFree: push, or apply in place if the ring is
+// full.
+static void* FreeBuffered(void* arg) {
+  Producer* p = static_cast<Producer*>(arg);
+  for (uint32_t i = 0; i < p->n; ++i) {
+    const int64_t tag = 24 * kSites + i % kSites;
+    if (!p->buffer->Push(tag)) {
+      p->profile->Apply(tag);
+      __sync_add_and_fetch(&p->profile->fallbacks, 1);
+    }
+  }
+  return NULL;
+}
+
+static void* Drain(void* arg) {
+  Profile* profile = static_cast<Profile*>(arg);
+  for (;;) {
+    const bool done = profile->done;
+    int64_t tag;
+    for (size_t i = 0; i < profile->buffers.size(); ++i) {
+      while (profile->buffers[i]->Pop(&tag))
+        profile->Apply(tag);
+    }
+    if (done)
+      return NULL;
+    usleep(kDrainMicros);
+  }
+}
+
+// Returns the wall time per free, until the producers are done; what
+// the drainer has left then isn't counted.
+static double Run(void* (*free)(void*), int nthreads, Profile* profile) {
+  vector<pthread_t> threads(nthreads);
+  vector<Producer> producers(nthreads);
+  for (int i = 0; i < nthreads; ++i)
+    profile->buffers.push_back(new FreeBuffer);
+
+  pthread_t drainer;
+  if (free == FreeBuffered)
+    pthread_create(&drainer, NULL, Drain, profile);
+
+  const double start = NowSeconds();
+  for (int i = 0; i < nthreads; ++i) {
+    Producer p = { profile, profile->buffers[i], kFrees / nthreads };
+    producers[i] = p;
+    pthread_create(&threads[i], NULL, free, &producers[i]);
+  }
+
+  for (int i = 0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+  const double seconds = NowSeconds() - start;
+
+  if (free == FreeBuffered) {
+    profile->done = true;
+    pthread_join(drainer, NULL);
+  }
+  for (int i = 0; i < nthreads; ++i)
+    delete profile->buffers[i];
+  return seconds / kFrees;
+}
+
+static void BenchFrees(int nthreads) {
+  Profile locked, buffered;
+  const double locked_time = Run(FreeLocked, nthreads, &locked);
+  const double buffered_time = Run(FreeBuffered, nthreads, &buffered);
+  printf("%8d threads  free %6.1f vs %6.1f ns  %5.1f%% applied in place\n",
+         nthreads, locked_time * 1e9, buffered_time * 1e9,
+         100.0 * buffered.fallbacks / kFrees);
+}
+
+int
+main()
+{
+  printf("# locked vs free rings, drained every %u us\n", kDrainMicros);
+  for (int n = 1; n <= 16; n *= 2)
+    BenchFrees(n);
+  return 0;
+}
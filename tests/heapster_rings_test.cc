@@ -0,0 +1,193 @@
+// Tests the free and event rings: filling, wrapping (of the ring and
+// of its counters), and a producer and consumer running at once.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "heapster_rings.h"
+
+using namespace std;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+static void TestFreeBufferFillsAndDrains() {
+  FreeBuffer* buffer = new FreeBuffer;
+  int64_t tag;
+  CHECK(!buffer->Pop(&tag));
+
+  for (uint32_t i = 0; i < FreeBuffer::kSize; ++i)
+    CHECK(buffer->Push(i + 1));
+  CHECK(!buffer->Push(-1));
+
+  for (uint32_t i = 0; i < FreeBuffer::kSize; ++i) {
+    CHECK(buffer->Pop(&tag));
+    CHECK(tag == i + 1);
+  }
+  CHECK(!buffer->Pop(&tag));
+  delete buffer;
+}
+
+// The counters wrap at 2^32 without losing track of how full it is.
+static void TestFreeBufferWraps() {
+  FreeBuffer* buffer = new FreeBuffer;
+  buffer->head = buffer->tail = 0xffffffffu - 10;
+  for (int64_t i = 0; i < FreeBuffer::kSize; ++i)
+    CHECK(buffer->Push(i));
+  CHECK(!buffer->Push(-1));
+  CHECK(buffer->tail < buffer->head);
+
+  int64_t tag;
+  for (int64_t i = 0; i < FreeBuffer::kSize; ++i) {
+    CHECK(buffer->Pop(&tag));
+    CHECK(tag == i);
+  }
+  CHECK(!buffer->Pop(&tag));
+  delete buffer;
+}
+
+static void TestEventBufferKeepsRecordsWhole() {
+  EventBuffer* buffer = new EventBuffer;
+  vector<char> out;
+  CHECK(buffer->Copy(&out) == 0);
+
+  // Records straddle the end of the ring as the tail goes round.
+  const string a(1000, 'a'), b(23, 'b');
+  string pushed;
+  for (int round = 0; round < 100; ++round) {
+    while (buffer->Push(a.data(), a.size(), b.data(), b.size()))
+      pushed += a + b;
+    CHECK(EventBuffer::kSize - (buffer->tail - buffer->head) <
+          a.size() + b.size());
+
+    const uint32_t n = buffer->Copy(&out);
+    CHECK(n == pushed.size());
+    CHECK(string(out.begin(), out.end()) == pushed);
+
+    // Giving back part of it makes room for as much.
+    buffer->Consume(a.size() + b.size());
+    pushed.erase(0, a.size() + b.size());
+    CHECK(buffer->Push(b.data(), b.size(), a.data(), a.size()));
+    pushed += b + a;
+
+    buffer->Consume(buffer->Copy(&out));
+    pushed.clear();
+  }
+
+  // A record as big as the ring fits only when it's empty.
+  const string whole(EventBuffer::kSize - 1, 'w');
+  CHECK(buffer->Push(whole.data(), whole.size(), "x", 1));
+  CHECK(!buffer->Push("y", 1, NULL, 0));
+  CHECK(buffer->Copy(&out) == EventBuffer::kSize);
+  CHECK(out[0] == 'w' && out[EventBuffer::kSize - 1] == 'x');
+  delete buffer;
+}
+
+static const uint64_t kItems = 2000000;
+
+static void* ProduceFrees(void* arg) {
+  FreeBuffer* buffer = static_cast<FreeBuffer*>(arg);
+  for (uint64_t i = 0; i < kItems;) {
+    if (buffer->Push(i))
+      ++i;
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void TestFreeBufferUnderConcurrency() {
+  FreeBuffer* buffer = new FreeBuffer;
+  pthread_t producer;
+  CHECK(pthread_create(&producer, NULL, ProduceFrees, buffer) == 0);
+
+  int64_t tag;
+  for (uint64_t i = 0; i < kItems;) {
+    if (buffer->Pop(&tag)) {
+      CHECK(tag == static_cast<int64_t>(i));
+      ++i;
+    } else {
+      sched_yield();
+    }
+  }
+  CHECK(pthread_join(producer, NULL) == 0);
+  CHECK(!buffer->Pop(&tag));
+  delete buffer;
+}
+
+// Records of 1 to 64 bytes, each its length then the low bytes of
+// its number.
+static void* ProduceEvents(void* arg) {
+  EventBuffer* buffer = static_cast<EventBuffer*>(arg);
+  char record[64];
+  for (uint64_t i = 0; i < kItems / 4;) {
+    const uint32_t n = i % 64 + 1;
+    record[0] = n;
+    for (uint32_t j = 1; j < n; ++j)
+      record[j] = static_cast<char>(i + j);
+    if (buffer->Push(record, n / 2, record + n / 2, n - n / 2))
+      ++i;
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void TestEventBufferUnderConcurrency() {
+  EventBuffer* buffer = new EventBuffer;
+  pthread_t producer;
+  CHECK(pthread_create(&producer, NULL, ProduceEvents, buffer) == 0);
+
+  vector<char> out;
+  string pending;
+  uint64_t i = 0;
+  while (i < kItems / 4) {
+    const uint32_t n = buffer->Copy(&out);
+    if (n == 0)
+      sched_yield();
+    pending.append(out.begin(), out.end());
+    buffer->Consume(n);
+
+    size_t p = 0;
+    while (p < pending.size() &&
+           p + static_cast<uint8_t>(pending[p]) <= pending.size()) {
+      const uint32_t length = pending[p];
+      CHECK(length == i % 64 + 1);
+      for (uint32_t j = 1; j < length; ++j)
+        CHECK(pending[p + j] == static_cast<char>(i + j));
+      p += length;
+      ++i;
+    }
+    pending.erase(0, p);
+  }
+  CHECK(pthread_join(producer, NULL) == 0);
+  CHECK(pending.empty());
+  CHECK(buffer->Copy(&out) == 0);
+  delete buffer;
+}
+
+int
+main()
+{
+  TestFreeBufferFillsAndDrains();
+  TestFreeBufferWraps();
+  TestEventBufferKeepsRecordsWhole();
+  TestFreeBufferUnderConcurrency();
+  TestEventBufferUnderConcurrency();
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,213 @@
+// Tests ShmReader against profiles laid out as the agent's Export
+// writes them.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "heapster_shm.h"
+
+using namespace std;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+// Lays out a profile: a header, then sites and symbols.
+class ShmBuilder {
+ public:
+  ShmBuilder() : data_(sizeof(ShmHeader)) {
+    ShmHeader* h = header();
+    h->magic = kShmMagic;
+    h->version = kShmVersion;
+    h->pid = 1234;
+    h->time_millis = 5678;
+    h->sample_period = 512 << 10;
+  }
+
+  void AddSite(int64_t inuse_objects, int64_t inuse_bytes,
+               const vector<uint64_t>& frames) {
+    const size_t at = data_.size();
+    data_.resize(at + ShmSite::Size(frames.size()));
+    ShmSite* s = reinterpret_cast<ShmSite*>(&data_[at]);
+    s->inuse_objects = inuse_objects;
+    s->inuse_bytes = inuse_bytes;
+    s->alloc_objects = 2 * inuse_objects;
+    s->alloc_bytes = 2 * inuse_bytes;
+    s->nframes = frames.size();
+    for (size_t i = 0; i < frames.size(); ++i)
+      s->frames[i] = frames[i];
+    header()->nsites++;
+    Finish();
+  }
+
+  void AddSymbol(uint64_t method, const string& name) {
+    const size_t at = data_.size();
+    data_.resize(at + ShmSymbol::Size(name.size()));
+    ShmSymbol* s = reinterpret_cast<ShmSymbol*>(&data_[at]);
+    s->method = method;
+    s->name_length = name.size();
+    memcpy(s + 1, name.data(), name.size());
+    header()->nsymbols++;
+    Finish();
+  }
+
+  ShmHeader* header() { return reinterpret_cast<ShmHeader*>(&data_[0]); }
+  vector<char>& data() { return data_; }
+
+  // Writes the profile to a new file; returns its path.
+  string Write() const {
+    char path[] = "/tmp/heapster_shm_test.XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, &data_[0], data_.size()) ==
+          static_cast<ssize_t>(data_.size()));
+    close(fd);
+    return path;
+  }
+
+ private:
+  void Finish() { header()->data_bytes = data_.size() - sizeof(ShmHeader); }
+
+  vector<char> data_;
+};
+
+static bool Read(const ShmBuilder& builder, ShmProfile* profile) {
+  const string path = builder.Write();
+  ShmReader reader;
+  CHECK(reader.Open(path.c_str()));
+  unlink(path.c_str());
+  return reader.Read(profile);
+}
+
+static vector<uint64_t> Frames(uint64_t a, uint64_t b) {
+  vector<uint64_t> frames;
+  frames.push_back(a);
+  frames.push_back(b);
+  return frames;
+}
+
+static void TestReadsSitesAndSymbols() {
+  ShmBuilder builder;
+  builder.AddSite(3, 96, Frames(0x10, 0x20));
+  builder.AddSite(1, 24, Frames(0x10, 0x30));
+  builder.AddSymbol(0x10, "Lfoo/Bar;baz");
+  builder.AddSymbol(0x20, "Ljava/lang/Object;<init>");
+
+  ShmProfile profile;
+  CHECK(Read(builder, &profile));
+  CHECK(profile.pid == 1234);
+  CHECK(profile.time_millis == 5678);
+  CHECK(profile.sample_period == 512 << 10);
+  CHECK(!profile.truncated);
+
+  CHECK(profile.sites.size() == 2);
+  CHECK(profile.sites[0].inuse_objects == 3);
+  CHECK(profile.sites[0].inuse_bytes == 96);
+  CHECK(profile.sites[0].alloc_objects == 6);
+  CHECK(profile.sites[0].alloc_bytes == 192);
+  CHECK(profile.sites[0].frames == Frames(0x10, 0x20));
+  CHECK(profile.sites[1].frames == Frames(0x10, 0x30));
+
+  CHECK(profile.symbols.size() == 2);
+  CHECK(profile.symbols[0x10] == "Lfoo/Bar;baz");
+  CHECK(profile.symbols[0x20] == "Ljava/lang/Object;<init>");
+}
+
+static void TestReadsEmptyProfile() {
+  ShmBuilder builder;
+  builder.header()->truncated = 1;
+
+  ShmProfile profile;
+  CHECK(Read(builder, &profile));
+  CHECK(profile.sites.empty());
+  CHECK(profile.symbols.empty());
+  CHECK(profile.truncated);
+}
+
+static void TestRejectsOtherFiles() {
+  ShmBuilder builder;
+  builder.header()->magic = 0;
+
+  ShmProfile profile;
+  CHECK(!Read(builder, &profile));
+
+  builder.header()->magic = kShmMagic;
+  builder.header()->version = kShmVersion + 1;
+  CHECK(!Read(builder, &profile));
+}
+
+static void TestRejectsShortFiles() {
+  ShmBuilder builder;
+  builder.data().resize(sizeof(ShmHeader) - 1);
+  const string path = builder.Write();
+
+  ShmReader reader;
+  errno = 0;
+  CHECK(!reader.Open(path.c_str()));
+  CHECK(errno == EINVAL);
+  unlink(path.c_str());
+
+  CHECK(!reader.Open("/nonexistent/heapster"));
+}
+
+// A profile being written (seq odd) is never read.
+static void TestGivesUpWhileWritten() {
+  ShmBuilder builder;
+  builder.AddSite(1, 8, Frames(0x10, 0x20));
+  builder.header()->seq = 3;
+
+  ShmProfile profile;
+  CHECK(!Read(builder, &profile));
+}
+
+// Records that run past the data are rejected, not read.
+static void TestRejectsCorruptRecords() {
+  ShmBuilder builder;
+  builder.AddSite(1, 8, Frames(0x10, 0x20));
+  reinterpret_cast<ShmSite*>(&builder.data()[sizeof(ShmHeader)])->nframes = 1000;
+
+  ShmProfile profile;
+  CHECK(!Read(builder, &profile));
+
+  ShmBuilder symbols;
+  symbols.AddSymbol(0x10, "Lfoo/Bar;baz");
+  reinterpret_cast<ShmSymbol*>(&symbols.data()[sizeof(ShmHeader)])->name_length = 1000;
+  CHECK(!Read(symbols, &profile));
+
+  // More sites than there are records.
+  ShmBuilder sites;
+  sites.AddSite(1, 8, Frames(0x10, 0x20));
+  sites.header()->nsites = 2;
+  CHECK(!Read(sites, &profile));
+
+  // data_bytes past the end of the file.
+  ShmBuilder length;
+  length.AddSite(1, 8, Frames(0x10, 0x20));
+  length.header()->data_bytes += 64;
+  CHECK(!Read(length, &profile));
+}
+
+int
+main()
+{
+  TestReadsSitesAndSymbols();
+  TestReadsEmptyProfile();
+  TestRejectsOtherFiles();
+  TestRejectsShortFiles();
+  TestGivesUpWhileWritten();
+  TestRejectsCorruptRecords();
+
+  printf("PASS\n");
+  return 0;
+}
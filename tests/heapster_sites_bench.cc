@@ -0,0 +1,287 @@
+// Benchmarks the site table against the chained table it replaced:
+// a fixed 179,999 buckets, with a node and a stack allocated apart
+// for each site.
+//
+//   $ make bench
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "heapster_sites.h"
+
+using namespace std;
+
+typedef SiteTable<uint64_t> Table;
+
+static const int kDepth = 16;
+static const uint32_t kMethods = 10000;
+
+// About what malloc adds to each allocation.
+static const size_t kMallocOverhead = 16;
+
+static double NowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t Next(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// As the agent hashes stacks.
+static long StackHash(const uint64_t* frames, int nframes) {
+  long h = 0;
+  for (int i = 0; i < nframes; i++) {
+    h += frames[i];
+    h += h << 10;
+    h ^= h >> 6;
+  }
+  h += h << 3;
+  h ^= h >> 11;
+  return h;
+}
+
+// Stacks of kDepth frames, drawn from kMethods methods, as aligned
+// as method ids are.
+struct Stacks {
+  explicit Stacks(uint32_t n) : frames(n * kDepth), hashes(n) {
+    uint64_t state = 88172645463325252ULL;
+    for (uint32_t i = 0; i < n; ++i) {
+      for (int j = 0; j < kDepth; ++j)
+        frames[i * kDepth + j] = 0x7f0000000000ULL + (Next(&state) % kMethods) * 8;
+      hashes[i] = StackHash(&frames[i * kDepth], kDepth);
+    }
+  }
+
+  const uint64_t* At(uint32_t i) const { return &frames[i * kDepth]; }
+
+  vector<uint64_t> frames;
+  vector<long>     hashes;
+};
+
+class ChainedTable {
+ public:
+  static const uint32_t kBuckets = 179999;
+
+  struct Site {
+    Site*     next;
+    long      hash;
+    int       nframes;
+    uint64_t* stack;
+    int64_t   alloc_objects;
+  };
+
+  ChainedTable() : buckets_(new Site*[kBuckets]()), size_(0) {}
+
+  ~ChainedTable() {
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      for (Site* s = buckets_[i]; s != NULL;) {
+        Site* next = s->next;
+        delete[] s->stack;
+        delete s;
+        s = next;
+      }
+    }
+    delete[] buckets_;
+  }
+
+  Site* FindOrInsert(long h, const uint64_t* frames, int nframes) {
+    const uint32_t bucket = static_cast<unsigned long>(h) % kBuckets;
+    for (Site* s = buckets_[bucket]; s != NULL; s = s->next) {
+      if (s->hash == h && s->nframes == nframes &&
+          memcmp(s->stack, frames, nframes * sizeof(*frames)) == 0)
+        return s;
+    }
+
+    Site* s = new Site;
+    s->next = buckets_[bucket];
+    s->hash = h;
+    s->nframes = nframes;
+    s->stack = new uint64_t[nframes];
+    memcpy(s->stack, frames, nframes * sizeof(*frames));
+    s->alloc_objects = 0;
+    buckets_[bucket] = s;
+    ++size_;
+    return s;
+  }
+
+  size_t Bytes() const {
+    return kBuckets * sizeof(Site*) +
+        size_ * (sizeof(Site) + kDepth * sizeof(uint64_t) +
+                 2 * kMallocOverhead);
+  }
+
+ private:
+  Site**   buckets_;
+  uint32_t size_;
+};
+
+static size_t TableBytes(const Table& table) {
+  return table.slots()->capacity * sizeof(Table::Slot) +
+      table.size() * (Table::Site::Size(kDepth) + kMallocOverhead);
+}
+
+// Inserts every stack, then looks them up at random, counting in
+// each site; reports the time per operation of each, and the memory
+// the tables take. No locks are taken, to compare the tables alone.
+static void BenchLookups(uint32_t nstacks) {
+  static const uint32_t kLookups = 2000000;
+  const Stacks stacks(nstacks);
+
+  vector<uint32_t> order(kLookups);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (uint32_t i = 0; i < kLookups; ++i)
+    order[i] = Next(&state) % nstacks;
+
+  double chained_insert, chained_lookup;
+  size_t chained_bytes;
+  {
+    ChainedTable table;
+    double start = NowSeconds();
+    for (uint32_t i = 0; i < nstacks; ++i)
+      table.FindOrInsert(stacks.hashes[i], stacks.At(i), kDepth);
+    chained_insert = (NowSeconds() - start) / nstacks;
+
+    start = NowSeconds();
+    for (uint32_t i = 0; i < kLookups; ++i) {
+      const uint32_t j = order[i];
+      table.FindOrInsert(stacks.hashes[j], stacks.At(j), kDepth)
+          ->alloc_objects++;
+    }
+    chained_lookup = (NowSeconds() - start) / kLookups;
+    chained_bytes = table.Bytes();
+  }
+
+  double open_insert, open_lookup;
+  size_t open_bytes;
+  {
+    Table table(1024);
+    bool inserted;
+    double start = NowSeconds();
+    for (uint32_t i = 0; i < nstacks; ++i)
+      table.Insert(stacks.hashes[i], stacks.At(i), kDepth, ~0u, &inserted);
+    open_insert = (NowSeconds() - start) / nstacks;
+
+    start = NowSeconds();
+    for (uint32_t i = 0; i < kLookups; ++i) {
+      const uint32_t j = order[i];
+      table.Find(stacks.hashes[j], stacks.At(j), kDepth)->alloc_objects++;
+    }
+    open_lookup = (NowSeconds() - start) / kLookups;
+    open_bytes = TableBytes(table);
+  }
+
+  printf("%8u stacks  insert %6.1f vs %6.1f ns  lookup %6.1f vs %6.1f ns"
+         "  memory %6.1f vs %6.1f MB\n",
+         nstacks, chained_insert * 1e9, open_insert * 1e9,
+         chained_lookup * 1e9, open_lookup * 1e9,
+         chained_bytes / 1e6, open_bytes / 1e6);
+}
+
+// As the agent counted samples before: the chained table, under a
+// lock held for the lookup and the count.
+struct LockedTable {
+  LockedTable() { pthread_mutex_init(&mutex, NULL); }
+  ~LockedTable() { pthread_mutex_destroy(&mutex); }
+
+  ChainedTable    table;
+  pthread_mutex_t mutex;
+};
+
+struct Counter {
+  const Stacks*   stacks;
+  LockedTable*    locked;  // Or,
+  Table*          table;
+  uint32_t        start, n;
+};
+
+static void* CountLocked(void* arg) {
+  const Counter* c = static_cast<Counter*>(arg);
+  const Stacks& stacks = *c->stacks;
+  for (uint32_t i = 0; i < c->n; ++i) {
+    const uint32_t j = (c->start + i * 7919) % stacks.hashes.size();
+    pthread_mutex_lock(&c->locked->mutex);
+    c->locked->table.FindOrInsert(stacks.hashes[j], stacks.At(j), kDepth)
+        ->alloc_objects++;
+    pthread_mutex_unlock(&c->locked->mutex);
+  }
+  return NULL;
+}
+
+// As the agent counts samples now: in a reader's scope, finding
+// before inserting, and counting atomically.
+static void* CountShared(void* arg) {
+  const Counter* c = static_cast<Counter*>(arg);
+  const Stacks& stacks = *c->stacks;
+  bool inserted;
+  for (uint32_t i = 0; i < c->n; ++i) {
+    const uint32_t j = (c->start + i * 7919) % stacks.hashes.size();
+    Table::Reader reader(c->table);
+    Table::Site* s = c->table->Find(stacks.hashes[j], stacks.At(j), kDepth);
+    if (s == NULL) {
+      s = c->table->Insert(
+          stacks.hashes[j], stacks.At(j), kDepth, ~0u, &inserted);
+    }
+    __sync_add_and_fetch(&s->alloc_objects, 1);
+  }
+  return NULL;
+}
+
+static double RunThreads(void* (*count)(void*), const Stacks& stacks,
+                         LockedTable* locked, Table* table,
+                         int nthreads, uint32_t ops) {
+  vector<pthread_t> threads(nthreads);
+  vector<Counter> counters(nthreads);
+  const double start = NowSeconds();
+  for (int i = 0; i < nthreads; ++i) {
+    Counter c = { &stacks, locked, table, i * 104729u, ops / nthreads };
+    counters[i] = c;
+    pthread_create(&threads[i], NULL, count, &counters[i]);
+  }
+  for (int i = 0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+  return (NowSeconds() - start) / ops;
+}
+
+// Threads sampling the same 10,000 stacks at once; reports the wall
+// time per sample, across all threads.
+static void BenchContention(int nthreads) {
+  static const uint32_t kOps = 4000000;
+  static const Stacks stacks(10000);
+
+  LockedTable locked;
+  Table table(1024);
+  const double locked_time =
+      RunThreads(CountLocked, stacks, &locked, NULL, nthreads, kOps);
+  const double shared_time =
+      RunThreads(CountShared, stacks, NULL, &table, nthreads, kOps);
+
+  printf("%8d threads  sample %6.1f vs %6.1f ns\n",
+         nthreads, locked_time * 1e9, shared_time * 1e9);
+}
+
+int
+main()
+{
+  printf("# chained vs site table, stacks of %d frames\n", kDepth);
+  BenchLookups(1000);
+  BenchLookups(10000);
+  BenchLookups(100000);
+  BenchLookups(1000000);
+
+  printf("# locked chained vs site table with readers, 10000 stacks\n");
+  for (int n = 1; n <= 64; n *= 2)
+    BenchContention(n);
+  return 0;
+}
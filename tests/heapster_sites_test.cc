@@ -0,0 +1,352 @@
+// Tests the site table, alone and with threads racing to insert the
+// same stacks or to count in sites being reclaimed, and the packing
+// of sampled objects' tags.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <set>
+#include <vector>
+
+#include "heapster_sites.h"
+
+using namespace std;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+typedef SiteTable<uint64_t> Table;
+
+// Stack i is i+1, i+2, ... i+1+i%5, so that stacks share frames and
+// have different depths; h collides often when coarse is set.
+static vector<uint64_t> Stack(uint32_t i) {
+  vector<uint64_t> frames;
+  for (uint32_t j = 0; j <= i % 5; ++j)
+    frames.push_back(i + 1 + j);
+  return frames;
+}
+
+static long Hash(uint32_t i, bool coarse) {
+  return coarse ? i % 7 + 1 : static_cast<long>(i) * 0x9e3779b97f4a7c15LL;
+}
+
+static Table::Site* Insert(Table* table, uint32_t i, bool coarse,
+                           uint32_t max_size, bool* inserted) {
+  const vector<uint64_t> frames = Stack(i);
+  return table->Insert(Hash(i, coarse), &frames[0], frames.size(), max_size,
+                       inserted);
+}
+
+static Table::Site* Find(Table* table, uint32_t i, bool coarse) {
+  const vector<uint64_t> frames = Stack(i);
+  return table->Find(Hash(i, coarse), &frames[0], frames.size());
+}
+
+static void TestPacksTags() {
+  const int64_t tag = MakeSiteTag(130, kMaxSites - 1, 1001);
+  CHECK(tag > 0);
+  CHECK(SiteTagEpoch(tag) == 130 % 128);
+  CHECK(SiteTagIndex(tag) == kMaxSites - 1);
+  CHECK(SiteTagSize(tag) == 1008);
+
+  const int64_t big = MakeSiteTag(0, 0, 0xffffffffLL << 3);
+  CHECK(big > 0);
+  CHECK(SiteTagEpoch(big) == 0);
+  CHECK(SiteTagIndex(big) == 0);
+  CHECK(SiteTagSize(big) == 0xffffffffLL << 3);
+}
+
+static void TestInsertsAndFinds() {
+  for (int coarse = 0; coarse < 2; ++coarse) {
+    Table table(4);
+    for (uint32_t i = 0; i < 1000; ++i) {
+      bool inserted;
+      Table::Site* s = Insert(&table, i, coarse, ~0u, &inserted);
+      CHECK(s != NULL && inserted);
+      CHECK(s->index == i);
+      CHECK(table.ByIndex(i) == s);
+    }
+    CHECK(table.size() == 1000);
+    CHECK(table.slots()->capacity >= 2000);
+
+    for (uint32_t i = 0; i < 1000; ++i) {
+      bool inserted;
+      Table::Site* s = Find(&table, i, coarse);
+      CHECK(s != NULL && s->index == i);
+      CHECK(s->nframes == static_cast<int>(i % 5 + 1));
+      CHECK(s->stack[0] == i + 1);
+      CHECK(Insert(&table, i, coarse, ~0u, &inserted) == s && !inserted);
+    }
+    CHECK(Find(&table, 1000, coarse) == NULL);
+    CHECK(table.size() == 1000);
+  }
+}
+
+static void TestStopsAtMaxSize() {
+  Table table(4);
+  bool inserted;
+  for (uint32_t i = 0; i < 10; ++i)
+    CHECK(Insert(&table, i, false, 10, &inserted) != NULL && inserted);
+  CHECK(Insert(&table, 10, false, 10, &inserted) == NULL && !inserted);
+  CHECK(Insert(&table, 3, false, 10, &inserted) != NULL && !inserted);
+  CHECK(table.size() == 10);
+}
+
+struct Racer {
+  Table*   table;
+  uint32_t first;
+  uint32_t nstacks;
+  bool     coarse;
+  uint32_t inserted;
+  vector<Table::Site*> sites;
+};
+
+static void* Race(void* arg) {
+  Racer* r = static_cast<Racer*>(arg);
+  r->inserted = 0;
+  r->sites.resize(r->nstacks);
+  for (uint32_t n = 0; n < r->nstacks; ++n) {
+    const uint32_t i = (r->first + n) % r->nstacks;
+    bool inserted;
+    r->sites[i] = Insert(r->table, i, r->coarse, ~0u, &inserted);
+    r->inserted += inserted;
+  }
+  return NULL;
+}
+
+// Threads start at different stacks, so that they both race to
+// insert the same ones and grow the table under each other.
+static void TestInsertsOnceUnderRaces() {
+  static const int kThreads = 8;
+  static const uint32_t kStacks = 20000;
+
+  for (int coarse = 0; coarse < 2; ++coarse) {
+    Table table(4);
+    pthread_t threads[kThreads];
+    Racer racers[kThreads];
+    const uint32_t nstacks = coarse ? kStacks / 10 : kStacks;
+    for (int t = 0; t < kThreads; ++t) {
+      racers[t].table = &table;
+      racers[t].first = t * 997;
+      racers[t].nstacks = nstacks;
+      racers[t].coarse = coarse;
+      CHECK(pthread_create(&threads[t], NULL, Race, &racers[t]) == 0);
+    }
+
+    uint32_t inserted = 0;
+    for (int t = 0; t < kThreads; ++t) {
+      CHECK(pthread_join(threads[t], NULL) == 0);
+      inserted += racers[t].inserted;
+    }
+    CHECK(inserted == nstacks);
+    CHECK(table.size() == nstacks);
+
+    set<uint32_t> indices;
+    for (uint32_t i = 0; i < nstacks; ++i) {
+      Table::Site* s = Find(&table, i, coarse);
+      CHECK(s != NULL);
+      for (int t = 0; t < kThreads; ++t)
+        CHECK(racers[t].sites[i] == s);
+      CHECK(table.ByIndex(s->index) == s);
+      indices.insert(s->index);
+    }
+    CHECK(indices.size() == nstacks);
+
+    uint32_t found = 0;
+    const Table::Slots* slots = table.slots();
+    for (uint32_t i = 0; i < slots->capacity; ++i)
+      found += slots->At(i) != NULL;
+    CHECK(found == nstacks);
+  }
+}
+
+// Reclaims the sites of the stacks it's told to, totting up their
+// counts.
+class TestReclaimer : public Table::Reclaimer {
+ public:
+  explicit TestReclaimer(uint32_t modulus, bool reuse = true)
+      : modulus_(modulus), reuse_(reuse), calls_(0), objects_(0) {}
+
+  virtual bool ShouldReclaim(const Table::Site* s) {
+    return s->stack[0] % modulus_ == 0;
+  }
+
+  virtual void Reclaimed(Table::Site* const* sites, size_t n) {
+    ++calls_;
+    for (size_t i = 0; i < n; ++i) {
+      objects_ += sites[i]->alloc_objects;
+      indices_.insert(sites[i]->index);
+    }
+  }
+
+  virtual bool ReuseIndices() { return reuse_; }
+
+  int calls() const { return calls_; }
+  int64_t objects() const { return objects_; }
+  const set<uint32_t>& indices() const { return indices_; }
+
+ private:
+  uint32_t      modulus_;
+  bool          reuse_;
+  int           calls_;
+  int64_t       objects_;
+  set<uint32_t> indices_;
+};
+
+static void TestReclaimsAndReusesIndices() {
+  Table table(4);
+  bool inserted;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    Table::Site* s = Insert(&table, i, false, ~0u, &inserted);
+    s->alloc_objects = 1;
+  }
+
+  // Stacks of odd i start with even frames.
+  TestReclaimer reclaimer(2);
+  CHECK(table.Reclaim(&reclaimer) == 500);
+  CHECK(reclaimer.calls() == 1);
+  CHECK(reclaimer.objects() == 500);
+  CHECK(table.size() == 500);
+  CHECK(table.slots()->capacity == 1024);
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    Table::Site* s = Find(&table, i, false);
+    CHECK((s == NULL) == (i % 2 == 1));
+    CHECK((table.ByIndex(i) == NULL) == (i % 2 == 1));
+  }
+
+  // New sites take the freed numbers before any new one.
+  set<uint32_t> reused;
+  for (uint32_t i = 1000; i < 1500; ++i) {
+    Table::Site* s = Insert(&table, i, false, ~0u, &inserted);
+    CHECK(s != NULL && inserted);
+    CHECK(reclaimer.indices().count(s->index) == 1);
+    CHECK(table.ByIndex(s->index) == s);
+    reused.insert(s->index);
+  }
+  CHECK(reused.size() == 500);
+  CHECK(Insert(&table, 1500, false, ~0u, &inserted)->index == 1000);
+
+  TestReclaimer none(1 << 30);
+  CHECK(table.Reclaim(&none) == 0);
+  CHECK(none.calls() == 0);
+  CHECK(table.size() == 1001);
+}
+
+// Indices the reclaimer won't have reused yet are held until one
+// that will.
+static void TestHoldsIndices() {
+  Table table(4);
+  bool inserted;
+  for (uint32_t i = 0; i < 100; ++i)
+    Insert(&table, i, false, ~0u, &inserted);
+
+  TestReclaimer hold(2, false);
+  CHECK(table.Reclaim(&hold) == 50);
+  for (uint32_t i = 100; i < 150; ++i)
+    CHECK(Insert(&table, i, false, ~0u, &inserted)->index == i);
+
+  TestReclaimer none(1 << 30);
+  CHECK(table.Reclaim(&none) == 0);
+  set<uint32_t> reused;
+  for (uint32_t i = 150; i < 200; ++i) {
+    Table::Site* s = Insert(&table, i, false, ~0u, &inserted);
+    CHECK(hold.indices().count(s->index) == 1);
+    reused.insert(s->index);
+  }
+  CHECK(reused.size() == 50);
+}
+
+struct Counter {
+  Table*   table;
+  uint32_t first;
+  uint32_t nstacks;
+  volatile bool* done;
+  int64_t  counted;
+};
+
+// Counts in sites (as samplers do), through lookups, inserts and tags
+// alike, while they're being reclaimed.
+static void* Count(void* arg) {
+  Counter* c = static_cast<Counter*>(arg);
+  c->counted = 0;
+  for (uint32_t n = 0; !*c->done; ++n) {
+    const uint32_t i = (c->first + n) % c->nstacks;
+    Table::Reader reader(c->table);
+    bool inserted;
+    Table::Site* s = Insert(c->table, i, false, ~0u, &inserted);
+    CHECK(s != NULL);
+    CHECK(s->stack[0] == i + 1);
+    __sync_add_and_fetch(&s->alloc_objects, 1);
+
+    Table::Site* by_index = c->table->ByIndex(s->index);
+    CHECK(by_index == s || by_index == NULL);
+    ++c->counted;
+  }
+  return NULL;
+}
+
+static void TestCountsSurviveReclaims() {
+  static const int kThreads = 4;
+  static const uint32_t kStacks = 5000;
+
+  Table table(4);
+  volatile bool done = false;
+  pthread_t threads[kThreads];
+  Counter counters[kThreads];
+  for (int t = 0; t < kThreads; ++t) {
+    counters[t].table = &table;
+    counters[t].first = t * 1231;
+    counters[t].nstacks = kStacks;
+    counters[t].done = &done;
+    CHECK(pthread_create(&threads[t], NULL, Count, &counters[t]) == 0);
+  }
+
+  TestReclaimer reclaimer(3);
+  for (int round = 0; round < 50; ++round)
+    table.Reclaim(&reclaimer);
+  done = true;
+
+  int64_t counted = 0;
+  for (int t = 0; t < kThreads; ++t) {
+    CHECK(pthread_join(threads[t], NULL) == 0);
+    counted += counters[t].counted;
+  }
+
+  int64_t kept = 0;
+  set<uint32_t> indices;
+  const Table::Slots* slots = table.slots();
+  for (uint32_t i = 0; i < slots->capacity; ++i) {
+    const Table::Site* s = slots->At(i);
+    if (s == NULL)
+      continue;
+    kept += s->alloc_objects;
+    CHECK(table.ByIndex(s->index) == s);
+    indices.insert(s->index);
+  }
+  CHECK(indices.size() == table.size());
+  CHECK(kept + reclaimer.objects() == counted);
+}
+
+int
+main()
+{
+  TestPacksTags();
+  TestInsertsAndFinds();
+  TestStopsAtMaxSize();
+  TestInsertsOnceUnderRaces();
+  TestReclaimsAndReusesIndices();
+  TestHoldsIndices();
+  TestCountsSurviveReclaims();
+
+  printf("PASS\n");
+  return 0;
+}
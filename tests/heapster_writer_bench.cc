@@ -0,0 +1,204 @@
+// Benchmarks writing out a text profile: building it in a string,
+// as the agent did before, then writing that out, or streaming it
+// through a ProfileWriter. Each is run in a child of its own, for
+// its peak RSS; a child that only makes the sites gives the base
+// line, which is taken off.
+//
+//   $ make bench
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+using namespace std;
+
+#ifdef __x86_64
+#define FRAME_FORMAT "0x%016lx"
+#else
+#define FRAME_FORMAT "0x%08lx"
+#endif
+
+static const int kDepth = 16;
+static const uint32_t kMethods = 10000;
+
+static double NowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct Site {
+  long long inuse_objects, inuse_bytes, alloc_objects, alloc_bytes;
+  uintptr_t stack[kDepth];
+};
+
+struct Profile {
+  explicit Profile(uint32_t nsites) : sites(nsites), names(kMethods) {
+    uint64_t state = 88172645463325252ULL;
+    for (uint32_t i = 0; i < nsites; ++i) {
+      Site* s = &sites[i];
+      s->inuse_objects = i % 100;
+      s->inuse_bytes = s->inuse_objects * 24;
+      s->alloc_objects = i % 1000 + 1;
+      s->alloc_bytes = s->alloc_objects * 24;
+      for (int j = 0; j < kDepth; ++j) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        s->stack[j] = 0x7f0000000000ULL + (state % kMethods) * 8;
+      }
+    }
+    for (uint32_t i = 0; i < kMethods; ++i)
+      names[i] = StringPrintf("Lcom/example/Class%u;method%u", i / 10, i);
+  }
+
+  uintptr_t Method(uint32_t i) const { return 0x7f0000000000ULL + i * 8; }
+
+  vector<Site>   sites;
+  vector<string> names;
+};
+
+static string FrameAddress(uintptr_t frame) {
+  return StringPrintf(FRAME_FORMAT, frame);
+}
+
+static void WriteString(const Profile& profile, int fd) {
+  string prof = "";
+  prof += "--- symbol\nbinary=heapster\n";
+  for (uint32_t i = 0; i < kMethods; ++i)
+    prof += FrameAddress(profile.Method(i)) + " " + profile.names[i] + "\n";
+  prof += "---\n";
+  prof += "--- heap\n";
+
+  long long total_inuse_objects = 0, total_inuse_bytes = 0;
+  long long total_alloc_objects = 0, total_alloc_bytes = 0;
+  string records;
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    const Site& s = profile.sites[n];
+    total_inuse_objects += s.inuse_objects;
+    total_inuse_bytes += s.inuse_bytes;
+    total_alloc_objects += s.alloc_objects;
+    total_alloc_bytes += s.alloc_bytes;
+    records += StringPrintf("%6lld: %8lld [%6lld: %8lld] @",
+                            s.inuse_objects, s.inuse_bytes,
+                            s.alloc_objects, s.alloc_bytes);
+    for (int i = 0; i < kDepth; ++i)
+      records += " " + FrameAddress(s.stack[i]);
+    records += "\n";
+  }
+
+  prof += StringPrintf("heap profile: %6lld: %8lld [%6lld: %8lld] "
+                       "@ heapprofile\n",
+                       total_inuse_objects, total_inuse_bytes,
+                       total_alloc_objects, total_alloc_bytes);
+  prof += records;
+
+  FdSink sink(fd);
+  sink.Write(prof.data(), prof.size());
+}
+
+static void WriteStreamed(const Profile& profile, int fd) {
+  FdSink sink(fd);
+  ProfileWriter out(&sink);
+  out.Append("--- symbol\nbinary=heapster\n");
+  for (uint32_t i = 0; i < kMethods; ++i)
+    out.Printf(FRAME_FORMAT " %s\n", profile.Method(i), profile.names[i].c_str());
+  out.Append("---\n");
+  out.Append("--- heap\n");
+
+  long long total_inuse_objects = 0, total_inuse_bytes = 0;
+  long long total_alloc_objects = 0, total_alloc_bytes = 0;
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    const Site& s = profile.sites[n];
+    total_inuse_objects += s.inuse_objects;
+    total_inuse_bytes += s.inuse_bytes;
+    total_alloc_objects += s.alloc_objects;
+    total_alloc_bytes += s.alloc_bytes;
+  }
+
+  out.Printf("heap profile: %6lld: %8lld [%6lld: %8lld] @ heapprofile\n",
+             total_inuse_objects, total_inuse_bytes,
+             total_alloc_objects, total_alloc_bytes);
+  for (size_t n = 0; n < profile.sites.size(); ++n) {
+    const Site& s = profile.sites[n];
+    out.Printf("%6lld: %8lld [%6lld: %8lld] @",
+               s.inuse_objects, s.inuse_bytes,
+               s.alloc_objects, s.alloc_bytes);
+    for (int i = 0; i < kDepth; ++i)
+      out.Printf(" " FRAME_FORMAT, s.stack[i]);
+    out.Append("\n");
+  }
+  out.Flush();
+}
+
+// Runs a writer (or, given none, nothing) over the sites in a child;
+// returns its time, and its peak RSS in kB.
+static double RunChild(void (*write)(const Profile&, int), uint32_t nsites,
+                       long* maxrss) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    const Profile profile(nsites);
+    const int fd = open("/dev/null", O_WRONLY);
+    const double start = NowSeconds();
+    if (write != NULL)
+      write(profile, fd);
+    const double seconds = NowSeconds() - start;
+    FdSink(fds[1]).Write(reinterpret_cast<const char*>(&seconds),
+                         sizeof(seconds));
+    _exit(0);
+  }
+
+  close(fds[1]);
+  double seconds = 0;
+  if (read(fds[0], &seconds, sizeof(seconds)) != sizeof(seconds))
+    seconds = -1;
+  close(fds[0]);
+
+  struct rusage usage;
+  int status;
+  wait4(pid, &status, 0, &usage);
+  *maxrss = usage.ru_maxrss;
+  return seconds;
+}
+
+static void BenchWriters(uint32_t nsites) {
+  long base_rss, string_rss, streamed_rss;
+  RunChild(NULL, nsites, &base_rss);
+  const double string_time = RunChild(WriteString, nsites, &string_rss);
+  const double streamed_time = RunChild(WriteStreamed, nsites, &streamed_rss);
+
+  printf("%8u sites  dump %7.1f vs %7.1f ms  peak RSS +%7.1f vs +%7.1f MB\n",
+         nsites, string_time * 1e3, streamed_time * 1e3,
+         (string_rss - base_rss) / 1024.0,
+         (streamed_rss - base_rss) / 1024.0);
+}
+
+int
+main()
+{
+  printf("# string vs streamed, stacks of %d frames, to /dev/null\n",
+         kDepth);
+  BenchWriters(10000);
+  BenchWriters(100000);
+  BenchWriters(1000000);
+  return 0;
+}
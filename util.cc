@@ -1,9 +1,20 @@
 // Lifted from google-perftools.
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
 #include <string>
+#include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <cstdio>
 
+#include "util.h"
+
 using namespace std;
 
 string StringPrintf(const char* format, ...) {
@@ -14,3 +25,239 @@ string StringPrintf(const char* format, ...) {
   va_end(ap);
   return buf;  // implicit conversion
 }
+
+int64_t MonotonicMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+bool SetSocketDeadline(int fd, int option, int64_t deadline_millis) {
+  const int64_t left = deadline_millis - MonotonicMillis();
+  if (left <= 0) {
+    errno = ETIMEDOUT;
+    return false;
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = left / 1000;
+  timeout.tv_usec = left % 1000 * 1000;
+  return setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout)) == 0;
+}
+
+// Bogarted from various OpenBSD.
+static size_t AtomicIO(ssize_t (*f)(int, const void*, size_t),
+                       int fd, const void* _s, size_t n) {
+  const char* s = reinterpret_cast<const char*>(_s);
+  size_t pos = 0;
+  ssize_t res;
+
+  while (n > pos) {
+    res = (f) (fd, s + pos, n - pos);
+    switch (res) {
+      case -1:
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        return 0;
+
+    case 0:
+        errno = EPIPE;
+        return pos;
+
+    default:
+        pos += (size_t)res;
+    }
+  }
+
+  return pos;
+}
+
+bool FdSink::Write(const char* data, size_t n) {
+  return AtomicIO(write, fd_, data, n) == n;
+}
+
+// Unlike AtomicIO, gives up when a send times out (with EAGAIN);
+// each send may only wait for what's left until the deadline.
+bool SocketSink::Write(const char* data, size_t n) {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;  // The socket has SO_NOSIGPIPE set instead.
+#endif
+
+  while (n > 0) {
+    if (!SetSocketDeadline(fd_, SO_SNDTIMEO, deadline_millis_))
+      return false;
+
+    const ssize_t res = send(fd_, data, n, flags);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+
+    data += res;
+    n -= res;
+  }
+
+  return true;
+}
+
+GzipSink::GzipSink(Sink* sink)
+    : sink_(sink), buf_(static_cast<char*>(malloc(kBufferSize))),
+      ok_(buf_ != NULL) {
+  memset(&stream_, 0, sizeof(stream_));
+
+  // 16 + the largest window selects a gzip header and trailer.
+  if (ok_)
+    ok_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipSink::~GzipSink() {
+  deflateEnd(&stream_);
+  free(buf_);
+}
+
+bool GzipSink::Write(const char* data, size_t n) {
+  if (!ok_)
+    return false;
+
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream_.avail_in = n;
+  return Deflate(Z_NO_FLUSH);
+}
+
+bool GzipSink::Finish() {
+  if (!ok_)
+    return false;
+
+  stream_.next_in = NULL;
+  stream_.avail_in = 0;
+  return Deflate(Z_FINISH);
+}
+
+// Compresses the pending input, handing the output to the sink
+// whenever our buffer fills up.
+bool GzipSink::Deflate(int flush) {
+  int res;
+
+  do {
+    stream_.next_out = reinterpret_cast<Bytef*>(buf_);
+    stream_.avail_out = kBufferSize;
+
+    res = deflate(&stream_, flush);
+    if (res == Z_STREAM_ERROR)
+      return ok_ = false;
+
+    const size_t n = kBufferSize - stream_.avail_out;
+    if (n > 0 && !sink_->Write(buf_, n))
+      return ok_ = false;
+  } while (stream_.avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+
+  return true;
+}
+
+void ProtoBuffer::Varint(uint64_t v) {
+  while (v >= 0x80) {
+    data_ += static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  data_ += static_cast<char>(v);
+}
+
+// Wire types.
+enum { kVarint = 0, kLengthDelimited = 2 };
+
+void ProtoBuffer::Int(int field, int64_t v) {
+  Varint(field << 3 | kVarint);
+  Varint(v);
+}
+
+void ProtoBuffer::Bytes(int field, const char* data, size_t n) {
+  Varint(field << 3 | kLengthDelimited);
+  Varint(n);
+  data_.append(data, n);
+}
+
+ProfileWriter::ProfileWriter(Sink* sink)
+    : sink_(sink), buf_(static_cast<char*>(malloc(kBufferSize))),
+      used_(0), ok_(buf_ != NULL) {}
+
+ProfileWriter::~ProfileWriter() {
+  Flush();
+  free(buf_);
+}
+
+void ProfileWriter::Append(const char* data, size_t n) {
+  if (!ok_)
+    return;
+
+  if (used_ + n > kBufferSize && !Flush())
+    return;
+
+  // Too big to buffer at all; pass it straight through.
+  if (n > kBufferSize) {
+    ok_ = sink_->Write(data, n);
+    return;
+  }
+
+  memcpy(buf_ + used_, data, n);
+  used_ += n;
+}
+
+void ProfileWriter::Append(const char* s) {
+  Append(s, strlen(s));
+}
+
+void ProfileWriter::Append(const string& s) {
+  Append(s.data(), s.size());
+}
+
+void ProfileWriter::Printf(const char* format, ...) {
+  if (!ok_)
+    return;
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    va_list ap;
+    va_start(ap, format);
+    const int n = vsnprintf(buf_ + used_, kBufferSize - used_, format, ap);
+    va_end(ap);
+
+    if (n < 0) {
+      ok_ = false;
+      return;
+    }
+
+    if (used_ + n < kBufferSize) {
+      used_ += n;
+      return;
+    }
+
+    // It didn't fit; try again in an empty buffer.
+    if (attempt == 0 && !Flush())
+      return;
+  }
+
+  // Larger than our whole buffer.
+  va_list ap;
+  va_start(ap, format);
+  char* s = NULL;
+  const int n = vasprintf(&s, format, ap);
+  va_end(ap);
+
+  if (n < 0) {
+    ok_ = false;
+    return;
+  }
+
+  Append(s, n);
+  free(s);
+}
+
+bool ProfileWriter::Flush() {
+  if (ok_ && used_ > 0)
+    ok_ = sink_->Write(buf_, used_);
+
+  used_ = 0;
+  return ok_;
+}
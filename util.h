@@ -1,6 +1,124 @@
 #ifndef HEAPSTER_UTIL_H_
 #define HEAPSTER_UTIL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <string>
+
 std::string StringPrintf(const char* format, ...);
 
+// Milliseconds on a clock that never goes back.
+int64_t MonotonicMillis();
+
+// Sets a socket's SO_RCVTIMEO or SO_SNDTIMEO to the time left until
+// a deadline (in MonotonicMillis); returns false, with errno set to
+// ETIMEDOUT, once it has passed.
+bool SetSocketDeadline(int fd, int option, int64_t deadline_millis);
+
+// Where profiles are written to, in chunks.
+class Sink {
+ public:
+  virtual ~Sink() {}
+
+  // Returns false if the data couldn't be written.
+  virtual bool Write(const char* data, size_t n) = 0;
+};
+
+// Writes to a file descriptor, which it doesn't own.
+class FdSink : public Sink {
+ public:
+  explicit FdSink(int fd) : fd_(fd) {}
+
+  virtual bool Write(const char* data, size_t n);
+
+ private:
+  int fd_;
+};
+
+// Writes to a connected socket, which it doesn't own; a peer that
+// goes away makes writes fail, rather than raising SIGPIPE, as does
+// one that hasn't taken everything by the deadline.
+class SocketSink : public Sink {
+ public:
+  SocketSink(int fd, int64_t deadline_millis)
+      : fd_(fd), deadline_millis_(deadline_millis) {}
+
+  virtual bool Write(const char* data, size_t n);
+
+ private:
+  int     fd_;
+  int64_t deadline_millis_;
+};
+
+// Compresses into another sink, in the gzip format. Finish must be
+// called to write out the end of the stream.
+class GzipSink : public Sink {
+ public:
+  explicit GzipSink(Sink* sink);
+  virtual ~GzipSink();
+
+  virtual bool Write(const char* data, size_t n);
+  bool Finish();
+
+ private:
+  static const size_t kBufferSize = 64 << 10;
+
+  bool Deflate(int flush);
+
+  Sink*    sink_;
+  z_stream stream_;
+  char*    buf_;
+  bool     ok_;
+};
+
+// Encodes protocol buffer messages, a field at a time, into a
+// buffer that can be reused (after clear()) to avoid allocating for
+// each message. Packed repeated fields are encoded as the varints
+// of another buffer, and written with Bytes.
+class ProtoBuffer {
+ public:
+  void Varint(uint64_t v);
+  void Int(int field, int64_t v);
+  void Bytes(int field, const char* data, size_t n);
+  void Bytes(int field, const std::string& s) {
+    Bytes(field, s.data(), s.size());
+  }
+  void Bytes(int field, const ProtoBuffer& message) {
+    Bytes(field, message.data());
+  }
+
+  const std::string& data() const { return data_; }
+  void clear() { data_.clear(); }
+
+ private:
+  std::string data_;
+};
+
+// Formats into a fixed buffer, handing it to a sink whenever it
+// fills up, so that output of any size takes bounded memory. Once a
+// write fails, the rest are dropped; see ok().
+class ProfileWriter {
+ public:
+  explicit ProfileWriter(Sink* sink);
+  ~ProfileWriter();
+
+  void Append(const char* data, size_t n);
+  void Append(const char* s);
+  void Append(const std::string& s);
+  void Printf(const char* format, ...)
+      __attribute__((format(printf, 2, 3)));
+
+  bool Flush();
+  bool ok() const { return ok_; }
+
+ private:
+  static const size_t kBufferSize = 64 << 10;
+
+  Sink*  sink_;
+  char*  buf_;
+  size_t used_;
+  bool   ok_;
+};
+
 #endif  // HEAPSTER_UTIL_H_